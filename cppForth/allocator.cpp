@@ -0,0 +1,297 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "allocator.hpp"
+
+namespace SM {
+
+// constant initialized: operator new can run before the static constructors
+static HeapAllocator        heap_;
+
+__thread IAllocator*        __current_allocator__   = nullptr;
+
+IAllocator*
+heapAllocator() {
+    return &heap_;
+}
+
+IAllocator::~IAllocator() {}
+
+////////////////////////////////////////////////////////////////////////////////
+// heap
+////////////////////////////////////////////////////////////////////////////////
+HeapAllocator::~HeapAllocator() {}
+
+void*
+HeapAllocator::allocate(size_t bytes) {
+    if( !charge(bytes) ) {
+        return nullptr;
+    }
+    return malloc(bytes);
+}
+
+void*
+HeapAllocator::reallocate(void* p, size_t oldBytes, size_t newBytes) {
+    if( newBytes > oldBytes && !charge(newBytes - oldBytes) ) {
+        return nullptr;
+    }
+
+    void*   q   = realloc(p, newBytes);
+    if( q == nullptr && newBytes != 0 ) {
+        // p is still there with its old size
+        if( newBytes > oldBytes ) {
+            credit(newBytes - oldBytes);
+        }
+        return nullptr;
+    }
+
+    if( newBytes < oldBytes ) {
+        credit(oldBytes - newBytes);
+    }
+    return q;
+}
+
+void
+HeapAllocator::deallocate(void* p, size_t bytes) {
+    if( p ) {
+        credit(bytes);
+        free(p);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// arena
+////////////////////////////////////////////////////////////////////////////////
+ArenaAllocator::ArenaAllocator(IAllocator* parent, size_t chunkSize) :
+    parent_(parent ? parent : heapAllocator()),
+    chunkSize_(chunkSize),
+    chunks_(nullptr),
+    top_(nullptr),
+    end_(nullptr),
+    last_(nullptr) {
+}
+
+ArenaAllocator::~ArenaAllocator() {
+    reset();
+}
+
+bool
+ArenaAllocator::newChunk(size_t bytes) {
+    size_t  size    = bytes > chunkSize_ ? bytes : chunkSize_;
+    size_t  total   = align(sizeof(Chunk)) + size;
+
+    // the arena is charged for what it holds from the parent
+    if( !charge(total) ) {
+        return false;
+    }
+
+    Chunk*  c       = static_cast<Chunk*>(parent_->allocate(total));
+    if( c == nullptr ) {
+        credit(total);
+        return false;
+    }
+
+    c->next     = chunks_;
+    c->size     = size;
+    chunks_     = c;
+    top_        = chunkBegin(c);
+    end_        = top_ + size;
+    last_       = nullptr;
+    return true;
+}
+
+void*
+ArenaAllocator::allocate(size_t bytes) {
+    bytes   = align(bytes);
+    if( static_cast<size_t>(end_ - top_) < bytes && !newChunk(bytes) ) {
+        return nullptr;
+    }
+
+    last_   = top_;
+    top_   += bytes;
+    return last_;
+}
+
+void*
+ArenaAllocator::reallocate(void* p, size_t oldBytes, size_t newBytes) {
+    if( p == nullptr ) {
+        return allocate(newBytes);
+    }
+
+    // the last allocation grows and shrinks in place
+    if( p == last_ && static_cast<size_t>(end_ - last_) >= align(newBytes) ) {
+        top_    = last_ + align(newBytes);
+        return p;
+    }
+
+    if( newBytes <= oldBytes ) {
+        return p;
+    }
+
+    void*   n   = allocate(newBytes);
+    if( n ) {
+        memcpy(n, p, oldBytes);
+    }
+    return n;
+}
+
+void
+ArenaAllocator::deallocate(void* p, size_t) {
+    // only the last allocation is given back, the rest goes with the arena
+    if( p && p == last_ ) {
+        top_    = last_;
+        last_   = nullptr;
+    }
+}
+
+void
+ArenaAllocator::reset() {
+    while( chunks_ ) {
+        Chunk*  next    = chunks_->next;
+        size_t  total   = align(sizeof(Chunk)) + chunks_->size;
+        parent_->deallocate(chunks_, total);
+        credit(total);
+        chunks_ = next;
+    }
+
+    top_    = nullptr;
+    end_    = nullptr;
+    last_   = nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// size class pools
+////////////////////////////////////////////////////////////////////////////////
+PoolAllocator::PoolAllocator(IAllocator* parent) : parent_(parent ? parent : heapAllocator()), slabs_(nullptr) {
+    for( uint32_t c = 0; c < CLASS_COUNT; ++c ) {
+        free_[c]    = nullptr;
+    }
+}
+
+PoolAllocator::~PoolAllocator() {
+    while( slabs_ ) {
+        Slab*   next    = slabs_->next;
+        parent_->deallocate(slabs_, SLAB_SIZE);
+        credit(SLAB_SIZE);
+        slabs_  = next;
+    }
+}
+
+bool
+PoolAllocator::refill(uint32_t c) {
+    if( !charge(SLAB_SIZE) ) {
+        return false;
+    }
+
+    Slab*   slab    = static_cast<Slab*>(parent_->allocate(SLAB_SIZE));
+    if( slab == nullptr ) {
+        credit(SLAB_SIZE);
+        return false;
+    }
+
+    slab->next  = slabs_;
+    slabs_      = slab;
+
+    // the slab header takes the first block
+    size_t      block   = static_cast<size_t>(1) << (c + MIN_CLASS_SHIFT);
+    uint8_t*    first   = reinterpret_cast<uint8_t*>(slab) + (block > align(sizeof(Slab)) ? block : align(sizeof(Slab)));
+    uint8_t*    end     = reinterpret_cast<uint8_t*>(slab) + SLAB_SIZE;
+
+    for( uint8_t* b = first; b + block <= end; b += block ) {
+        FreeBlock*  fb  = reinterpret_cast<FreeBlock*>(b);
+        fb->next    = free_[c];
+        free_[c]    = fb;
+    }
+    return true;
+}
+
+void*
+PoolAllocator::allocate(size_t bytes) {
+    if( bytes > MAX_BLOCK_SIZE ) {
+        if( !charge(bytes) ) {
+            return nullptr;
+        }
+
+        void*   p   = parent_->allocate(bytes);
+        if( p == nullptr ) {
+            credit(bytes);
+        }
+        return p;
+    }
+
+    uint32_t    c   = sizeClass(bytes);
+    if( free_[c] == nullptr && !refill(c) ) {
+        return nullptr;
+    }
+
+    FreeBlock*  b   = free_[c];
+    free_[c]    = b->next;
+    return b;
+}
+
+void*
+PoolAllocator::reallocate(void* p, size_t oldBytes, size_t newBytes) {
+    if( p == nullptr ) {
+        return allocate(newBytes);
+    }
+
+    if( oldBytes > MAX_BLOCK_SIZE && newBytes > MAX_BLOCK_SIZE ) {
+        if( newBytes > oldBytes && !charge(newBytes - oldBytes) ) {
+            return nullptr;
+        }
+
+        void*   n   = parent_->reallocate(p, oldBytes, newBytes);
+        if( n == nullptr ) {
+            if( newBytes > oldBytes ) {
+                credit(newBytes - oldBytes);
+            }
+        } else if( newBytes < oldBytes ) {
+            credit(oldBytes - newBytes);
+        }
+        return n;
+    }
+
+    // same block when the size class does not change
+    if( oldBytes <= MAX_BLOCK_SIZE && newBytes <= MAX_BLOCK_SIZE && sizeClass(oldBytes) == sizeClass(newBytes) ) {
+        return p;
+    }
+
+    void*   n   = allocate(newBytes);
+    if( n ) {
+        memcpy(n, p, oldBytes < newBytes ? oldBytes : newBytes);
+        deallocate(p, oldBytes);
+    }
+    return n;
+}
+
+void
+PoolAllocator::deallocate(void* p, size_t bytes) {
+    if( p == nullptr ) {
+        return;
+    }
+
+    if( bytes > MAX_BLOCK_SIZE ) {
+        parent_->deallocate(p, bytes);
+        credit(bytes);
+        return;
+    }
+
+    uint32_t    c   = sizeClass(bytes);
+    FreeBlock*  b   = static_cast<FreeBlock*>(p);
+    b->next     = free_[c];
+    free_[c]    = b;
+}
+
+}   // namespace SM
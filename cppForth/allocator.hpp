@@ -0,0 +1,213 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __ALLOCATOR__HPP__
+#define __ALLOCATOR__HPP__
+
+#ifndef __SM_BASE__
+#   include "base.hpp"
+#endif
+
+namespace SM {
+
+///
+/// memory source of the containers and of operator new.
+///
+/// every allocator accounts the bytes it holds and can be capped: an allocation
+/// that would go over the limit returns nullptr.
+///
+struct IAllocator {
+    enum {
+        ALIGNMENT   = 16,
+    };
+
+    constexpr IAllocator() : used_(0), peak_(0), limit_(0) {}
+    virtual             ~IAllocator();
+
+    virtual void*       allocate(size_t bytes)  = 0;
+    virtual void*       reallocate(void* p, size_t oldBytes, size_t newBytes)   = 0;
+    virtual void        deallocate(void* p, size_t bytes)   = 0;
+
+    inline size_t       used() const            { return used_;     }
+    inline size_t       peak() const            { return peak_;     }
+    inline size_t       limit() const           { return limit_;    }
+    inline void         setLimit(size_t limit)  { limit_ = limit;   }   // 0: no limit
+
+    // bytes left before the limit, (size_t)-1 when unlimited
+    inline size_t
+    remaining() const {
+        return limit_ ? (used_ < limit_ ? limit_ - used_ : 0) : static_cast<size_t>(-1);
+    }
+
+    static inline size_t    align(size_t bytes) { return (bytes + ALIGNMENT - 1) & ~static_cast<size_t>(ALIGNMENT - 1); }
+
+protected:
+#ifdef FORTH_THREADS
+    // the heap is shared by the worker threads (the peak is a close estimate)
+    inline bool
+    charge(size_t bytes) {
+        size_t  used    = __atomic_add_fetch(&used_, bytes, __ATOMIC_RELAXED);
+        if( limit_ && used > limit_ ) {
+            __atomic_sub_fetch(&used_, bytes, __ATOMIC_RELAXED);
+            return false;
+        }
+        if( used > __atomic_load_n(&peak_, __ATOMIC_RELAXED) ) {
+            __atomic_store_n(&peak_, used, __ATOMIC_RELAXED);
+        }
+        return true;
+    }
+
+    inline void         credit(size_t bytes)    { __atomic_sub_fetch(&used_, bytes, __ATOMIC_RELAXED); }
+#else
+    inline bool
+    charge(size_t bytes) {
+        if( limit_ && used_ + bytes > limit_ ) {
+            return false;
+        }
+        used_  += bytes;
+        if( used_ > peak_ ) {
+            peak_   = used_;
+        }
+        return true;
+    }
+
+    inline void         credit(size_t bytes)    { used_ -= bytes; }
+#endif
+
+    size_t              used_;
+    size_t              peak_;
+    size_t              limit_;
+};
+
+///
+/// malloc/free
+///
+struct HeapAllocator : public IAllocator {
+    constexpr HeapAllocator() {}
+    ~HeapAllocator() override;
+
+    void*               allocate(size_t bytes) override;
+    void*               reallocate(void* p, size_t oldBytes, size_t newBytes) override;
+    void                deallocate(void* p, size_t bytes) override;
+};
+
+///
+/// bump pointer arena: allocations are carved from large chunks and only the last
+/// one can be freed or grown in place. Everything is released at once by reset()
+/// or the destructor, one parent free per chunk.
+///
+struct ArenaAllocator : public IAllocator, public NonCopyable {
+    enum {
+        DEFAULT_CHUNK_SIZE  = 64 * 1024,
+    };
+
+    explicit ArenaAllocator(IAllocator* parent = nullptr, size_t chunkSize = DEFAULT_CHUNK_SIZE);
+    ~ArenaAllocator() override;
+
+    void*               allocate(size_t bytes) override;
+    void*               reallocate(void* p, size_t oldBytes, size_t newBytes) override;
+    void                deallocate(void* p, size_t bytes) override;
+
+    void                reset();
+
+private:
+    struct Chunk {
+        Chunk*          next;
+        size_t          size;       // usable bytes after the header
+    };
+
+    inline uint8_t*     chunkBegin(Chunk* c) const  { return reinterpret_cast<uint8_t*>(c) + align(sizeof(Chunk)); }
+
+    bool                newChunk(size_t bytes);
+
+    IAllocator*         parent_;
+    size_t              chunkSize_;
+    Chunk*              chunks_;    // current chunk first
+    uint8_t*            top_;       // next free byte in the current chunk
+    uint8_t*            end_;       // end of the current chunk
+    uint8_t*            last_;      // last allocation (can be grown or freed)
+};
+
+///
+/// size class pools for small objects that are often recycled (streams, processes,
+/// short strings...). Blocks come from slabs of the parent and go back to a free
+/// list, bigger requests are forwarded to the parent.
+///
+struct PoolAllocator : public IAllocator, public NonCopyable {
+    enum {
+        CLASS_COUNT     = 6,            // 16, 32, 64, 128, 256, 512 bytes
+        MIN_CLASS_SHIFT = 4,
+        MAX_BLOCK_SIZE  = 512,
+        SLAB_SIZE       = 16 * 1024,
+    };
+
+    explicit PoolAllocator(IAllocator* parent = nullptr);
+    ~PoolAllocator() override;
+
+    void*               allocate(size_t bytes) override;
+    void*               reallocate(void* p, size_t oldBytes, size_t newBytes) override;
+    void                deallocate(void* p, size_t bytes) override;
+
+private:
+    struct FreeBlock {
+        FreeBlock*      next;
+    };
+
+    struct Slab {
+        Slab*           next;
+    };
+
+    static inline uint32_t
+    sizeClass(size_t bytes) {
+        uint32_t    c   = 0;
+        size_t      s   = static_cast<size_t>(1) << MIN_CLASS_SHIFT;
+        while( s < bytes ) {
+            s <<= 1;
+            ++c;
+        }
+        return c;
+    }
+
+    bool                refill(uint32_t c);
+
+    IAllocator*         parent_;
+    FreeBlock*          free_[CLASS_COUNT];
+    Slab*               slabs_;
+};
+
+///
+/// the allocator used by the containers constructed without an explicit one and by
+/// operator new (the heap unless an AllocatorScope is active on this thread)
+///
+FORTH_API IAllocator*   heapAllocator();
+
+extern __thread IAllocator* __current_allocator__;
+
+inline IAllocator*
+currentAllocator() {
+    return __current_allocator__ ? __current_allocator__ : heapAllocator();
+}
+
+struct AllocatorScope : public NonCopyable {
+    explicit AllocatorScope(IAllocator* allocator) : prev_(__current_allocator__)  { __current_allocator__ = allocator; }
+    ~AllocatorScope()       { __current_allocator__ = prev_; }
+
+private:
+    IAllocator*         prev_;
+};
+
+}   // namespace SM
+
+#endif  // __ALLOCATOR__HPP__
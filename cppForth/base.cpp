@@ -1,28 +1,74 @@
 #include "string.hpp"
+#include "allocator.hpp"
 
 #include <stdio.h>
 
 #include "forth.hpp"
 
+static inline uint64_t
+read64(const uint8_t* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+rotl64(uint64_t v, uint32_t r) {
+	return (v << r) | (v >> (64 - r));
+}
+
 extern "C" {
-FORTH_API uint32_t __forth_hash_string__(const char* str)
+//
+// word at a time hash: 8 bytes are folded per multiply, the tail is read as one
+// partial word and the murmur3 finalizer spreads the bits
+//
+FORTH_API uint64_t __forth_hash_bytes64__(const char* str, size_t len, uint64_t seed)
 {
-	uint32_t seed = 0;
+	const uint64_t	K0	= 0x9E3779B97F4A7C15ull;
+	const uint64_t	K1	= 0xC2B2AE3D27D4EB4Full;
 
-	size_t s = SM::String(str).size();
-	for( size_t i = 0; i < s; ++i )
-	{
-		seed ^= str[i] + 0x9e3779b9 + (seed<<6) + (seed>>2);
+	const uint8_t*	p	= reinterpret_cast<const uint8_t*>(str);
+	uint64_t		h	= K0 ^ (len * K1) ^ seed;
+
+	while( len >= 8 ) {
+		h	^= read64(p) * K1;
+		h	= rotl64(h, 31) * K0;
+		p	+= 8;
+		len	-= 8;
 	}
 
-	return seed;
+	if( len ) {
+		uint64_t	tail	= 0;
+		memcpy(&tail, p, len);
+		h	^= tail * K1;
+		h	= rotl64(h, 31) * K0;
+	}
+
+	h	^= h >> 33;
+	h	*= 0xFF51AFD7ED558CCDull;
+	h	^= h >> 33;
+	h	*= 0xC4CEB9FE1A85EC53ull;
+	h	^= h >> 33;
+
+	return h;
+}
+
+FORTH_API uint32_t __forth_hash_bytes__(const char* str, size_t len)
+{
+	uint64_t	h	= __forth_hash_bytes64__(str, len, 0);
+	return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+FORTH_API uint32_t __forth_hash_string__(const char* str)
+{
+	return __forth_hash_bytes__(str, strlen(str));
 }
 
 FORTH_API uint32_t __forth_reverse_hash_string__(const char* str)
 {
 	uint32_t seed = 0;
 
-	size_t s = SM::String(str).size();
+	size_t s = strlen(str);
 	for( size_t i = 0; i < s; ++i )
 	{
 		seed ^= str[s - i - 1] + 0x9e3779b9 + (seed<<6) + (seed>>2);
@@ -33,12 +79,46 @@ FORTH_API uint32_t __forth_reverse_hash_string__(const char* str)
 
 }
 
+//
+// operator new takes its memory from the current allocator, the block header
+// remembers the allocator and the size for operator delete
+//
+struct AllocHeader {
+	SM::IAllocator*	allocator;
+	size_t			size;
+};
+
+static_assert(sizeof(AllocHeader) <= SM::IAllocator::ALIGNMENT, "the allocation header has to fit in the alignment");
+
+static inline void*
+allocObject(size_t s) {
+	SM::IAllocator*	allocator	= SM::currentAllocator();
+	size_t			total		= s + SM::IAllocator::ALIGNMENT;
+	AllocHeader*	h			= static_cast<AllocHeader*>(allocator->allocate(total));
+	if( h == nullptr ) {
+		return nullptr;
+	}
+
+	h->allocator	= allocator;
+	h->size			= total;
+	return reinterpret_cast<uint8_t*>(h) + SM::IAllocator::ALIGNMENT;
+}
+
+static inline void
+freeObject(void* p) {
+	if( p ) {
+		AllocHeader*	h	= reinterpret_cast<AllocHeader*>(static_cast<uint8_t*>(p) - SM::IAllocator::ALIGNMENT);
+		h->allocator->deallocate(h, h->size);
+	}
+}
+
 void*    operator new(size_t, void* p) NOEXCEPT  { return p; }
-void*    operator new(size_t s) NOEXCEPT     { return malloc(s); }
-void     operator delete(void* p) NOEXCEPT   { free(p);  }
-void*    operator new[](size_t s) NOEXCEPT   { return malloc(s); }
-void     operator delete[](void* p) NOEXCEPT { free(p);  }
-void     operator delete[](void* p, size_t) NOEXCEPT { free(p);  }
+void*    operator new(size_t s) NOEXCEPT     { return allocObject(s); }
+void     operator delete(void* p) NOEXCEPT   { freeObject(p);  }
+void     operator delete(void* p, size_t) NOEXCEPT   { freeObject(p);  }
+void*    operator new[](size_t s) NOEXCEPT   { return allocObject(s); }
+void     operator delete[](void* p) NOEXCEPT { freeObject(p);  }
+void     operator delete[](void* p, size_t) NOEXCEPT { freeObject(p);  }
 
 namespace SM {
 RCObject::~RCObject() {}
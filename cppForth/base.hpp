@@ -60,6 +60,7 @@
 void*    operator new(size_t, void* p) NOEXCEPT;
 void*    operator new(size_t s) NOEXCEPT;
 void     operator delete(void* p) NOEXCEPT;
+void     operator delete(void* p, size_t) NOEXCEPT;
 void*    operator new[](size_t s) NOEXCEPT;
 void     operator delete[](void* p) NOEXCEPT;
 #ifdef _MSVC_VER
@@ -88,6 +89,40 @@ struct Hash<uint32_t> {
     }
 };
 
+///
+/// move/forward without the STL
+///
+template<typename T> struct RemoveReference         { typedef T Type; };
+template<typename T> struct RemoveReference<T&>     { typedef T Type; };
+template<typename T> struct RemoveReference<T&&>    { typedef T Type; };
+
+template<typename T>
+inline typename RemoveReference<T>::Type&&
+move(T&& t) { return static_cast<typename RemoveReference<T>::Type&&>(t); }
+
+template<typename T>
+inline T&&
+forward(typename RemoveReference<T>::Type& t) { return static_cast<T&&>(t); }
+
+template<typename T>
+inline T&&
+forward(typename RemoveReference<T>::Type&& t) { return static_cast<T&&>(t); }
+
+///
+/// a trivially relocatable type can be moved to a new address with memcpy/realloc and
+/// without running its destructor at the old one. Specialize it for types that own
+/// resources through pointers only (no pointer into themselves).
+///
+template<typename T>
+struct IsTriviallyRelocatable {
+    enum { VALUE = __is_trivially_copyable(T) };
+};
+
+template<typename T>
+struct IsTriviallyDestructible {
+    enum { VALUE = __has_trivial_destructor(T) };
+};
+
 class NonCopyable
 {
 protected:
@@ -0,0 +1,83 @@
+/* 
+** Copyright (c) 2017 Wael El Oraiby.
+** 
+** This program is free software: you can redistribute it and/or modify  
+** it under the terms of the GNU Lesser General Public License as   
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but 
+** WITHOUT ANY WARRANTY; without even the implied warranty of 
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+///
+/// build tool: compiles a bootstrap source with the terminal and writes its VM image
+/// as a C++ source (FORTH_EMBEDDED_BOOTSTRAP), so the binary starts without parsing
+/// and without bootstrap.f on the disk.
+///
+///     bootgen bootstrap.f bootstrap_image.cpp
+///
+/// bootgen has to be built with the same cell width as the binary embedding the image.
+///
+#include "forth.hpp"
+#include <stdio.h>
+
+int
+main(int argc, char* argv[]) {
+    if( argc != 3 ) {
+        fprintf(stderr, "usage: %s <bootstrap.f> <output.cpp>\n", argv[0]);
+        return 1;
+    }
+
+    SM::VM*             vm  = new SM::VM();
+    SM::Vector<uint8_t> image;
+    bool                ok  = false;
+
+    {
+        SM::AllocatorScope  scope(&vm->pool());
+
+        Forth::IInputStream::Ptr coreStream = Forth::MmapFileStream::open(argv[1]);
+        if( coreStream.get() == nullptr ) {
+            fprintf(stderr, "unable to load %s\n", argv[1]);
+        } else {
+            Forth::Terminal::Ptr    term(new Forth::Terminal(vm));
+            term->loadStream(coreStream);
+            if( term->signal().ty != SM::VM::Process::Signal::NONE ) {
+                // the image would hold what was compiled before the error only
+                fprintf(stderr, "unable to compile %s (signal %d)\n", argv[1], static_cast<int>(term->signal().ty));
+            } else {
+                ok  = vm->saveImage(image);
+                if( !ok ) {
+                    fprintf(stderr, "unable to make an image of %s\n", argv[1]);
+                }
+            }
+        }
+    }
+
+    FILE*   f   = ok ? fopen(argv[2], "wb") : nullptr;
+    if( ok && f == nullptr ) {
+        fprintf(stderr, "unable to write %s\n", argv[2]);
+        ok  = false;
+    }
+
+    if( ok ) {
+        fprintf(f, "// generated by bootgen from %s, do not edit\n", argv[1]);
+        fprintf(f, "#include \"vm.hpp\"\n\n");
+        fprintf(f, "namespace SM {\n\n");
+        fprintf(f, "extern const size_t     BOOTSTRAP_IMAGE_SIZE    = %u;\n\n", static_cast<uint32_t>(image.size()));
+        fprintf(f, "alignas(16) extern const uint8_t BOOTSTRAP_IMAGE[] = {");
+        for( size_t i = 0; i < image.size(); ++i ) {
+            fprintf(f, "%s0x%02X,", (i % 16) ? " " : "\n    ", image[i]);
+        }
+        fprintf(f, "\n};\n\n}   // namespace SM\n");
+        ok  = (fclose(f) == 0);
+    }
+
+    delete vm;
+
+    return ok ? 0 : 1;
+}
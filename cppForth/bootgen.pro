@@ -0,0 +1,11 @@
+# build tool writing the image of bootstrap.f as a C++ source (see FORTH_EMBEDDED_BOOTSTRAP),
+# it shares the sources and DEFINES of the interpreter so the cell width always matches
+include(cppForth.pro)
+
+TARGET  = bootgen
+
+DEFINES -= FORTH_EMBEDDED_BOOTSTRAP
+QMAKE_EXTRA_COMPILERS -= bootgen
+
+SOURCES -= main.cpp
+SOURCES += bootgen.cpp
@@ -0,0 +1,146 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __BUILTINS__HPP__
+#define __BUILTINS__HPP__
+
+#ifndef __SM_BASE__
+#   include "base.hpp"
+#endif
+
+namespace SM {
+
+///
+/// a native word known at compile time
+///
+template<typename NATIVE>
+struct BuiltinWord {
+    const char*     name;
+    NATIVE          native;
+    bool            isImmediate;
+};
+
+///
+/// view of a compile time word table: word i has the id i, names are resolved by a
+/// perfect hash (one slot read and one compare)
+///
+template<typename NATIVE>
+struct BuiltinTable {
+    const BuiltinWord<NATIVE>*  words;
+    const uint32_t*             lengths;
+    const uint8_t*              slots;      // word index + 1, 0: empty
+    uint32_t                    count;
+    uint32_t                    mask;
+    uint32_t                    seed;
+
+    static constexpr uint32_t
+    hash(const char* str, size_t len, uint32_t seed) {
+        uint32_t    h   = 2166136261u ^ seed;
+        for( size_t i = 0; i < len; ++i ) {
+            h = (h ^ static_cast<uint8_t>(str[i])) * 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    // word id or -1
+    inline int32_t
+    find(const char* str, size_t len) const {
+        uint32_t    s   = slots[hash(str, len, seed) & mask];
+        if( s == 0 ) {
+            return -1;
+        }
+
+        uint32_t    w   = s - 1;
+        return (lengths[w] == len && memcmp(words[w].name, str, len) == 0) ? static_cast<int32_t>(w) : -1;
+    }
+};
+
+///
+/// storage of a BuiltinTable, built by the compiler: the first table is followed by
+/// the extension table (ids continue) and the hash seed is searched until no two
+/// names share a slot.
+///
+template<typename NATIVE, uint32_t N>
+struct StaticBuiltinTable {
+    enum : uint32_t {
+        COUNT       = N,
+        SLOT_COUNT  = N <= 16 ? 128 : (N <= 32 ? 256 : (N <= 64 ? 512 : 1024)),
+        MAX_SEED    = 1 << 16,
+    };
+
+    static_assert(N < 255, "word indices are stored in a byte");
+
+    constexpr
+    StaticBuiltinTable(const BuiltinWord<NATIVE>* base, uint32_t baseCount, const BuiltinWord<NATIVE>* ext, uint32_t extCount) :
+        words(),
+        lengths(),
+        slots(),
+        seed(0) {
+
+        for( uint32_t i = 0; i < baseCount; ++i ) {
+            words[i]    = base[i];
+        }
+
+        for( uint32_t i = 0; i < extCount; ++i ) {
+            words[baseCount + i]    = ext[i];
+        }
+
+        for( uint32_t i = 0; i < N; ++i ) {
+            uint32_t    len = 0;
+            while( words[i].name[len] ) {
+                ++len;
+            }
+            lengths[i]  = len;
+        }
+
+        for( uint32_t s = 1; s < MAX_SEED; ++s ) {
+            if( tryPlace(s) ) {
+                seed    = s;
+                break;
+            }
+        }
+    }
+
+    constexpr BuiltinTable<NATIVE>
+    table() const {
+        return BuiltinTable<NATIVE>{ words, lengths, slots, N, SLOT_COUNT - 1, seed };
+    }
+
+    BuiltinWord<NATIVE>     words[N];
+    uint32_t                lengths[N];
+    uint8_t                 slots[SLOT_COUNT];
+    uint32_t                seed;
+
+private:
+    constexpr bool
+    tryPlace(uint32_t s) {
+        for( uint32_t i = 0; i < SLOT_COUNT; ++i ) {
+            slots[i]    = 0;
+        }
+
+        for( uint32_t i = 0; i < N; ++i ) {
+            uint32_t    slot    = BuiltinTable<NATIVE>::hash(words[i].name, lengths[i], s) & (SLOT_COUNT - 1);
+            if( slots[slot] ) {
+                return false;
+            }
+            slots[slot] = static_cast<uint8_t>(i + 1);
+        }
+        return true;
+    }
+};
+
+}   // namespace SM
+
+#endif  // __BUILTINS__HPP__
@@ -0,0 +1,138 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __CELL__HPP__
+#define __CELL__HPP__
+
+#ifndef __SM_BASE__
+#   include "base.hpp"
+#endif
+
+///
+/// cell width of the VM stacks and constant data segment:
+///  - 32: compact cell (int32, uint32, float), pointers only on 32 bits targets
+///  - 64: NaN-boxed cell (tagged int32/uint32, double/float and 48 bits pointers)
+///
+#ifndef FORTH_CELL_WIDTH
+#   define FORTH_CELL_WIDTH 32
+#endif
+
+namespace SM {
+
+template<unsigned WIDTH>
+struct Cell;
+
+///
+/// 32 bits cell: the value is untyped, the primitive decides how to read it
+///
+template<>
+struct Cell<32> {
+    typedef uint32_t    Bits;
+
+    Cell()                      : bits_(0) {}
+    explicit Cell(uint32_t v)   : bits_(v) {}
+    explicit Cell(int32_t v)    : bits_(static_cast<uint32_t>(v)) {}
+    explicit Cell(float v)      { memcpy(&bits_, &v, sizeof(float)); }
+
+    inline uint32_t     u32() const     { return bits_; }
+    inline int32_t      i32() const     { return static_cast<int32_t>(bits_); }
+    inline float        f32() const     { float f; memcpy(&f, &bits_, sizeof(float)); return f; }
+
+#if UINTPTR_MAX == 0xFFFFFFFF
+    explicit Cell(void* v)      : bits_(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(v))) {}
+    inline void*        ptr() const     { return reinterpret_cast<void*>(static_cast<uintptr_t>(bits_)); }
+#endif
+
+    inline Bits         bits() const    { return bits_; }
+    static inline Cell  fromBits(Bits b)    { Cell c; c.bits_ = b; return c; }
+
+private:
+    Bits                bits_;
+};
+
+///
+/// 64 bits NaN-boxed cell: doubles are stored as is, everything else lives in the
+/// payload of a quiet NaN with a tag in the upper 16 bits
+///
+template<>
+struct Cell<64> {
+    typedef uint64_t    Bits;
+
+    enum Tag {
+        INT_TAG     = 0xFFF9,   // int32/uint32 in the lower 32 bits
+        PTR_TAG     = 0xFFFA,   // pointer in the lower 48 bits
+    };
+
+    Cell()                      : bits_(box(INT_TAG, 0)) {}
+    explicit Cell(uint32_t v)   : bits_(box(INT_TAG, v)) {}
+    explicit Cell(int32_t v)    : bits_(box(INT_TAG, static_cast<uint32_t>(v))) {}
+    explicit Cell(float v)      : bits_(fromDouble(static_cast<double>(v))) {}
+    explicit Cell(double v)     : bits_(fromDouble(v)) {}
+    explicit Cell(void* v)      : bits_(box(PTR_TAG, reinterpret_cast<uintptr_t>(v) & PAYLOAD_MASK)) {}
+
+    inline bool         isInt() const       { return tag() == INT_TAG; }
+    inline bool         isPtr() const       { return tag() == PTR_TAG; }
+    inline bool         isDouble() const    { return tag() < INT_TAG; }
+
+    inline uint32_t     u32() const     { return static_cast<uint32_t>(bits_); }
+    inline int32_t      i32() const     { return static_cast<int32_t>(static_cast<uint32_t>(bits_)); }
+    inline void*        ptr() const     { return reinterpret_cast<void*>(static_cast<uintptr_t>(bits_ & PAYLOAD_MASK)); }
+
+    // an int cell is read back as the float with the same bit pattern, like the 32 bits cell
+    inline float
+    f32() const {
+        if( isDouble() ) {
+            return static_cast<float>(f64());
+        }
+        float f; uint32_t b = u32(); memcpy(&f, &b, sizeof(float)); return f;
+    }
+
+    inline double
+    f64() const {
+        if( isDouble() ) {
+            double d; memcpy(&d, &bits_, sizeof(double)); return d;
+        }
+        return static_cast<double>(f32());
+    }
+
+    inline Bits         bits() const    { return bits_; }
+    static inline Cell  fromBits(Bits b)    { Cell c; c.bits_ = b; return c; }
+
+private:
+    static const uint64_t   PAYLOAD_MASK    = 0x0000FFFFFFFFFFFFull;
+    static const uint64_t   CANONICAL_NAN   = 0x7FF8000000000000ull;
+
+    static inline uint64_t  box(uint64_t tag, uint64_t payload)    { return (tag << 48) | payload; }
+    inline uint32_t         tag() const     { return static_cast<uint32_t>(bits_ >> 48); }
+
+    static inline uint64_t
+    fromDouble(double d) {
+        uint64_t b;
+        memcpy(&b, &d, sizeof(double));
+        // every NaN is folded into one that cannot collide with the tags
+        return (d != d) ? CANONICAL_NAN : b;
+    }
+
+    Bits                bits_;
+};
+
+static_assert(sizeof(Cell<32>) == 4, "32 bits cell has to be 4 bytes");
+static_assert(sizeof(Cell<64>) == 8, "64 bits cell has to be 8 bytes");
+
+typedef Cell<FORTH_CELL_WIDTH>  VMCell;
+
+}   // namespace SM
+
+#endif  // __CELL__HPP__
@@ -0,0 +1,114 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "channel.hpp"
+
+namespace SM {
+
+Channel::Channel(uint32_t capacity, Kind kind) :
+    kind_(kind),
+    sender_(0),
+    receiver_(0),
+    head_(0),
+    tail_(0) {
+    uint32_t    size    = MIN_CAPACITY;
+    while( size < capacity && size < MAX_CAPACITY ) {
+        size <<= 1;
+    }
+    mask_   = size - 1;
+
+    // the slots are touched by every thread, they do not come from a VM pool
+    slots_  = static_cast<Slot*>(heapAllocator()->allocate(sizeof(Slot) * size));
+    assert(slots_ != nullptr);
+    for( uint32_t i = 0; i < size; ++i ) {
+        new(&slots_[i]) Slot();
+        slots_[i].seq   = i;
+    }
+}
+
+Channel::~Channel() {
+    heapAllocator()->deallocate(slots_, sizeof(Slot) * (mask_ + 1));
+}
+
+bool
+Channel::trySend(Value v) {
+    if( kind_ == SPSC ) {
+        uint32_t    tail    = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+        if( tail - __atomic_load_n(&head_, __ATOMIC_ACQUIRE) > mask_ ) {
+            return false;
+        }
+
+        slots_[tail & mask_].value  = v;
+        __atomic_store_n(&tail_, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    uint32_t    pos     = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+    Slot*       slot;
+    for( ;; ) {
+        slot    = &slots_[pos & mask_];
+        int32_t     diff    = static_cast<int32_t>(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if( diff == 0 ) {
+            // free for this lap: claim it (pos is reloaded when another sender did)
+            if( __atomic_compare_exchange_n(&tail_, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+                break;
+            }
+        } else if( diff < 0 ) {
+            return false;   // still holds the value of the previous lap
+        } else {
+            pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->value = v;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool
+Channel::tryReceive(Value& v) {
+    uint32_t    head    = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+    if( kind_ == SPSC ) {
+        if( __atomic_load_n(&tail_, __ATOMIC_ACQUIRE) == head ) {
+            return false;
+        }
+
+        v   = slots_[head & mask_].value;
+        __atomic_store_n(&head_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    Slot*       slot;
+    for( ;; ) {
+        slot    = &slots_[head & mask_];
+        int32_t     diff    = static_cast<int32_t>(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (head + 1));
+        if( diff == 0 ) {
+            // written for this lap: claim it (head is reloaded when another receiver did)
+            if( __atomic_compare_exchange_n(&head_, &head, head + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+                break;
+            }
+        } else if( diff < 0 ) {
+            return false;   // not written yet
+        } else {
+            head    = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+        }
+    }
+
+    v   = slot->value;
+    __atomic_store_n(&slot->seq, head + mask_ + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+}   // namespace SM
@@ -0,0 +1,99 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __CHANNEL__HPP__
+#define __CHANNEL__HPP__
+
+#ifndef __SM_BASE__
+#   include "base.hpp"
+#endif
+
+#include "vm.hpp"
+
+namespace SM {
+
+///
+/// bounded lock free queue of cells between processes.
+///
+/// SPSC: one sender and one receiver, bound to the first process using each end
+/// (claimSender, claimReceiver). The sender owns the tail and the receiver the head,
+/// a slot is published by the release of the tail (and freed by the release of the head).
+/// MPMC: any number of senders and receivers claim a slot with a CAS on the tail or
+/// the head, each slot has a sequence number telling whether it holds a value for
+/// this lap (Vyukov's queue).
+///
+/// Neither blocks: trySend fails when the queue is full, tryReceive when it is empty.
+/// The capacity is rounded up to a power of 2.
+///
+struct Channel : public NonCopyable {
+    typedef VM::Process::Value  Value;
+
+    enum Kind {
+        SPSC                = 0,
+        MPMC                = 1,
+    };
+
+    enum : uint32_t {
+        MIN_CAPACITY        = 2,
+        MAX_CAPACITY        = 1 << 20,
+    };
+
+    Channel(uint32_t capacity, Kind kind);
+    ~Channel();
+
+    bool                trySend(Value v);
+    bool                tryReceive(Value& v);
+
+    // SPSC: false when another process has that end, always true for MPMC
+    inline bool         claimSender(uint32_t pid)   { return kind_ != SPSC || claim(sender_, pid); }
+    inline bool         claimReceiver(uint32_t pid) { return kind_ != SPSC || claim(receiver_, pid); }
+
+    // a hint when others send or receive meanwhile
+    inline bool         isEmpty() const     { return __atomic_load_n(&tail_, __ATOMIC_ACQUIRE) == __atomic_load_n(&head_, __ATOMIC_ACQUIRE); }
+    inline bool         isFull() const      { return __atomic_load_n(&tail_, __ATOMIC_ACQUIRE) - __atomic_load_n(&head_, __ATOMIC_ACQUIRE) > mask_; }
+    inline Kind         kind() const        { return kind_; }
+
+private:
+    enum {
+        CACHE_LINE          = 64,
+    };
+
+    struct Slot {
+        uint32_t            seq;        // MPMC: position + 1 once written, position + capacity once read
+        Value               value;
+    };
+
+    // owner is pid + 1 once claimed
+    static inline bool
+    claim(uint32_t& owner, uint32_t pid) {
+        uint32_t    expected    = 0;
+        return __atomic_compare_exchange_n(&owner, &expected, pid + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == pid + 1;
+    }
+
+    Kind                kind_;
+    uint32_t            mask_;
+    Slot*               slots_;
+    uint32_t            sender_;        // SPSC ends (atomic)
+    uint32_t            receiver_;
+
+    // the receiver and the senders do not share a cache line
+    uint32_t            head_;
+    uint8_t             pad_[CACHE_LINE - sizeof(uint32_t)];
+    uint32_t            tail_;
+};
+
+}   // namespace SM
+
+#endif  // __CHANNEL__HPP__
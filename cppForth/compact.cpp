@@ -0,0 +1,295 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "vm.hpp"
+
+namespace SM {
+
+int32_t
+VM::relocationAt(uint32_t addr) const {
+    size_t  lo  = 0;
+    size_t  hi  = relocations_.size();
+    while( lo < hi ) {
+        size_t  mid = (lo + hi) >> 1;
+        if( (relocations_[mid] >> 1) < addr ) {
+            lo  = mid + 1;
+        } else {
+            hi  = mid;
+        }
+    }
+
+    return (lo < relocations_.size() && (relocations_[lo] >> 1) == addr) ? static_cast<int32_t>(relocations_[lo] & 1) : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// tree shaking: mark the words reached from the roots, lay their code out in word
+// order, check every address can follow, then rewrite everything at once
+////////////////////////////////////////////////////////////////////////////////
+bool
+VM::compact(const uint32_t* roots, uint32_t count) {
+    uint32_t    funcCount   = static_cast<uint32_t>(functions_.size());
+    uint32_t    codeSize    = static_cast<uint32_t>(wordSegment_.size());
+    uint32_t    dataSize    = static_cast<uint32_t>(constDataSegment_.size());
+
+    // the literal before branch and ?branch is a code address
+    uint32_t    branchId    = NO_ADDRESS;
+    uint32_t    branchIfId  = NO_ADDRESS;
+    for( uint32_t b = 0; b < builtinCount_; ++b ) {
+        if( builtins_->words[b].native == Primitives::branch ) {
+            branchId    = b;
+        } else if( builtins_->words[b].native == Primitives::branchIf ) {
+            branchIfId  = b;
+        }
+    }
+
+    // new word ids, NO_ADDRESS for the dropped words (0 while only marked)
+    Vector<uint32_t>    newId(heapAllocator());
+    Vector<uint32_t>    work(heapAllocator());
+    newId.resize(funcCount);
+    for( uint32_t i = 0; i < funcCount; ++i ) {
+        newId[i]    = NO_ADDRESS;
+    }
+
+    for( uint32_t r = 0; r < count; ++r ) {
+        if( roots[r] >= builtinCount_ && roots[r] < wordCount() && newId[roots[r] - builtinCount_] == NO_ADDRESS ) {
+            newId[roots[r] - builtinCount_] = 0;
+            work.push_back(roots[r]);
+        }
+    }
+
+    while( work.size() ) {
+        const Function& func    = function(work.back());
+        work.pop_back();
+        if( func.isNative() || func.body.interpreted.start < 0 ) {
+            continue;
+        }
+
+        uint32_t    end     = functionEnd(func);
+        for( uint32_t pos = static_cast<uint32_t>(func.body.interpreted.start); pos < end; ++pos ) {
+            uint32_t    ref     = wordSegment_[pos];
+            if( ref == 0 && pos + 1 < end ) {
+                ++pos;
+                if( relocationAt(pos) != RELOC_WORD ) {
+                    continue;
+                }
+                ref = wordSegment_[pos];
+            }
+
+            if( ref >= builtinCount_ && ref < wordCount() && newId[ref - builtinCount_] == NO_ADDRESS ) {
+                newId[ref - builtinCount_]  = 0;
+                work.push_back(ref);
+            }
+        }
+    }
+
+    // layout: the kept words in id order, each one's code packed after the previous
+    Vector<uint32_t>    newStart(heapAllocator());
+    Vector<uint32_t>    addrMap(heapAllocator());
+    newStart.resize(funcCount);
+    addrMap.resize(codeSize);
+    for( uint32_t pos = 0; pos < codeSize; ++pos ) {
+        addrMap[pos]    = NO_ADDRESS;
+    }
+
+    uint32_t    nextId      = builtinCount_;
+    uint32_t    newSize     = 0;
+    for( uint32_t i = 0; i < funcCount; ++i ) {
+        if( newId[i] == NO_ADDRESS ) {
+            continue;
+        }
+
+        const Function& func    = functions_[i];
+        newId[i]    = nextId++;
+        newStart[i] = newSize;
+        if( func.isNative() || func.body.interpreted.start < 0 ) {
+            continue;
+        }
+
+        uint32_t    end     = functionEnd(func);
+        for( uint32_t pos = static_cast<uint32_t>(func.body.interpreted.start); pos < end; ++pos ) {
+            addrMap[pos]    = newSize++;
+        }
+    }
+
+    // the strings the kept code refers to (program data stays where it is)
+    Vector<uint32_t>    dataMap(heapAllocator());
+    if( !rawData_ ) {
+        dataMap.resize(dataSize);
+        for( uint32_t addr = 0; addr < dataSize; ++addr ) {
+            dataMap[addr]   = NO_ADDRESS;
+        }
+    }
+
+    for( uint32_t i = 0; i < funcCount; ++i ) {
+        const Function& func    = functions_[i];
+        if( newId[i] == NO_ADDRESS || func.isNative() || func.body.interpreted.start < 0 ) {
+            continue;
+        }
+
+        uint32_t    end     = functionEnd(func);
+        for( uint32_t pos = static_cast<uint32_t>(func.body.interpreted.start); pos + 1 < end; ++pos ) {
+            if( wordSegment_[pos] != 0 ) {
+                continue;
+            }
+
+            uint32_t    operand = wordSegment_[++pos];
+            int32_t     kind    = relocationAt(pos);
+            if( kind == RELOC_DATA && !rawData_ ) {
+                if( operand >= dataSize || memchr(&constDataSegment_[operand], 0, dataSize - operand) == nullptr ) {
+                    return false;
+                }
+                dataMap[operand]    = 0;
+            } else if( kind < 0 && pos + 1 < end && (wordSegment_[pos + 1] == branchId || wordSegment_[pos + 1] == branchIfId) ) {
+                if( operand >= codeSize || addrMap[operand] == NO_ADDRESS ) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    // nothing can fail from here
+    Vector<uint8_t>     data(heapAllocator());
+    if( !rawData_ ) {
+        for( uint32_t addr = 0; addr < dataSize; ++addr ) {
+            if( dataMap[addr] == NO_ADDRESS ) {
+                continue;
+            }
+
+            uint32_t    length  = static_cast<uint32_t>(strlen(dataString(addr))) + 1;
+            dataMap[addr]   = static_cast<uint32_t>(data.size());
+            data.resize(data.size() + length);
+            memcpy(&data[dataMap[addr]], &constDataSegment_[addr], length);
+        }
+    }
+
+    Vector<uint32_t>    code(heapAllocator());
+    Vector<uint32_t>    relocs(&arena_);
+    code.reserve(newSize);
+    for( uint32_t i = 0; i < funcCount; ++i ) {
+        const Function& func    = functions_[i];
+        if( newId[i] == NO_ADDRESS || func.isNative() || func.body.interpreted.start < 0 ) {
+            continue;
+        }
+
+        uint32_t    end     = functionEnd(func);
+        for( uint32_t pos = static_cast<uint32_t>(func.body.interpreted.start); pos < end; ++pos ) {
+            uint32_t    cell    = wordSegment_[pos];
+            if( cell == 0 && pos + 1 < end ) {
+                code.push_back(0);
+
+                uint32_t    operand = wordSegment_[++pos];
+                int32_t     kind    = relocationAt(pos);
+                if( kind == RELOC_WORD ) {
+                    if( operand >= builtinCount_ && operand < wordCount() ) {
+                        operand = newId[operand - builtinCount_];
+                    }
+                    relocs.push_back((static_cast<uint32_t>(code.size()) << 1) | RELOC_WORD);
+                } else if( kind == RELOC_DATA ) {
+                    if( !rawData_ ) {
+                        operand = dataMap[operand];
+                    }
+                    relocs.push_back((static_cast<uint32_t>(code.size()) << 1) | RELOC_DATA);
+                } else if( pos + 1 < end && (wordSegment_[pos + 1] == branchId || wordSegment_[pos + 1] == branchIfId) ) {
+                    operand = addrMap[operand];
+                }
+
+                code.push_back(operand);
+                continue;
+            }
+
+            if( cell >= builtinCount_ && cell < wordCount() ) {
+                cell    = newId[cell - builtinCount_];
+            }
+            code.push_back(cell);
+        }
+    }
+
+    // the names follow their words, a name whose word was dropped is free again
+    memset(shadowed_, 0, sizeof(shadowed_));
+    for( uint32_t s = 0; s < symbolWords_.size(); ++s ) {
+        int32_t     word    = symbolWords_[s];
+        if( word < 0 || static_cast<uint32_t>(word) < builtinCount_ ) {
+            continue;
+        }
+
+        uint32_t    id      = newId[static_cast<uint32_t>(word) - builtinCount_];
+        symbolWords_[s] = id == NO_ADDRESS ? -1 : static_cast<int32_t>(id);
+        if( id != NO_ADDRESS ) {
+            int32_t     builtin = builtins_->find(symbols_.name(s), symbols_.length(s));
+            if( builtin >= 0 ) {
+                shadowed_[builtin >> 5] |= 1u << (builtin & 31);
+            }
+        }
+    }
+
+    Vector<Function>    funcs(&arena_);
+    funcs.reserve(nextId - builtinCount_);
+    for( uint32_t i = 0; i < funcCount; ++i ) {
+        if( newId[i] == NO_ADDRESS ) {
+            continue;
+        }
+
+        Function    func    = SM::move(functions_[i]);
+        if( !func.isNative() && func.body.interpreted.start >= 0 ) {
+            uint32_t    length  = functionEnd(func) - static_cast<uint32_t>(func.body.interpreted.start);
+            func.body.interpreted.start = static_cast<int32_t>(newStart[i]);
+            func.body.interpreted.end   = func.body.interpreted.end ? newStart[i] + length : 0;
+#ifdef FORTH_DENSE_CODE
+            func.body.interpreted.denseStart    = -1;
+#endif
+        }
+        funcs.push_back(SM::move(func));
+    }
+    functions_  = SM::move(funcs);
+
+    wordSegment_.resize(code.size());
+    if( code.size() ) {
+        memcpy(&wordSegment_[0], code.get(), code.size() * sizeof(uint32_t));
+    }
+    relocations_        = SM::move(relocs);
+    pendingStringAt_    = NO_ADDRESS;
+
+    if( !rawData_ ) {
+        constDataSegment_.resize(data.size());
+        if( data.size() ) {
+            memcpy(&constDataSegment_[0], data.get(), data.size());
+        }
+
+        Vector<String>  dropped(heapAllocator());
+        for( HashMap<String, uint32_t>::Iterator it = stringPool_.begin(); it != stringPool_.end(); ++it ) {
+            uint32_t    addr    = it.value() < dataSize ? dataMap[it.value()] : NO_ADDRESS;
+            if( addr == NO_ADDRESS ) {
+                dropped.push_back(it.key());
+            } else {
+                it.value()  = addr;
+            }
+        }
+
+        for( size_t i = 0; i < dropped.size(); ++i ) {
+            stringPool_.erase(dropped[i]);
+        }
+    }
+
+#ifdef FORTH_DENSE_CODE
+    // the words are translated again on their next call
+    denseSegment_.clear();
+    addrMap_.clear();
+    translatedEnd_  = 0;
+#endif
+
+    return true;
+}
+
+}   // namespace SM
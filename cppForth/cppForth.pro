@@ -1,29 +1,77 @@
 TEMPLATE = app
-CONFIG += console c++11
+CONFIG += console c++14
 CONFIG -= app_bundle
 CONFIG -= qt
 #  -fno-non-call-exceptions -fno-use-cxa-get-exception-ptr
 QMAKE_CXXFLAGS  += -D_HAS_EXCEPTION=0 -fno-rtti -fno-exceptions -fno-use-cxa-atexit -ffunction-sections -fdata-sections -fno-common -DBUILDING_STATIC
 QMAKE_LFLAGS += -Wl,--gc-sections #-static -static-libgcc
 
+# reserve the stacks and segments as mmap'd regions with guard pages (POSIX only)
+#DEFINES += FORTH_VM_SEGMENTS
+
+# cell width: 32 (compact, default) or 64 (NaN-boxed ints, floats and pointers)
+#DEFINES += FORTH_CELL_WIDTH=64
+
+# execute a varint encoded copy of the code segment (smaller code, slower decode)
+#DEFINES += FORTH_DENSE_CODE
+
+# start from bootstrap.f compiled at build time (no parsing, no bootstrap.f at run time),
+# the bootgen tool has to be built first: qmake -o Makefile.bootgen bootgen.pro && make -f Makefile.bootgen
+#DEFINES += FORTH_EMBEDDED_BOOTSTRAP
+
+# run the spawned processes on $FORTH_WORKERS threads with work stealing (POSIX threads),
+# the reference counts and the heap accounting become atomic
+#DEFINES += FORTH_THREADS
+
 QMAKE_LINK  = gcc
 
 SOURCES += main.cpp \
     primitives.cpp \
     base.cpp \
+    allocator.cpp \
+    image.cpp \
+    compact.cpp \
+    output.cpp \
     streams.cpp \
     mingw_fix.c \
     terminal.cpp \
+    channel.cpp \
+    scheduler.cpp \
+    segment.cpp \
+    symbol_table.cpp \
     vm.cpp
 
 HEADERS += \
     forth.hpp \
     hash_map.hpp \
     base.hpp \
+    builtins.hpp \
+    allocator.hpp \
+    output.hpp \
+    cell.hpp \
     string.hpp \
     vector.hpp \
     intrusive-ptr.hpp \
+    channel.hpp \
+    scheduler.hpp \
+    segment.hpp \
+    symbol_table.hpp \
     vm.hpp
 
 DISTFILES += \
-    bootstrap.f
+    bootstrap.f \
+    bootgen.pro
+
+contains(DEFINES, FORTH_THREADS) {
+    LIBS   += -lpthread
+}
+
+contains(DEFINES, FORTH_EMBEDDED_BOOTSTRAP) {
+    BOOTSTRAP_SOURCES       = bootstrap.f
+    bootgen.input           = BOOTSTRAP_SOURCES
+    bootgen.output          = ${QMAKE_FILE_BASE}_image.cpp
+    bootgen.commands        = $$OUT_PWD/bootgen ${QMAKE_FILE_IN} ${QMAKE_FILE_OUT}
+    bootgen.depends         = $$OUT_PWD/bootgen
+    bootgen.variable_out    = SOURCES
+    QMAKE_EXTRA_COMPILERS  += bootgen
+}
@@ -30,20 +30,36 @@ namespace Forth {
 
 enum { MAX_BUFF = 1024 };
 
+///
+/// input streams are read by blocks: the unread part of the current block is the
+/// window [cursor(), limit()). refill() replaces the window with the next block
+/// (pointers into the previous window are invalid after) and returns false at the
+/// end of the stream. A refilled window is never empty.
+///
 struct IInputStream : public SM::RCObject {
     typedef SM::IntrusivePtr<IInputStream>  Ptr;
-    IInputStream() {}
+    IInputStream() : cur_(nullptr), end_(nullptr) {}
 
     enum class Mode {
         COMPILE,
         EVAL
     };
 
-    virtual uint32_t        peekChar()      = 0;
-    virtual uint32_t        getChar()       = 0;
+    inline const char*      cursor() const  { return cur_; }
+    inline const char*      limit() const   { return end_; }
+    inline void             seek(const char* p) { cur_ = p; }   // p in [cursor(), limit()]
+    inline bool             available()     { return cur_ != end_ || refill(); }
+
+    inline uint32_t         peekChar()      { return available() ? static_cast<uint8_t>(*cur_) : 0; }
+    inline uint32_t         getChar()       { return available() ? static_cast<uint8_t>(*cur_++) : 0; }
+
+    virtual bool            refill()        = 0;
     virtual Mode            getMode() const = 0;
     virtual void            setMode(Mode m) = 0;
     virtual                 ~IInputStream() = 0;
+
+    // the window is the whole stream and stays valid as long as the stream lives
+    virtual bool            isPersistent() const    { return false; }
     
     static inline
     bool
@@ -54,38 +70,97 @@ struct IInputStream : public SM::RCObject {
             || ch == static_cast<uint32_t>(' ')
             || ch == static_cast<uint32_t>('\a'));
     }
+
+    // first non space / first space in [p, end), end if none
+    static const char*      skipSpaces(const char* p, const char* end);
+    static const char*      findSpace(const char* p, const char* end);
+
+protected:
+    const char*             cur_;
+    const char*             end_;
 };
 
+///
+/// a file descriptor (standard input by default) read in large blocks with read(2).
+/// The next block is read only once the current one is consumed, into the same
+/// fixed buffer: memory stays flat however long the session runs, and input the VM
+/// has not caught up with stays in the pipe, blocking the producer.
+///
 struct StdInStream : public IInputStream {
-    void            testAndFillBuffer();
-    uint32_t        peekChar() override;
-    uint32_t        getChar() override;
+    enum : uint32_t {
+        BLOCK_SIZE  = 1 << 16,
+    };
+
+    bool            refill() override;
     Mode            getMode() const override;
     void            setMode(Mode m) override;
 
     ~StdInStream() override;
-    StdInStream();
+    explicit StdInStream(int fd = 0);
 
     Mode            mode;
-    uint32_t        pos;
-    SM::String      buff;
+
+private:
+    int             fd_;
+    char            block_[BLOCK_SIZE];
 };
 
 struct StringStream : public IInputStream {
-    uint32_t        peekChar() override;
-    uint32_t        getChar() override;
+    bool            refill() override;
     Mode            getMode() const override;
     void            setMode(Mode m) override;
 
+    bool            isPersistent() const override   { return true; }
+
     StringStream(const char* str);
     ~StringStream()    override;
 
 
     Mode            mode;
-    uint32_t        pos;
     SM::String      buff;
 };
 
+///
+/// a file mapped read only: the whole file is the only block, nothing is copied and
+/// only the touched pages are read
+///
+struct MmapFileStream : public IInputStream {
+    static Ptr      open(const char* path);     // nullptr when the file can not be read
+
+    bool            refill() override;
+    Mode            getMode() const override;
+    void            setMode(Mode m) override;
+    bool            isPersistent() const override   { return true; }
+
+    ~MmapFileStream() override;
+
+    Mode            mode;
+
+private:
+    MmapFileStream();
+
+    void*           base_;
+    size_t          size_;
+};
+
+///
+/// a slice [begin, end) of a persistent stream, which is kept alive by the slice
+///
+struct SpanStream : public IInputStream {
+    bool            refill() override;
+    Mode            getMode() const override;
+    void            setMode(Mode m) override;
+    bool            isPersistent() const override   { return true; }
+
+    SpanStream(IInputStream::Ptr source, const char* begin, const char* end);
+    ~SpanStream() override;
+
+    Mode            mode;
+
+private:
+    IInputStream::Ptr   source_;
+};
+
 struct Terminal : public SM::VM::Process {
     typedef SM::IntrusivePtr<Terminal>  Ptr;
 
@@ -100,33 +175,147 @@ struct Terminal : public SM::VM::Process {
         WORD_ID_OUT_OF_RANGE    = -8,
         LOCAL_IS_NOT_INT        = -9,
         LOCAL_OVERFLOW          = -10,
+        FILE_NOT_FOUND          = -11,
+        INCLUDE_TOO_DEEP        = -12,
+        IMAGE_NOT_SAVED         = -13,
+        NOT_COMPACTED           = -14,
+    };
+
+    enum {
+        MAX_INCLUDE_DEPTH       = 64,
     };
 
     static void     wordId          (SM::VM::Process* proc);
     static void     defineWord      (SM::VM::Process* proc);
     static void     immediate       (SM::VM::Process* proc);
     static void     setLocalCount   (SM::VM::Process* proc);
+    static void     setClearedLocalCount(SM::VM::Process* proc);
     static void     endWord         (SM::VM::Process* proc);
     static void     see             (SM::VM::Process* proc);
     static void     streamPeek      (SM::VM::Process* proc);
     static void     streamGetCH     (SM::VM::Process* proc);
+    static void     streamSkip      (SM::VM::Process* proc);
     static void     streamToken     (SM::VM::Process* proc);
+    static void     readString      (SM::VM::Process* proc);
+    static void     state           (SM::VM::Process* proc);
+    static void     include         (SM::VM::Process* proc);
+    static void     saveImage       (SM::VM::Process* proc);
+    static void     shake           (SM::VM::Process* proc);
+
+    static void     parenComment    (SM::VM::Process* proc);
+    static void     lineComment     (SM::VM::Process* proc);
+    static void     doWord          (SM::VM::Process* proc);
+    static void     whileWord       (SM::VM::Process* proc);
+    static void     ifWord          (SM::VM::Process* proc);
+    static void     thenWord        (SM::VM::Process* proc);
+    static void     elseWord        (SM::VM::Process* proc);
+
+    ///
+    /// a token is a slice of the stream window (or of the terminal scratch buffer when
+    /// it spans two blocks), valid until the next token is read. Decimal integers are
+    /// recognized and converted while the token is classified.
+    ///
+    struct Token {
+        const char*     str;
+        uint32_t        length;
+        bool            isInt;
+        int32_t         value;
+    };
 
     void            loadStream(IInputStream::Ptr stream);
 
+    ///
+    /// compile cache: an included file that only defines words is saved in dir as an
+    /// image fragment, keyed by the hash of its contents and of the dictionary it is
+    /// compiled against. Including it again over the same dictionary loads the fragment
+    /// instead of compiling the file. Redefining a word (or compiling anything else
+    /// first) changes the dictionary and so the key. nullptr disables the cache.
+    ///
+    void            setCompileCache(const char* dir);
+
+    ///
+    /// lazy compilation: a definition read from a persistent stream (a file or a string)
+    /// is only scanned to its ';', the word is created without code (start -1) and its
+    /// source span is kept. The body is compiled on the first call, so loading a large
+    /// library only costs the words it actually uses. Compile errors of a lazy body show
+    /// on its first call, and its names are resolved then (a name defined later is found).
+    ///
+    /// Definitions holding 'immediate' are compiled at once, with the lazy words they
+    /// reference since they run while other words are compiled. Redefining a name first
+    /// compiles the pending bodies, which keep the definition they were written against.
+    /// The scan skips ( ... ), \ comments, the text of words ending in " and the name
+    /// after ', other immediate words are assumed not to read the input.
+    ///
+    void            setLazyCompile(bool lazy);
+
     Terminal(SM::VM* vm);
 
 private:
-    SM::String      getToken();
+    bool            nextToken(Token& tok);      // false at the end of the stream
+
+    // the output is flushed before the stream may block for its next block
+    inline void     waitInput(IInputStream* strm)   { if( strm->cursor() == strm->limit() ) { out_.flush(); } }
+    void            declareLocals(bool clear);
+    bool            skipPast(char delimiter);   // false at the end of the stream
+    bool            popAddress(uint32_t& addr);
 
-    inline IInputStream::Ptr    stream() const  { return streams_.back(); }
+    // the word being compiled (the last one outside of a lazy compile)
+    inline uint32_t compiledWord() const        { return openWord_ >= 0 ? static_cast<uint32_t>(openWord_) : vm_->lastWord(); }
+
+    inline IInputStream*        stream() const  { return streams_.back().get(); }
     inline void     pushStream(IInputStream::Ptr strm)  { streams_.push_back(strm); }
     inline void     popStream()                 { streams_.pop_back(); }
 
-    SM::Vector<IInputStream::Ptr>   streams_;
+    // an included file being compiled for the cache
+    struct CacheFrame {
+        size_t          depth;          // streams_ size while it is read
+        uint64_t        key;
+        uint64_t        before;         // fingerprint of the dictionary at mark
+        SM::VM::Mark    mark;
+        bool            cacheable;      // nothing but definitions so far
+    };
+
+    bool            includeCached(IInputStream* strm);
+    void            endCacheFrame();
+    void            cachePath(uint64_t key, SM::String& path) const;
+    bool            isDefiningWord(uint32_t word) const;
+
+    inline void
+    notCacheable() {
+        for( size_t i = 0; i < cacheFrames_.size(); ++i ) {
+            cacheFrames_[i].cacheable   = false;
+        }
+    }
+
+    // a definition waiting for its first call
+    struct LazyBody {
+        uint32_t        word;
+        uint32_t        source;         // index in lazySources_
+        const char*     begin;          // nullptr once compiled
+        const char*     end;            // past the ';'
+    };
+
+    bool            scanDefinition(uint32_t word);
+    LazyBody*       findLazy(uint32_t word);
+    bool            compileLazy(uint32_t word);
+    void            compilePending();
+    void            compileReferenced(uint32_t word);
+
+    static bool     lazyCompiler(void* term, uint32_t word);
+
+    SM::SmallVector<IInputStream::Ptr, 4>   streams_;   // include nesting rarely goes deeper
+    SM::String      tokenScratch_;              // tokens crossing a block boundary
+
+    SM::String      cacheDir_;                  // empty: no compile cache
+    SM::Vector<CacheFrame>  cacheFrames_;
+
+    bool            lazy_;
+    int32_t         openWord_;                  // definition being compiled, -1: none
+    uint32_t        pendingLazy_;               // bodies not compiled yet
+    SM::Vector<LazyBody>            lazyBodies_;    // by word id
+    SM::Vector<IInputStream::Ptr>   lazySources_;
 
-    static bool     isInt(const SM::String& tok);
-    static int32_t  toInt32(const SM::String& tok);
+    static void     classify(Token& tok);
 };
 
 
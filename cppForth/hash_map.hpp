@@ -1,13 +1,14 @@
-/* 
+
+/*
 ** Copyright (c) 2017 Wael El Oraiby.
-** 
-** This program is free software: you can redistribute it and/or modify  
-** it under the terms of the GNU Lesser General Public License as   
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
 ** published by the Free Software Foundation, version 3.
 **
-** This program is distributed in the hope that it will be useful, but 
-** WITHOUT ANY WARRANTY; without even the implied warranty of 
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
 ** Lesser General Lesser Public License for more details.
 **
 ** You should have received a copy of the GNU Lesser General Public License
@@ -20,272 +21,339 @@
 #   include "base.hpp"
 #endif
 
+#include "allocator.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define SM_HASH_MAP_SSE2
+#   include <emmintrin.h>
+#endif
+
 namespace SM {
 
+///
+/// open addressing hash map (swiss table layout)
+///
+/// every slot has a control byte: EMPTY, DELETED or the lower 7 bits of the key hash.
+/// Control bytes are probed 16 at a time (one SSE2 compare when available), the full
+/// hash is stored next to the key so keys are only compared on a full hash match and
+/// never rehashed when the table grows.
+///
 template<typename K, typename V>
 struct HashMap : public NonCopyable {
 
     HashMap();
+    explicit HashMap(IAllocator* allocator);
     ~HashMap();
 
-    struct EPtr {
-        EPtr() : raw(ENDPTR) {}
-        EPtr(const EPtr& other) : raw(other.raw) {}
+    struct Iterator {
+        Iterator() : map(nullptr), slot(0) {}
 
-        static EPtr endPtr() { return EPtr(); }
+        bool            operator == (const Iterator& other) const { return slot == other.slot; }
+        bool            operator != (const Iterator& other) const { return slot != other.slot; }
 
-        bool        operator == (const EPtr& other) const { return raw == other.raw; }
-        bool        operator != (const EPtr& other) const { return raw != other.raw; }
+        Iterator&       operator ++ () { slot = map->nextFull(slot + 1); return *this; }
 
-        EPtr        operator = (const EPtr& other) { raw = other.raw; return *this; }
+        const K&        key() const     { return map->slots_[slot].key; }
+        V&              value() const   { return map->slots_[slot].value; }
 
     private:
+        Iterator(const HashMap* m, uint32_t s) : map(m), slot(s) {}
 
-        explicit EPtr(uint32_t r) : raw(r) {}
-        bool        isUsed() const  { return raw & 0x80000000 ? true : false; }
-        void        setUsed()       { raw |= 0x80000000; }
-        uint32_t    getPtr() const  { return raw & 0x7FFFFFFF; }
-
-        uint32_t raw;
+        const HashMap*  map;
+        uint32_t        slot;
 
         friend struct HashMap;
     };
 
-    EPtr            end() const { return EPtr::endPtr(); }
-    EPtr            find(const K& k) const { return findElement(k); }
-    const V&        operator [] (const K& k) const { return *getValue(k); }
-    
-    V&
-    operator [] (const K& k) {
-        if( find(k) == end() ) {
-            insert(k, V());
-        }
-        return *getValue(k);
-    }
+    Iterator        begin() const   { return Iterator(this, nextFull(0)); }
+    Iterator        end() const     { return Iterator(this, capacity_); }
 
+    Iterator        find(const K& k) const;
+    const V&        operator [] (const K& k) const { Iterator it = find(k); assert(it != end()); return it.value(); }
+    V&              operator [] (const K& k);
+
+    void            insert(const K& key, const V& value)    { (*this)[key] = value; }
+    bool            erase(const K& key);
+    void            reserve(uint32_t count);
+    void            clear();
+
+    inline uint32_t size() const    { return size_; }
+    inline IAllocator*  allocator() const   { return allocator_; }
 
 private:
     enum {
-        ENDPTR = -1,
-        INITIAL_HASH_ELEMENT_COUNT = 16,
+        GROUP_WIDTH         = 16,
+        INITIAL_CAPACITY    = 16,
+    };
+
+    enum Control {
+        EMPTY       = -128,     // 0b10000000
+        DELETED     = -2,       // 0b11111110
     };
 
-    struct Element {
-        EPtr        next;
+    struct Slot {
+        uint32_t    hash;
         K           key;
         V           value;
     };
 
-    EPtr*           pointers;
-    Element*        elements;
-    uint32_t        capacity;
-    uint32_t        count;
-    EPtr            freeList;
-    
-    void            releaseElements ();
-    void            insert       (const K& key, const V& value);
-    EPtr            findElement  (const K& key) const;
-    void            remove       (const K& key);
-    const V*        getValue     (const K& key) const;
-    const V*        getValueAt   (EPtr elemPos) const;
-    V*              getValue     (const K& key);
-    V*              getValueAt   (EPtr elemPos);
-
-    Element*        allocateBuckets(uint32_t size);
-    EPtr*           allocatePointers(uint32_t size);
-
-    void            rehash(uint32_t newSize);
+    ///
+    /// a group of 16 control bytes, match* return a bit mask of the matching bytes
+    ///
+    struct Group {
+#ifdef SM_HASH_MAP_SSE2
+        explicit Group(const int8_t* ctrl) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl))) {}
+
+        uint32_t    match(int8_t h) const       { return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h), ctrl))); }
+        uint32_t    matchEmpty() const          { return match(EMPTY); }
+        uint32_t    matchFree() const           { return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl))); }
+
+        __m128i     ctrl;
+#else
+        explicit Group(const int8_t* ctrl) : ctrl(ctrl) {}
+
+        uint32_t
+        match(int8_t h) const {
+            uint32_t mask = 0;
+            for( uint32_t i = 0; i < GROUP_WIDTH; ++i ) {
+                mask |= (ctrl[i] == h ? 1u : 0u) << i;
+            }
+            return mask;
+        }
 
+        uint32_t    matchEmpty() const          { return match(EMPTY); }
+
+        uint32_t
+        matchFree() const {
+            uint32_t mask = 0;
+            for( uint32_t i = 0; i < GROUP_WIDTH; ++i ) {
+                mask |= (ctrl[i] < -1 ? 1u : 0u) << i;
+            }
+            return mask;
+        }
+
+        const int8_t*   ctrl;
+#endif
+    };
+
+    static inline uint32_t  h1(uint32_t hash)   { return hash >> 7; }
+    static inline int8_t    h2(uint32_t hash)   { return static_cast<int8_t>(hash & 0x7F); }
+
+    static inline uint32_t
+    lowestBit(uint32_t mask) {
+#if defined(__GNUC__)
+        return static_cast<uint32_t>(__builtin_ctz(mask));
+#else
+        uint32_t i = 0;
+        while( !(mask & 1) ) { mask >>= 1; ++i; }
+        return i;
+#endif
+    }
+
+    uint32_t        findSlot    (const K& key, uint32_t hash) const;
+    uint32_t        findFree    (uint32_t hash) const;
+    uint32_t        nextFull    (uint32_t slot) const;
+    void            setCtrl     (uint32_t slot, int8_t c) { ctrl_[slot] = c; }
+    void            resize      (uint32_t newCapacity);
+    void            releaseSlots();
+
+    int8_t*         ctrl_;
+    Slot*           slots_;
+    uint32_t        capacity_;      // power of 2, multiple of GROUP_WIDTH
+    uint32_t        size_;
+    uint32_t        growthLeft_;    // inserts into EMPTY slots left before growing (7/8 max load)
+    IAllocator*     allocator_;
 };
 
 template<typename K, typename V>
-HashMap<K, V>::HashMap() : pointers(nullptr), elements(nullptr), capacity(0), count(0), freeList(ENDPTR) {
+HashMap<K, V>::HashMap() : ctrl_(nullptr), slots_(nullptr), capacity_(0), size_(0), growthLeft_(0), allocator_(currentAllocator()) {
+}
+
+template<typename K, typename V>
+HashMap<K, V>::HashMap(IAllocator* allocator) : ctrl_(nullptr), slots_(nullptr), capacity_(0), size_(0), growthLeft_(0), allocator_(allocator) {
 }
 
 template<typename K, typename V>
 HashMap<K, V>::~HashMap() {
-    releaseElements();
+    releaseSlots();
 }
 
 template<typename K, typename V>
 void
-HashMap<K, V>::releaseElements() {
-    if( pointers ) {
-        delete[] pointers;
+HashMap<K, V>::releaseSlots() {
+    for( uint32_t i = 0; i < capacity_; ++i ) {
+        if( ctrl_[i] >= 0 ) {
+            slots_[i].~Slot();
+        }
     }
 
-    if( elements ) {
-        delete[] elements;
-    }
-    pointers = nullptr;
-    elements = nullptr;
+    allocator_->deallocate(ctrl_, capacity_);
+    allocator_->deallocate(slots_, sizeof(Slot) * capacity_);
+    ctrl_       = nullptr;
+    slots_      = nullptr;
 }
 
 template<typename K, typename V>
-typename HashMap<K, V>::Element*
-HashMap<K, V>::allocateBuckets(uint32_t size) {
-    Element*  buckets = new Element[size];
-    for (uint32_t i = 0; i < size; ++i) {
-        buckets[i].next = EPtr(i + 1);
+uint32_t
+HashMap<K, V>::findSlot(const K& key, uint32_t hash) const {
+    if( capacity_ == 0 ) {
+        return capacity_;
     }
-    buckets[size - 1].next = EPtr::endPtr();
-    return buckets;
-}
 
+    uint32_t    groupMask   = capacity_ / GROUP_WIDTH - 1;
+    uint32_t    group       = h1(hash) & groupMask;
 
-template<typename K, typename V>
-typename HashMap<K, V>::EPtr*
-HashMap<K, V>::allocatePointers(uint32_t size) {
-    EPtr*   pointers = new EPtr[size];
-    return pointers;
-}
+    // triangular probing visits every group once
+    for( uint32_t step = 1; ; ++step ) {
+        Group       g(&ctrl_[group * GROUP_WIDTH]);
+        uint32_t    mask    = g.match(h2(hash));
 
+        while( mask ) {
+            uint32_t    slot    = group * GROUP_WIDTH + lowestBit(mask);
+            if( slots_[slot].hash == hash && slots_[slot].key == key ) {
+                return slot;
+            }
+            mask &= mask - 1;
+        }
 
-template<typename K, typename V>
-typename HashMap<K, V>::EPtr
-HashMap<K, V>::findElement(const K& key) const {
-    if( capacity ) {
-        uint32_t    hash        = Hash<K>::hash(key) & 0x7FFFFFFF;
-        uint32_t    ptrPosition = hash % capacity;
-        EPtr        oldPtr      = pointers[ptrPosition];
-
-        while( oldPtr != EPtr::endPtr() && elements[oldPtr.getPtr()].key != key ) {
-            oldPtr = elements[oldPtr.getPtr()].next;
+        if( g.matchEmpty() || step > groupMask ) {
+            return capacity_;
         }
 
-        return oldPtr;
-    } else {
-        return EPtr::endPtr();
+        group = (group + step) & groupMask;
     }
 }
 
 template<typename K, typename V>
-const V*
-HashMap<K, V>::getValue(const K& key) const {
-    EPtr elemPos = findElement(key);
-    if( elemPos != EPtr::endPtr() ) {
-        return &elements[elemPos.getPtr()].value;
-    } else {
-        return nullptr;
+uint32_t
+HashMap<K, V>::findFree(uint32_t hash) const {
+    uint32_t    groupMask   = capacity_ / GROUP_WIDTH - 1;
+    uint32_t    group       = h1(hash) & groupMask;
+
+    for( uint32_t step = 1; ; ++step ) {
+        uint32_t    mask    = Group(&ctrl_[group * GROUP_WIDTH]).matchFree();
+        if( mask ) {
+            return group * GROUP_WIDTH + lowestBit(mask);
+        }
+        group = (group + step) & groupMask;
     }
 }
 
 template<typename K, typename V>
-const V*
-HashMap<K, V>::getValueAt(EPtr elemPos) const {
-    if( elemPos != EPtr::endPtR() ) {
-        return &elements[elemPos.getPtr()].value;
-    } else {
-        return nullptr;
+uint32_t
+HashMap<K, V>::nextFull(uint32_t slot) const {
+    while( slot < capacity_ && ctrl_[slot] < 0 ) {
+        ++slot;
     }
+    return slot;
 }
 
 template<typename K, typename V>
-V*
-HashMap<K, V>::getValue(const K& key) {
-    EPtr elemPos = findElement(key);
-    if( elemPos != EPtr::endPtr() ) {
-        return &elements[elemPos.getPtr()].value;
-    } else {
-        return nullptr;
+typename HashMap<K, V>::Iterator
+HashMap<K, V>::find(const K& key) const {
+    return Iterator(this, findSlot(key, Hash<K>::hash(key)));
+}
+
+template<typename K, typename V>
+V&
+HashMap<K, V>::operator [] (const K& key) {
+    uint32_t    hash    = Hash<K>::hash(key);
+    uint32_t    slot    = findSlot(key, hash);
+
+    if( slot != capacity_ ) {
+        return slots_[slot].value;
+    }
+
+    if( growthLeft_ == 0 ) {
+        // only grow when live entries (not tombstones) fill the table
+        resize(size_ * 2 >= capacity_ * 7 / 8 ? (capacity_ ? capacity_ * 2 : static_cast<uint32_t>(INITIAL_CAPACITY)) : capacity_);
     }
+
+    slot = findFree(hash);
+    if( ctrl_[slot] == EMPTY ) {
+        --growthLeft_;
+    }
+
+    setCtrl(slot, h2(hash));
+    new(&slots_[slot]) Slot();
+    slots_[slot].hash   = hash;
+    slots_[slot].key    = key;
+    ++size_;
+
+    return slots_[slot].value;
 }
 
 template<typename K, typename V>
-V*
-HashMap<K, V>::getValueAt(EPtr elemPos) {
-    if( elemPos != EPtr::endPtR() ) {
-        return &elements[elemPos.getPtr()].value;
+bool
+HashMap<K, V>::erase(const K& key) {
+    uint32_t    slot    = findSlot(key, Hash<K>::hash(key));
+    if( slot == capacity_ ) {
+        return false;
+    }
+
+    slots_[slot].~Slot();
+    --size_;
+
+    // a group with an empty slot never stopped a probe, no tombstone needed
+    uint32_t    group   = slot / GROUP_WIDTH;
+    if( Group(&ctrl_[group * GROUP_WIDTH]).matchEmpty() ) {
+        setCtrl(slot, EMPTY);
+        ++growthLeft_;
     } else {
-        return nullptr;
+        setCtrl(slot, DELETED);
     }
+
+    return true;
 }
 
 template<typename K, typename V>
 void
-HashMap<K, V>::rehash(uint32_t newSize) {
-    Element*        prevElements = elements;
-    EPtr*           prevPointers = pointers;
-    uint32_t        prevCapacity = capacity;
-    elements    = allocateBuckets(newSize); 
-    pointers    = allocatePointers(newSize);
-    freeList    = EPtr(0);
-    count       = 0;
-    capacity    = newSize;
-
-    for( uint32_t p = 0; p < prevCapacity; ++p ) {
-        if( prevPointers[p].isUsed() ) {
-            EPtr ptr = prevPointers[p];
-            while( ptr != EPtr::endPtr() ) {
-                insert(prevElements[ptr.getPtr()].key, prevElements[ptr.getPtr()].value);
-                ptr = prevElements[ptr.getPtr()].next;
-            }
-        }
+HashMap<K, V>::reserve(uint32_t count) {
+    uint32_t    capacity    = capacity_ ? capacity_ : INITIAL_CAPACITY;
+    while( capacity * 7 / 8 < count ) {
+        capacity <<= 1;
     }
 
-    delete[] prevElements;
-    delete[] prevPointers;
+    if( capacity > capacity_ ) {
+        resize(capacity);
+    }
 }
 
 template<typename K, typename V>
 void
-HashMap<K, V>::insert(const K& key, const V& value) {
-    if( freeList == EPtr::endPtr() ) {
-        uint32_t    newCapacity = capacity ? capacity * 2 : INITIAL_HASH_ELEMENT_COUNT;
-        rehash(newCapacity);
-    }
-        
-    EPtr    elementFound = findElement(key);
-
-    uint32_t    hash        = Hash<K>::hash(key) & 0x7FFFFFFF;
-    uint32_t    ptrPosition = hash % capacity;
-    EPtr        oldPtr      = pointers[ptrPosition];
-    uint32_t    currentFree = (elementFound != EPtr::endPtr()) ? elementFound.getPtr() : freeList.getPtr();
-        
-    if( elementFound == EPtr::endPtr() ) {  /* duplicate */
-        freeList            = elements[freeList.getPtr()].next;
-        elements[currentFree].next  = oldPtr;
-        elements[currentFree].key   = key;
-    } 
-
-    elements[currentFree].value = value;
-        
-    pointers[ptrPosition] = EPtr(currentFree);
-    pointers[ptrPosition].setUsed();
-    ++count;
+HashMap<K, V>::clear() {
+    releaseSlots();
+    capacity_   = 0;
+    size_       = 0;
+    growthLeft_ = 0;
 }
 
 template<typename K, typename V>
 void
-HashMap<K, V>::remove(const K& key) {
-    uint32_t    hash = Hash<K>::hash(key) & 0x7FFFFFFF;
-    uint32_t    ptrPosition = hash % capacity;
-    EPtr        oldPtr = pointers[ptrPosition];
-    EPtr        prevPos = EPtr::endPtr();
-    
-    while( oldPtr != EPtr::endPtr() && elements[oldPtr.getPtr()].key != key ) {
-        prevPos = oldPtr;
-        oldPtr = elements[prevPos.getPtr()].next;
-    }
-    
-    if( oldPtr != EPtr::endPtr() ) {
-        EPtr next = elements[oldPtr.getPtr()].next;
-        if( prevPos != EPtr::endPtr() ) {
-            next.setUsed();
-            elements[prevPos.getPtr()].next = next;
+HashMap<K, V>::resize(uint32_t newCapacity) {
+    int8_t*     prevCtrl        = ctrl_;
+    Slot*       prevSlots       = slots_;
+    uint32_t    prevCapacity    = capacity_;
+
+    ctrl_       = static_cast<int8_t*>(allocator_->allocate(newCapacity));
+    slots_      = static_cast<Slot*>(allocator_->allocate(sizeof(Slot) * newCapacity));
+    assert(ctrl_ != nullptr && slots_ != nullptr);
+    capacity_   = newCapacity;
+    growthLeft_ = newCapacity * 7 / 8 - size_;
+    memset(ctrl_, EMPTY, newCapacity);
+
+    // the stored hashes are reused, keys are not hashed again
+    for( uint32_t i = 0; i < prevCapacity; ++i ) {
+        if( prevCtrl[i] >= 0 ) {
+            uint32_t    slot    = findFree(prevSlots[i].hash);
+            setCtrl(slot, h2(prevSlots[i].hash));
+            new(&slots_[slot]) Slot(prevSlots[i]);
+            prevSlots[i].~Slot();
         }
-        
-        if( prevPos == EPtr::endPtr() ) {
-            pointers[ptrPosition] = next;
-        }
-        
-        elements[oldPtr.getPtr()].key   = K();
-        elements[oldPtr.getPtr()].value = V();
-
-        elements[oldPtr.getPtr()].next = freeList;
-        freeList = oldPtr;
-        --count;
     }
+
+    allocator_->deallocate(prevSlots, sizeof(Slot) * prevCapacity);
+    allocator_->deallocate(prevCtrl, prevCapacity);
 }
 
 }   // namespace SM
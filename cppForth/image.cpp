@@ -0,0 +1,434 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "vm.hpp"
+
+#include <stdio.h>
+
+#if defined _WIN32 || defined __CYGWIN__
+#   define FORTH_IMAGE_NO_MMAP
+#else
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+
+namespace SM {
+
+////////////////////////////////////////////////////////////////////////////////
+// image layout: a header followed by 4 byte aligned sections, every reference is
+// an offset (into the image, the code segment or the data segment)
+////////////////////////////////////////////////////////////////////////////////
+namespace {
+
+enum : uint32_t {
+    IMAGE_BYTE_ORDER    = 0x01020304,
+
+    FUNCTION_NORMAL     = 1 << 0,
+    FUNCTION_IMMEDIATE  = 1 << 1,
+    FUNCTION_CLEAR_LOCALS   = 1 << 2,
+
+    IMAGE_RAW_DATA      = 1 << 0,   // the data segment holds program data
+};
+
+static const char   IMAGE_MAGIC[8]  = { 'S', 'M', 'F', 'O', 'R', 'T', 'H', 0 };
+
+struct ImageHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byteOrder;
+    uint32_t    cellWidth;
+    uint32_t    builtinCount;
+    uint32_t    builtinHash;        // the words of the image refer to the built-ins by id
+    uint32_t    size;               // of the whole image
+    uint32_t    flags;
+
+    // where the image starts (all 0 but the built-ins for a whole VM), a fragment
+    // only loads in a VM that has exactly this much
+    uint32_t    wordBase;
+    uint32_t    codeBase;
+    uint32_t    dataBase;
+
+    uint32_t    functionCount;
+    uint32_t    codeCount;          // code segment words
+    uint32_t    dataSize;           // data segment bytes
+    uint32_t    namesSize;
+    uint32_t    stringCount;        // interned string literals (data segment addresses)
+    uint32_t    relocationCount;    // code segment address << 1 | kind
+
+    uint32_t    functionsOffset;
+    uint32_t    codeOffset;
+    uint32_t    dataOffset;
+    uint32_t    namesOffset;
+    uint32_t    stringsOffset;
+    uint32_t    relocationsOffset;
+};
+
+struct ImageFunction {
+    uint32_t    nameOffset;         // in the names section, null terminated
+    uint32_t    nameLength;
+    uint32_t    flags;
+    int32_t     start;              // normal: code segment address, -1 while not compiled
+    uint32_t    end;
+    uint32_t    localCount;
+    uint32_t    native;             // native: built-in id of the function
+};
+
+inline uint32_t align4(uint32_t n)  { return (n + 3) & ~3u; }
+
+inline bool
+inBounds(uint32_t offset, uint64_t length, uint32_t size) {
+    return offset <= size && length <= size - offset;
+}
+
+}   // namespace
+
+uint32_t
+VM::builtinsHash() const {
+    uint32_t    h   = BuiltinTable<NativeFunction>::hash(nullptr, 0, builtinCount_);
+    for( uint32_t i = 0; i < builtinCount_; ++i ) {
+        const char* name    = builtins_->words[i].name;
+        h   = (h ^ BuiltinTable<NativeFunction>::hash(name, builtins_->lengths[i], 0)) * 16777619u;
+    }
+    return h;
+}
+
+uint64_t
+VM::fingerprint(const Mark& upTo) const {
+    // images of another format or cell width never share a key
+    uint64_t    h   = builtinsHash() ^ (static_cast<uint64_t>(FORTH_CELL_WIDTH) << 32) ^ (static_cast<uint64_t>(IMAGE_VERSION) << 40);
+
+    for( uint32_t word = builtinCount_; word < upTo.wordCount; ++word ) {
+        const Function& func    = function(word);
+        uint32_t        rec[5]  = { static_cast<uint32_t>(func.color), func.isImmediate ? 1u : 0u, 0, 0, 0 };
+        if( !func.isNative() ) {
+            rec[2]  = static_cast<uint32_t>(func.body.interpreted.start);
+            rec[3]  = func.body.interpreted.end;
+            rec[4]  = func.body.interpreted.localCount | (func.body.interpreted.clearLocals ? 0x100u : 0u);
+        }
+        h   = hash_bytes64(func.name.c_str(), func.name.size(), h);
+        h   = hash_bytes64(reinterpret_cast<const char*>(rec), sizeof(rec), h);
+    }
+
+    if( upTo.codeSize ) {
+        h   = hash_bytes64(reinterpret_cast<const char*>(wordSegment_.get()), upTo.codeSize * sizeof(uint32_t), h);
+    }
+
+    if( upTo.dataSize ) {
+        h   = hash_bytes64(reinterpret_cast<const char*>(constDataSegment_.get()), upTo.dataSize, h);
+    }
+
+    return h;
+}
+
+bool
+VM::saveImage(Vector<uint8_t>& image, const Mark& from) const {
+    Mark        to              = mark();
+    if( from.wordCount < builtinCount_ || from.wordCount > to.wordCount || from.codeSize > to.codeSize || from.dataSize > to.dataSize ) {
+        return false;
+    }
+
+    uint32_t    firstFunction   = from.wordCount - builtinCount_;
+    uint32_t    functionCount   = to.wordCount - from.wordCount;
+    uint32_t    codeCount       = to.codeSize - from.codeSize;
+    uint32_t    dataSize        = to.dataSize - from.dataSize;
+
+    uint32_t    stringCount     = 0;
+    for( HashMap<String, uint32_t>::Iterator it = stringPool_.begin(); it != stringPool_.end(); ++it ) {
+        stringCount    += it.value() >= from.dataSize ? 1 : 0;
+    }
+
+    uint32_t    firstRelocation = 0;
+    while( firstRelocation < relocations_.size() && (relocations_[firstRelocation] >> 1) < from.codeSize ) {
+        ++firstRelocation;
+    }
+    uint32_t    relocationCount = static_cast<uint32_t>(relocations_.size()) - firstRelocation;
+
+    uint32_t    namesSize       = 0;
+    for( uint32_t i = 0; i < functionCount; ++i ) {
+        namesSize  += static_cast<uint32_t>(functions_[firstFunction + i].name.size()) + 1;
+    }
+
+    ImageHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version         = IMAGE_VERSION;
+    hdr.byteOrder       = IMAGE_BYTE_ORDER;
+    hdr.cellWidth       = FORTH_CELL_WIDTH;
+    hdr.builtinCount    = builtinCount_;
+    hdr.builtinHash     = builtinsHash();
+    hdr.flags           = rawData_ ? static_cast<uint32_t>(IMAGE_RAW_DATA) : 0;
+    hdr.wordBase        = from.wordCount;
+    hdr.codeBase        = from.codeSize;
+    hdr.dataBase        = from.dataSize;
+    hdr.functionCount   = functionCount;
+    hdr.codeCount       = codeCount;
+    hdr.dataSize        = dataSize;
+    hdr.namesSize       = namesSize;
+    hdr.stringCount     = stringCount;
+    hdr.relocationCount = relocationCount;
+
+    hdr.functionsOffset = align4(sizeof(ImageHeader));
+    hdr.codeOffset      = hdr.functionsOffset + functionCount * sizeof(ImageFunction);
+    hdr.dataOffset      = hdr.codeOffset + codeCount * sizeof(uint32_t);
+    hdr.namesOffset     = align4(hdr.dataOffset + dataSize);
+    hdr.stringsOffset   = align4(hdr.namesOffset + namesSize);
+    hdr.relocationsOffset   = hdr.stringsOffset + stringCount * sizeof(uint32_t);
+    hdr.size            = hdr.relocationsOffset + relocationCount * sizeof(uint32_t);
+
+    image.resize(hdr.size);
+    uint8_t*    base    = image.get();
+    memset(base, 0, hdr.size);
+    memcpy(base, &hdr, sizeof(hdr));
+
+    ImageFunction*  funcs   = reinterpret_cast<ImageFunction*>(base + hdr.functionsOffset);
+    char*           names   = reinterpret_cast<char*>(base + hdr.namesOffset);
+    uint32_t        nameAt  = 0;
+    for( uint32_t i = 0; i < functionCount; ++i ) {
+        const Function& func    = functions_[firstFunction + i];
+        ImageFunction&  rec     = funcs[i];
+
+        rec.nameOffset  = nameAt;
+        rec.nameLength  = static_cast<uint32_t>(func.name.size());
+        memcpy(names + nameAt, func.name.c_str(), rec.nameLength + 1);
+        nameAt         += rec.nameLength + 1;
+
+        rec.flags       = func.isImmediate ? static_cast<uint32_t>(FUNCTION_IMMEDIATE) : 0;
+        if( func.isNative() ) {
+            // host natives have no stable id, they can not be saved
+            rec.native  = 0xFFFFFFFF;
+            for( uint32_t b = 0; b < builtinCount_; ++b ) {
+                if( builtins_->words[b].native == func.body.native ) {
+                    rec.native  = b;
+                    break;
+                }
+            }
+
+            if( rec.native == 0xFFFFFFFF ) {
+                image.clear();
+                return false;
+            }
+        } else {
+            rec.flags      |= FUNCTION_NORMAL | (func.body.interpreted.clearLocals ? static_cast<uint32_t>(FUNCTION_CLEAR_LOCALS) : 0);
+            rec.start       = func.body.interpreted.start;
+            rec.end         = func.body.interpreted.end;
+            rec.localCount  = func.body.interpreted.localCount;
+        }
+    }
+
+    if( codeCount ) {
+        memcpy(base + hdr.codeOffset, wordSegment_.get() + from.codeSize, codeCount * sizeof(uint32_t));
+    }
+
+    if( dataSize ) {
+        memcpy(base + hdr.dataOffset, constDataSegment_.get() + from.dataSize, dataSize);
+    }
+
+    uint32_t*   strings = reinterpret_cast<uint32_t*>(base + hdr.stringsOffset);
+    for( HashMap<String, uint32_t>::Iterator it = stringPool_.begin(); it != stringPool_.end(); ++it ) {
+        if( it.value() >= from.dataSize ) {
+            *strings++  = it.value();
+        }
+    }
+
+    if( relocationCount ) {
+        memcpy(base + hdr.relocationsOffset, relocations_.get() + firstRelocation, relocationCount * sizeof(uint32_t));
+    }
+
+    return true;
+}
+
+bool
+VM::saveImage(Vector<uint8_t>& image) const {
+    return saveImage(image, Mark{ builtinCount_, 0, 0 });
+}
+
+bool
+VM::saveImage(const char* path, const Mark& from) const {
+    Vector<uint8_t> image;
+    if( !saveImage(image, from) ) {
+        return false;
+    }
+
+    FILE*   f   = fopen(path, "wb");
+    if( f == nullptr ) {
+        return false;
+    }
+
+    bool    ok  = fwrite(image.get(), 1, image.size(), f) == image.size();
+    return (fclose(f) == 0) && ok;
+}
+
+bool
+VM::loadImage(const uint8_t* image, size_t size) {
+    if( size < sizeof(ImageHeader) || size > 0xFFFFFFFFu ) {
+        return false;
+    }
+
+    ImageHeader hdr;
+    memcpy(&hdr, image, sizeof(hdr));
+
+    uint32_t    isize   = static_cast<uint32_t>(size);
+    if( memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != IMAGE_VERSION ||
+        hdr.byteOrder != IMAGE_BYTE_ORDER ||
+        hdr.cellWidth != FORTH_CELL_WIDTH ||
+        hdr.builtinCount != builtinCount_ ||
+        hdr.builtinHash != builtinsHash() ||
+        hdr.wordBase != wordCount() ||
+        hdr.codeBase != wordSegment_.size() ||
+        hdr.dataBase != constDataSegment_.size() ||
+        hdr.size > isize ||
+        !inBounds(hdr.functionsOffset, static_cast<uint64_t>(hdr.functionCount) * sizeof(ImageFunction), isize) ||
+        !inBounds(hdr.codeOffset, static_cast<uint64_t>(hdr.codeCount) * sizeof(uint32_t), isize) ||
+        !inBounds(hdr.dataOffset, hdr.dataSize, isize) ||
+        !inBounds(hdr.namesOffset, hdr.namesSize, isize) ||
+        !inBounds(hdr.stringsOffset, static_cast<uint64_t>(hdr.stringCount) * sizeof(uint32_t), isize) ||
+        !inBounds(hdr.relocationsOffset, static_cast<uint64_t>(hdr.relocationCount) * sizeof(uint32_t), isize) ||
+        (hdr.functionsOffset | hdr.codeOffset | hdr.stringsOffset | hdr.relocationsOffset) & 3 ) {
+        return false;
+    }
+
+    const ImageFunction*    funcs   = reinterpret_cast<const ImageFunction*>(image + hdr.functionsOffset);
+    const char*             names   = reinterpret_cast<const char*>(image + hdr.namesOffset);
+    const uint32_t*         strings = reinterpret_cast<const uint32_t*>(image + hdr.stringsOffset);
+    const uint32_t*         relocs  = reinterpret_cast<const uint32_t*>(image + hdr.relocationsOffset);
+
+    // everything is checked before the VM is touched
+    for( uint32_t i = 0; i < hdr.functionCount; ++i ) {
+        const ImageFunction&    rec = funcs[i];
+        if( !inBounds(rec.nameOffset, static_cast<uint64_t>(rec.nameLength) + 1, hdr.namesSize) || names[rec.nameOffset + rec.nameLength] != '\0' ) {
+            return false;
+        }
+
+        if( rec.flags & FUNCTION_NORMAL ) {
+            uint32_t    codeEnd = hdr.codeBase + hdr.codeCount;
+            if( rec.start >= 0 && (static_cast<uint32_t>(rec.start) > codeEnd || rec.end > codeEnd) ) {
+                return false;
+            }
+        } else if( rec.native >= builtinCount_ ) {
+            return false;
+        }
+    }
+
+    for( uint32_t i = 0; i < hdr.stringCount; ++i ) {
+        uint32_t    at  = strings[i] - hdr.dataBase;
+        if( strings[i] < hdr.dataBase || at >= hdr.dataSize || memchr(image + hdr.dataOffset + at, 0, hdr.dataSize - at) == nullptr ) {
+            return false;
+        }
+    }
+
+    // in address order, inside the code of the image
+    for( uint32_t i = 0; i < hdr.relocationCount; ++i ) {
+        uint32_t    addr    = relocs[i] >> 1;
+        if( addr < hdr.codeBase || addr - hdr.codeBase >= hdr.codeCount || (i && relocs[i] <= relocs[i - 1]) ) {
+            return false;
+        }
+    }
+
+    AllocatorScope  scope(&arena_);
+
+    // the segments are copied in bulk, they keep growing and being patched after
+    wordSegment_.resize(hdr.codeBase + hdr.codeCount);
+    if( hdr.codeCount ) {
+        memcpy(&wordSegment_[hdr.codeBase], image + hdr.codeOffset, hdr.codeCount * sizeof(uint32_t));
+    }
+
+    constDataSegment_.resize(hdr.dataBase + hdr.dataSize);
+    if( hdr.dataSize ) {
+        memcpy(&constDataSegment_[hdr.dataBase], image + hdr.dataOffset, hdr.dataSize);
+    }
+
+    functions_.reserve(functions_.size() + hdr.functionCount);
+    for( uint32_t i = 0; i < hdr.functionCount; ++i ) {
+        const ImageFunction&    rec = funcs[i];
+        Function                func;
+
+        func.name           = String(names + rec.nameOffset, rec.nameLength);
+        func.isImmediate    = (rec.flags & FUNCTION_IMMEDIATE) != 0;
+        if( rec.flags & FUNCTION_NORMAL ) {
+            func.color                          = Function::Color::NORMAL;
+            func.body.interpreted.start         = rec.start;
+            func.body.interpreted.end           = rec.end;
+            func.body.interpreted.localCount    = rec.localCount;
+            func.body.interpreted.clearLocals   = (rec.flags & FUNCTION_CLEAR_LOCALS) != 0;
+        } else {
+            func.body.native    = builtins_->words[rec.native].native;
+        }
+
+        // the dense translation is made on the first call
+        functions_.push_back(SM::move(func));
+        bindSymbol(functions_.back().name, hdr.wordBase + i);
+    }
+
+    for( uint32_t i = 0; i < hdr.stringCount; ++i ) {
+        stringPool_[String(dataString(strings[i]))] = strings[i];
+    }
+
+    relocations_.reserve(relocations_.size() + hdr.relocationCount);
+    for( uint32_t i = 0; i < hdr.relocationCount; ++i ) {
+        relocations_.push_back(relocs[i]);
+    }
+
+    if( hdr.flags & IMAGE_RAW_DATA ) {
+        rawData_    = true;
+    }
+
+    return true;
+}
+
+bool
+VM::loadImage(const char* path) {
+#ifdef FORTH_IMAGE_NO_MMAP
+    FILE*   f   = fopen(path, "rb");
+    if( f == nullptr ) {
+        return false;
+    }
+
+    Vector<uint8_t> image;
+    fseek(f, 0, SEEK_END);
+    image.resize(static_cast<size_t>(ftell(f)));
+    fseek(f, 0, SEEK_SET);
+    bool    ok  = fread(image.get(), 1, image.size(), f) == image.size();
+    fclose(f);
+
+    return ok && loadImage(image.get(), image.size());
+#else
+    int     fd  = open(path, O_RDONLY);
+    if( fd < 0 ) {
+        return false;
+    }
+
+    struct stat st;
+    if( fstat(fd, &st) != 0 || st.st_size <= 0 ) {
+        close(fd);
+        return false;
+    }
+
+    size_t  size    = static_cast<size_t>(st.st_size);
+    void*   mem     = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( mem == MAP_FAILED ) {
+        return false;
+    }
+
+    bool    ok  = loadImage(static_cast<const uint8_t*>(mem), size);
+    munmap(mem, size);
+    return ok;
+#endif
+}
+
+}   // namespace SM
@@ -65,16 +65,14 @@ public:
 
 	// Move support
 
-	//	object_ptr(object_ptr && rhs): px( rhs.px )
-	//	{
-	//		rhs.px = 0;
-	//	}
+	IntrusivePtr(IntrusivePtr && rhs): px( rhs.px ) {
+		rhs.px = 0;
+	}
 
-	//	object_ptr & operator=(object_ptr && rhs)
-	//	{
-	//		this_type( static_cast< object_ptr && >( rhs ) ).swap(*this);
-	//		return *this;
-	//	}
+	IntrusivePtr & operator=(IntrusivePtr && rhs) {
+		this_type( static_cast< IntrusivePtr && >( rhs ) ).swap(*this);
+		return *this;
+	}
 
 	IntrusivePtr & operator=(IntrusivePtr const & rhs) {
 		this_type(rhs).swap(*this);
@@ -138,6 +136,12 @@ private:
 	T*		px;
 };
 
+// only the pointer is stored, moving the bits moves the reference
+template<class T>
+struct IsTriviallyRelocatable< IntrusivePtr<T> > {
+	enum { VALUE = 1 };
+};
+
 template<class T, class U>
 inline bool operator==(IntrusivePtr<T> const & a, IntrusivePtr<U> const & b) {
 	return a.get() == b.get();
@@ -219,9 +223,16 @@ struct RCObject {
     RCObject() : count_(0) {}
     virtual                 ~RCObject()   = 0;
 
+#ifdef FORTH_THREADS
+	// the processes move between the worker threads
+	inline void		        grab() const			{ __atomic_add_fetch(&count_, 1, __ATOMIC_RELAXED); }
+	inline void		        release() const			{ if( __atomic_sub_fetch(&count_, 1, __ATOMIC_ACQ_REL) == 0 ) { delete this; } }
+	inline size_t		    getRefCount() const		{ return __atomic_load_n(&count_, __ATOMIC_RELAXED); }
+#else
 	inline void		        grab() const			{ ++count_;		}
 	inline void		        release() const			{ --count_; if( count_ == 0 ) { delete this; } }
 	inline size_t		    getRefCount() const		{ return count_;	}
+#endif
 
 private:
     mutable uint32_t        count_;
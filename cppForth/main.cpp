@@ -15,46 +15,61 @@
 */
 
 #include "forth.hpp"
+#include "scheduler.hpp"
 #include <stdio.h>
+#include <stdlib.h>
 
-SM::String*
-readFile(const char* filename) {
-    FILE* f = fopen(filename, "rb");
-    if( f == nullptr ) {
-        return nullptr;
-    }
+int
+main(int argc, char* argv[]) {
+    SM::VM*  vm  = new SM::VM();
 
-    fseek(f, 0, SEEK_END);
-    size_t fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    {
+        // the terminal and its streams are recycled by the VM pool
+        SM::AllocatorScope  scope(&vm->pool());
 
-    char* buff = new char[fsize + 1];
-    fread(buff, 1, fsize, f);
-    buff[fsize] = '\0';
+        Forth::Terminal::Ptr    term(new Forth::Terminal(vm));
 
-    fclose(f);
+        // included files are cached compiled in $FORTH_CACHE_DIR
+        term->setCompileCache(getenv("FORTH_CACHE_DIR"));
 
-    SM::String* ret = new SM::String(buff);
-    delete[] buff;
+        // definitions are compiled on their first call when $FORTH_LAZY_COMPILE is set
+        term->setLazyCompile(getenv("FORTH_LAZY_COMPILE") != nullptr);
 
-    return ret;
-}
+#ifdef FORTH_THREADS
+        // the spawned processes run on $FORTH_WORKERS threads
+        if( getenv("FORTH_WORKERS") ) {
+            vm->scheduler().setWorkers(static_cast<uint32_t>(atoi(getenv("FORTH_WORKERS"))));
+        }
+#endif
 
-int
-main(int argc, char* argv[]) {
-    SM::VM*  vm  = new SM::VM();
-
-    SM::String* core    = readFile("bootstrap.f");
-    if(core != nullptr) {
-        Forth::IInputStream::Ptr coreStream(new Forth::StringStream(core->c_str()));
-        Forth::Terminal::Ptr    term(new Forth::Terminal(vm));
-        term->loadStream(coreStream);
-        delete core;
+        // cppForth [image]: start from a saved image instead of compiling bootstrap.f
+        bool    ready   = false;
+        if( argc > 1 ) {
+            ready   = vm->loadImage(argv[1]);
+            if( !ready ) {
+                fprintf(stderr, "unable to load image %s", argv[1]);
+            }
+        } else {
+#ifdef FORTH_EMBEDDED_BOOTSTRAP
+            ready   = vm->loadImage(SM::BOOTSTRAP_IMAGE, SM::BOOTSTRAP_IMAGE_SIZE);
+            if( !ready ) {
+                fprintf(stderr, "unable to load the embedded bootstrap");
+            }
+#else
+            Forth::IInputStream::Ptr coreStream = Forth::MmapFileStream::open("bootstrap.f");
+            if( coreStream.get() != nullptr ) {
+                term->loadStream(coreStream);
+                ready   = true;
+            } else {
+                fprintf(stderr, "unable to load bootstrap.f");
+            }
+#endif
+        }
 
-        Forth::IInputStream::Ptr strm(new Forth::StdInStream());
-        term->loadStream(strm);
-    } else {
-        fprintf(stderr, "unable to load bootstrap.f");
+        if( ready ) {
+            Forth::IInputStream::Ptr strm(new Forth::StdInStream());
+            term->loadStream(strm);
+        }
     }
 
     delete vm;
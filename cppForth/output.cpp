@@ -0,0 +1,215 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "output.hpp"
+
+#if defined _WIN32 || defined __CYGWIN__
+#   define SM_OUTPUT_NO_WRITEV
+#   include <io.h>
+#else
+#   include <errno.h>
+#   include <unistd.h>
+#   include <sys/uio.h>
+#endif
+
+namespace SM {
+
+IOutputTarget::~IOutputTarget() {}
+
+////////////////////////////////////////////////////////////////////////////////
+// targets
+////////////////////////////////////////////////////////////////////////////////
+bool
+FdOutputTarget::writeAll(int fd, const Slice* slices, uint32_t count) {
+#ifdef SM_OUTPUT_NO_WRITEV
+    for( uint32_t i = 0; i < count; ++i ) {
+        const char* data    = slices[i].data;
+        size_t      left    = slices[i].length;
+        while( left ) {
+            int     n   = _write(fd, data, static_cast<unsigned int>(left));
+            if( n <= 0 ) {
+                return false;
+            }
+            data   += n;
+            left   -= static_cast<size_t>(n);
+        }
+    }
+    return true;
+#else
+    enum { MAX_IOV = 8 };
+
+    // copy the slices so partial writes can advance them
+    struct iovec    iov[MAX_IOV];
+    uint32_t        first   = 0;
+    uint32_t        last    = 0;
+    for( ; last < count && last < MAX_IOV; ++last ) {
+        iov[last].iov_base  = const_cast<char*>(slices[last].data);
+        iov[last].iov_len   = slices[last].length;
+    }
+
+    while( first < last ) {
+        ssize_t     n   = writev(fd, &iov[first], static_cast<int>(last - first));
+        if( n < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return false;
+        }
+
+        size_t      done    = static_cast<size_t>(n);
+        while( first < last && done >= iov[first].iov_len ) {
+            done   -= iov[first].iov_len;
+            ++first;
+        }
+
+        if( first < last ) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + done;
+            iov[first].iov_len -= done;
+        }
+    }
+
+    return count <= MAX_IOV ? true : writeAll(fd, slices + MAX_IOV, count - MAX_IOV);
+#endif
+}
+
+bool
+FdOutputTarget::write(const Slice* slices, uint32_t count) {
+    return writeAll(fd, slices, count);
+}
+
+FdOutputTarget::~FdOutputTarget() {
+}
+
+bool
+MemoryOutputTarget::write(const Slice* slices, uint32_t count) {
+    for( uint32_t i = 0; i < count; ++i ) {
+        size_t  at  = bytes.size();
+        bytes.resize(at + slices[i].length);
+        memcpy(&bytes[at], slices[i].data, slices[i].length);
+    }
+    return true;
+}
+
+MemoryOutputTarget::~MemoryOutputTarget() {
+}
+
+bool
+CallbackOutputTarget::write(const Slice* slices, uint32_t count) {
+    for( uint32_t i = 0; i < count; ++i ) {
+        cb(user, slices[i].data, slices[i].length);
+    }
+    return true;
+}
+
+CallbackOutputTarget::~CallbackOutputTarget() {
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// sink
+////////////////////////////////////////////////////////////////////////////////
+static const char DIGIT_PAIRS[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+void
+OutputSink::putInt(int32_t v) {
+    if( BUFFER_SIZE - used_ < MAX_INT_DIGITS ) {
+        flush();
+    }
+
+    // digits are written backward from the end of a scratch, two at a time
+    char        tmp[MAX_INT_DIGITS];
+    char*       end = tmp + MAX_INT_DIGITS;
+    char*       p   = end;
+    uint32_t    u   = v < 0 ? 0u - static_cast<uint32_t>(v) : static_cast<uint32_t>(v);
+
+    while( u >= 100 ) {
+        uint32_t    pair    = (u % 100) * 2;
+        u  /= 100;
+        *--p    = DIGIT_PAIRS[pair + 1];
+        *--p    = DIGIT_PAIRS[pair];
+    }
+
+    if( u >= 10 ) {
+        *--p    = DIGIT_PAIRS[u * 2 + 1];
+        *--p    = DIGIT_PAIRS[u * 2];
+    } else {
+        *--p    = static_cast<char>('0' + u);
+    }
+
+    if( v < 0 ) {
+        *--p    = '-';
+    }
+
+    memcpy(&buffer_[used_], p, static_cast<size_t>(end - p));
+    used_  += static_cast<uint32_t>(end - p);
+}
+
+void
+OutputSink::putHex(uint32_t v) {
+    static const char   HEX[]   = "0123456789ABCDEF";
+
+    if( BUFFER_SIZE - used_ < 8 ) {
+        flush();
+    }
+
+    uint32_t    digits  = 1;
+    while( digits < 8 && (v >> (digits * 4)) ) {
+        ++digits;
+    }
+
+    for( uint32_t i = digits; i > 0; --i ) {
+        buffer_[used_++]    = HEX[(v >> ((i - 1) * 4)) & 0xF];
+    }
+}
+
+void
+OutputSink::putLarge(const char* str, size_t len) {
+    // the buffered bytes and the large string leave in one call
+    IOutputTarget::Slice    slices[2]   = { { buffer_, used_ }, { str, len } };
+    write(slices, 2);
+    used_   = 0;
+}
+
+void
+OutputSink::flush() {
+    if( used_ == 0 ) {
+        return;
+    }
+
+    IOutputTarget::Slice    slice   = { buffer_, used_ };
+    write(&slice, 1);
+    used_   = 0;
+}
+
+void
+OutputSink::write(const IOutputTarget::Slice* slices, uint32_t count) {
+    // output errors (closed pipe...) drop the bytes, like stdio does
+    if( target_.get() ) {
+        target_->write(slices, count);
+    } else {
+        FdOutputTarget::writeAll(1, slices, count);
+    }
+}
+
+}   // namespace SM
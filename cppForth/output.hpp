@@ -0,0 +1,132 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __OUTPUT__HPP__
+#define __OUTPUT__HPP__
+
+#ifndef __SM_BASE__
+#   include "base.hpp"
+#endif
+
+#include "intrusive-ptr.hpp"
+#include "vector.hpp"
+
+namespace SM {
+
+///
+/// where the bytes of an OutputSink end up. write() gets the buffered bytes and,
+/// for large outputs, the bytes that bypassed the buffer, in order.
+///
+struct IOutputTarget : public RCObject {
+    typedef IntrusivePtr<IOutputTarget> Ptr;
+
+    struct Slice {
+        const char*     data;
+        size_t          length;
+    };
+
+    virtual bool            write(const Slice* slices, uint32_t count)  = 0;
+    virtual                 ~IOutputTarget()                            = 0;
+};
+
+// a file descriptor, written with writev
+struct FdOutputTarget : public IOutputTarget {
+    explicit FdOutputTarget(int fd) : fd(fd) {}
+
+    bool            write(const Slice* slices, uint32_t count) override;
+    ~FdOutputTarget() override;
+
+    static bool     writeAll(int fd, const Slice* slices, uint32_t count);
+
+    int             fd;
+};
+
+// bytes kept in memory (tests, embedding)
+struct MemoryOutputTarget : public IOutputTarget {
+    MemoryOutputTarget() {}
+
+    bool            write(const Slice* slices, uint32_t count) override;
+    ~MemoryOutputTarget() override;
+
+    Vector<char>    bytes;
+};
+
+// handed to the host
+struct CallbackOutputTarget : public IOutputTarget {
+    typedef void    (*Callback)(void* user, const char* data, size_t length);
+
+    CallbackOutputTarget(Callback cb, void* user) : cb(cb), user(user) {}
+
+    bool            write(const Slice* slices, uint32_t count) override;
+    ~CallbackOutputTarget() override;
+
+    Callback        cb;
+    void*           user;
+};
+
+///
+/// buffered text output of a process. The buffer is flushed when it is full, when
+/// flush() is called (before reading input, reporting errors or exiting) and when
+/// the sink is destroyed. Without a target the bytes go to the standard output.
+///
+struct OutputSink : public NonCopyable {
+    enum : uint32_t {
+        BUFFER_SIZE     = 4096,
+        MAX_INT_DIGITS  = 11,       // -2147483648
+    };
+
+    OutputSink() : used_(0) {}
+    ~OutputSink()                                   { flush(); }
+
+    inline void
+    putChar(char ch) {
+        if( used_ == BUFFER_SIZE ) {
+            flush();
+        }
+        buffer_[used_++]    = ch;
+    }
+
+    inline void
+    putString(const char* str, size_t len) {
+        if( len <= BUFFER_SIZE - used_ ) {
+            memcpy(&buffer_[used_], str, len);
+            used_  += static_cast<uint32_t>(len);
+        } else {
+            putLarge(str, len);
+        }
+    }
+
+    inline void     putString(const char* str)      { putString(str, strlen(str)); }
+
+    void            putInt(int32_t v);
+    void            putHex(uint32_t v);             // upper case, no prefix
+
+    void            flush();
+
+    inline void     setTarget(IOutputTarget::Ptr target)    { flush(); target_ = target; }
+    inline IOutputTarget::Ptr   target() const      { return target_; }
+
+private:
+    void            putLarge(const char* str, size_t len);
+    void            write(const IOutputTarget::Slice* slices, uint32_t count);
+
+    IOutputTarget::Ptr  target_;
+    uint32_t            used_;
+    char                buffer_[BUFFER_SIZE];
+};
+
+}   // namespace SM
+
+#endif  // __OUTPUT__HPP__
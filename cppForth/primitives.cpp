@@ -14,6 +14,7 @@
 ** along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 #include "forth.hpp"
+#include "scheduler.hpp"
 
 #include <cstdio>
 #include <cstdlib>
@@ -25,6 +26,14 @@ namespace SM {
     VM::Process::Value   V = proc->topValue(); \
     proc->popValue()
 
+// the worker threads read the segments while they run
+#define CHECK_NOT_SHARED()   \
+    if( proc->vm_->isShared() ) { proc->emitSignal(VM::Process::Signal(VM::Process::Signal::VM_IS_SHARED, proc->pid_, 0)); return; }
+
+// code and data emitted at run time count against the VM memory limit
+#define CHECK_MEMORY_LIMIT()   \
+    if( proc->vm_->isOverMemoryLimit() ) { proc->emitSignal(VM::Process::Signal(VM::Process::Signal::OUT_OF_MEMORY, proc->pid_, 0)); }
+
 void
 Primitives::fetchInt32(VM::Process* proc) {
     int32_t    u   = proc->fetch();
@@ -40,20 +49,30 @@ Primitives::returnWord(VM::Process* proc) {
 void
 Primitives::callIndirect(VM::Process* proc) {
     VS_POP(u);
-    proc->setCall(u.u32);
-    --proc->wp_;   // once outside the native, wp will get incremented, so decrement to stay at the start of the word
+    if( !proc->vm_->ensureCompiled(u.u32()) ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::WORD_NOT_IMPLEMENTED, proc->pid_, 0));
+        return;
+    }
+    proc->setIndirectCall(u.u32());
 }
 
 void
 Primitives::printInt32(VM::Process* proc) {
     VS_POP(v);
-    fprintf(stdout, "%d\n", v.i32);
+    proc->out_.putInt(v.i32());
+    proc->out_.putChar('\n');
 }
 
 void
 Primitives::printChar(VM::Process* proc) {
     VS_POP(v);
-    fprintf(stdout, "%c", static_cast<char>(v.i32));
+    proc->out_.putChar(static_cast<char>(v.i32()));
+}
+
+void
+Primitives::printString(VM::Process* proc) {
+    VS_POP(addr);
+    proc->out_.putString(proc->vm_->dataString(addr.u32()));
 }
 
 
@@ -61,41 +80,41 @@ void
 Primitives::addInt32(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.i32 + b.i32));
+    proc->pushValue(VM::Process::Value(a.i32() + b.i32()));
 }
 
 void
 Primitives::subInt32(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.i32 - b.i32));
+    proc->pushValue(VM::Process::Value(a.i32() - b.i32()));
 }
 
 void
 Primitives::mulInt32(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.i32 * b.i32));
+    proc->pushValue(VM::Process::Value(a.i32() * b.i32()));
 }
 
 void
 Primitives::divInt32(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.i32 / b.i32));
+    proc->pushValue(VM::Process::Value(a.i32() / b.i32()));
 }
 
 void
 Primitives::modInt32(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.i32 % b.i32));
+    proc->pushValue(VM::Process::Value(a.i32() % b.i32()));
 }
 
 void
 Primitives::branch(VM::Process* proc) {
     VS_POP(addr);
-    proc->setBranch(addr.i32 - 1);
+    proc->setBranch(addr.i32());
 }
 
 void
@@ -103,8 +122,8 @@ Primitives::branchIf(VM::Process* proc) {
     VS_POP(addr);
     VS_POP(cond);
 
-    if( cond.i32 != 0 ) {
-        proc->setBranch(addr.i32 - 1);
+    if( cond.i32() != 0 ) {
+        proc->setBranch(addr.i32());
     }
 }
 
@@ -138,81 +157,94 @@ Primitives::codeSize(VM::Process* proc) {
 void
 Primitives::emitWord(VM::Process* proc) {
     VS_POP(v);
-    proc->vm_->emit(v.u32);
+    CHECK_NOT_SHARED();
+    proc->vm_->emit(v.u32());
+    CHECK_MEMORY_LIMIT();
 }
 
 void
 Primitives::emitConstData(VM::Process* proc) {
     VS_POP(v);
-    proc->vm_->constDataSegment_.push_back(v);
+    CHECK_NOT_SHARED();
+    proc->vm_->emitData(&v, sizeof(v));
+    CHECK_MEMORY_LIMIT();
+}
+
+void
+Primitives::emitConstByte(VM::Process* proc) {
+    VS_POP(v);
+    CHECK_NOT_SHARED();
+    uint8_t b = static_cast<uint8_t>(v.u32());
+    proc->vm_->emitData(&b, 1);
+    CHECK_MEMORY_LIMIT();
 }
 
 void
 Primitives::emitException(VM::Process* proc) {
     VS_POP(v);
-    proc->emitSignal(VM::Process::Signal(VM::Process::Signal::EXCEPTION, proc->pid_, v.i32));
+    proc->emitSignal(VM::Process::Signal(VM::Process::Signal::EXCEPTION, proc->pid_, v.i32()));
 }
 
 void
 Primitives::ieq(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value((a.i32 == b.i32) ? -1 : 0));
+    proc->pushValue(VM::Process::Value((a.i32() == b.i32()) ? -1 : 0));
 }
 
 void
 Primitives::ineq(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value((a.i32 != b.i32) ? -1 : 0));
+    proc->pushValue(VM::Process::Value((a.i32() != b.i32()) ? -1 : 0));
 }
 
 void
 Primitives::igt(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.i32 > b.i32));
+    proc->pushValue(VM::Process::Value(a.i32() > b.i32()));
 }
 
 void
 Primitives::ilt(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.i32 < b.i32));
+    proc->pushValue(VM::Process::Value(a.i32() < b.i32()));
 }
 
 void
 Primitives::igeq(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.i32 >= b.i32));
+    proc->pushValue(VM::Process::Value(a.i32() >= b.i32()));
 }
 
 void
 Primitives::ileq(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.i32 <= b.i32));
+    proc->pushValue(VM::Process::Value(a.i32() <= b.i32()));
 }
 
 void
 Primitives::notBW(VM::Process* proc) {
     VS_POP(v);
-    proc->pushValue(VM::Process::Value(!v.u32));
+    proc->pushValue(VM::Process::Value(!v.u32()));
 }
 
 void
 Primitives::andBW(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.u32 & b.u32));
+    proc->pushValue(VM::Process::Value(a.u32() & b.u32()));
 }
 
 void
 Primitives::orBW(VM::Process* proc) {
     VS_POP(b);
     VS_POP(a);
-    proc->pushValue(VM::Process::Value(a.u32 | b.u32));
+    proc->pushValue(VM::Process::Value(a.u32() | b.u32()));
 }
 
 void
@@ -242,14 +274,14 @@ Primitives::cdsPtr(VM::Process* proc) {
 void
 Primitives::vsFetch(VM::Process* proc) {
     VS_POP(addr);
-    VM::Process::Value v = proc->valueStack_[addr.i32];
+    VM::Process::Value v = proc->valueStack_[addr.i32()];
     proc->pushValue(v);
 }
 
 void
 Primitives::rsFetch(VM::Process* proc) {
     VS_POP(addr);
-    VM::Process::Value v(static_cast<int32_t>(proc->returnStack_[addr.i32].ip));
+    VM::Process::Value v(static_cast<int32_t>(proc->returnStack_[addr.i32()].ip));
     proc->pushValue(v);
 }
 
@@ -257,9 +289,9 @@ void
 Primitives::lsFetch(VM::Process* proc) {
     VS_POP(addr);
 
-    uint32_t lp     = proc->lp_ + addr.u32;
+    uint32_t lp     = proc->lp_ + addr.u32();
 
-    VM::Process::Value v = proc->localStack_[lp];
+    VM::Process::Value v = proc->locals_.base[lp];
     proc->pushValue(v);
 }
 
@@ -267,14 +299,22 @@ void
 Primitives::wsFetch(VM::Process* proc) {
     VS_POP(addr);
 
-    VM::Process::Value v(static_cast<int32_t>(proc->vm_->wordSegment_[addr.i32]));
+    VM::Process::Value v(static_cast<int32_t>(proc->vm_->wordSegment_[addr.i32()]));
     proc->pushValue(v);
 }
 
 void
 Primitives::cdsFetch(VM::Process* proc) {
     VS_POP(addr);
-    VM::Process::Value v = proc->vm_->constDataSegment_[addr.i32];
+    VM::Process::Value v;
+    memcpy(&v, &proc->vm_->constDataSegment_[addr.i32()], sizeof(v));
+    proc->pushValue(v);
+}
+
+void
+Primitives::cdsFetchByte(VM::Process* proc) {
+    VS_POP(addr);
+    VM::Process::Value v(static_cast<uint32_t>(proc->vm_->constDataSegment_[addr.i32()]));
     proc->pushValue(v);
 }
 
@@ -283,7 +323,7 @@ Primitives::vsStore(VM::Process* proc) {
     VS_POP(addr);
     VS_POP(v);
 
-    proc->valueStack_[addr.i32] = v;
+    proc->valueStack_[addr.i32()] = v;
 }
 
 void
@@ -291,17 +331,17 @@ Primitives::lsStore(VM::Process* proc) {
     VS_POP(addr);
     VS_POP(v);
 
-    uint32_t lp     = proc->lp_ + addr.u32;
+    uint32_t lp     = proc->lp_ + addr.u32();
 
-    proc->localStack_[lp] = v;
+    proc->locals_.base[lp] = v;
 }
 
 void
 Primitives::wsStore(VM::Process* proc) {
     VS_POP(addr);
     VS_POP(v);
-
-    proc->vm_->wordSegment_[addr.i32] = v.u32;
+    CHECK_NOT_SHARED();
+    proc->vm_->patch(addr.i32(), v.u32());
 }
 
 void
@@ -309,7 +349,15 @@ Primitives::cdsStore(VM::Process* proc) {
     VS_POP(addr);
     VS_POP(v);
 
-    proc->vm_->constDataSegment_[addr.i32] = v;
+    memcpy(&proc->vm_->constDataSegment_[addr.i32()], &v, sizeof(v));
+}
+
+void
+Primitives::cdsStoreByte(VM::Process* proc) {
+    VS_POP(addr);
+    VS_POP(v);
+
+    proc->vm_->constDataSegment_[addr.i32()] = static_cast<uint8_t>(v.u32());
 }
 
 void
@@ -320,20 +368,268 @@ Primitives::bye(VM::Process* proc) {
 void
 Primitives::exit(VM::Process* proc) {
     VS_POP(ret);
-    ::exit(ret.i32);
+    proc->out_.flush();
+    ::exit(ret.i32());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// processes: a scheduled process hands its turn back with a signal, the host
+// (not scheduled) runs the others in place
+////////////////////////////////////////////////////////////////////////////////
+void
+Primitives::pid(VM::Process* proc) {
+    VM::Process::Value v(static_cast<int32_t>(proc->pid_));
+    proc->pushValue(v);
+}
+
+void
+Primitives::spawn(VM::Process* proc) {
+    VS_POP(w);
+    uint32_t    word    = w.u32();
+    if( word >= proc->vm_->wordCount() ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::WORD_ID_OUT_OF_RANGE, proc->pid_, 0));
+        return;
+    }
+
+    if( proc->vm_->isNativeWord(word) || !proc->vm_->ensureCompiled(word) ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::WORD_NOT_IMPLEMENTED, proc->pid_, 0));
+        return;
+    }
+
+    VM::Process::Value v(static_cast<int32_t>(proc->vm_->scheduler().spawn(proc, word)));
+    proc->pushValue(v);
+}
+
+void
+Primitives::yield(VM::Process* proc) {
+    Scheduler&  sched   = proc->vm_->scheduler();
+    if( sched.current() == proc ) {
+        proc->sig_ = VM::Process::Signal(VM::Process::Signal::YIELD, proc->pid_, 0);
+    } else {
+        proc->out_.flush();
+        sched.runRound();
+    }
+}
+
+void
+Primitives::join(VM::Process* proc) {
+    VS_POP(p);
+    Scheduler&  sched   = proc->vm_->scheduler();
+    uint32_t    pid     = p.u32();
+    if( pid == proc->pid_ || !sched.isRunning(pid) ) {
+        return;
+    }
+
+    if( sched.current() == proc ) {
+        proc->sig_ = VM::Process::Signal(VM::Process::Signal::JOIN, proc->pid_, pid);
+    } else {
+        proc->out_.flush();
+        sched.runUntil(pid);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// channels: the operands stay on the stack until the word completes, a scheduled
+// process that has to wait parks and runs the word again once woken
+////////////////////////////////////////////////////////////////////////////////
+static constexpr uint32_t   SEND_ID     = primitiveId("send");
+static constexpr uint32_t   RECEIVE_ID  = primitiveId("receive");
+static constexpr uint32_t   SELECT_ID   = primitiveId("select");
+
+static_assert(SEND_ID < PRIMITIVE_COUNT && RECEIVE_ID < PRIMITIVE_COUNT && SELECT_ID < PRIMITIVE_COUNT, "the blocking channel words are primitives");
+
+bool
+Primitives::waitChannels(VM::Process* proc, uint32_t word, const uint32_t* ids, uint32_t count, uint32_t kind) {
+    Scheduler&  sched   = proc->vm_->scheduler();
+    if( sched.current() == proc ) {
+        sched.waitFor(ids, count, static_cast<Scheduler::WaitKind>(kind));
+        proc->retry(word);
+        proc->sig_ = VM::Process::Signal(VM::Process::Signal::PARK, proc->pid_, 0);
+        return false;
+    }
+
+    proc->out_.flush();
+    if( !sched.runUntilReady(ids, count, static_cast<Scheduler::WaitKind>(kind)) ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::DEADLOCK, proc->pid_, ids[0]));
+        return false;
+    }
+    return true;
+}
+
+void
+Primitives::newChannel(VM::Process* proc) {
+    VS_POP(c);
+    uint32_t    id  = proc->vm_->scheduler().newChannel(c.u32(), Channel::MPMC);
+    if( id == 0 ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::BAD_CHANNEL, proc->pid_, 0));
+        return;
+    }
+    proc->pushValue(VM::Process::Value(static_cast<int32_t>(id)));
+}
+
+void
+Primitives::newSpscChannel(VM::Process* proc) {
+    VS_POP(c);
+    uint32_t    id  = proc->vm_->scheduler().newChannel(c.u32(), Channel::SPSC);
+    if( id == 0 ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::BAD_CHANNEL, proc->pid_, 0));
+        return;
+    }
+    proc->pushValue(VM::Process::Value(static_cast<int32_t>(id)));
+}
+
+void
+Primitives::mailbox(VM::Process* proc) {
+    VS_POP(p);
+    uint32_t    id  = proc->vm_->scheduler().mailbox(p.u32());
+    if( id == 0 ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::BAD_CHANNEL, proc->pid_, p.u32()));
+        return;
+    }
+    proc->pushValue(VM::Process::Value(static_cast<int32_t>(id)));
+}
+
+void
+Primitives::send(VM::Process* proc) {
+    size_t      size    = proc->valueStack_.size();
+    if( size < 2 ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::VS_UNDERFLOW, proc->pid_, 0));
+        return;
+    }
+
+    Scheduler&  sched   = proc->vm_->scheduler();
+    uint32_t    id      = proc->topValue().u32();
+    Channel*    ch      = sched.channel(id);
+    if( ch == nullptr || !ch->claimSender(proc->pid_) ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::BAD_CHANNEL, proc->pid_, id));
+        return;
+    }
+
+    VM::Process::Value  v   = proc->valueStack_[size - 2];
+    while( !ch->trySend(v) ) {
+        if( !waitChannels(proc, SEND_ID, &id, 1, Scheduler::WAIT_SEND) ) {
+            return;
+        }
+    }
+
+    proc->popValue();
+    proc->popValue();
+    sched.notify(id, Scheduler::WAIT_RECEIVE);
+}
+
+void
+Primitives::receive(VM::Process* proc) {
+    if( proc->valueStack_.size() == 0 ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::VS_UNDERFLOW, proc->pid_, 0));
+        return;
+    }
+
+    Scheduler&  sched   = proc->vm_->scheduler();
+    uint32_t    id      = proc->topValue().u32();
+    Channel*    ch      = sched.channel(id);
+    if( ch == nullptr || !ch->claimReceiver(proc->pid_) ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::BAD_CHANNEL, proc->pid_, id));
+        return;
+    }
+
+    VM::Process::Value  v;
+    while( !ch->tryReceive(v) ) {
+        if( !waitChannels(proc, RECEIVE_ID, &id, 1, Scheduler::WAIT_RECEIVE) ) {
+            return;
+        }
+    }
+
+    proc->popValue();
+    proc->pushValue(v);
+    sched.notify(id, Scheduler::WAIT_SEND);
+}
+
+void
+Primitives::tryReceive(VM::Process* proc) {
+    VS_POP(c);
+    Scheduler&  sched   = proc->vm_->scheduler();
+    Channel*    ch      = sched.channel(c.u32());
+    if( ch == nullptr || !ch->claimReceiver(proc->pid_) ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::BAD_CHANNEL, proc->pid_, c.u32()));
+        return;
+    }
+
+    VM::Process::Value  v;
+    if( ch->tryReceive(v) ) {
+        proc->pushValue(v);
+        proc->pushValue(VM::Process::Value(-1));
+        sched.notify(c.u32(), Scheduler::WAIT_SEND);
+    } else {
+        proc->pushValue(VM::Process::Value(0));
+    }
+}
+
+void
+Primitives::select(VM::Process* proc) {
+    size_t      size    = proc->valueStack_.size();
+    if( size == 0 ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::VS_UNDERFLOW, proc->pid_, 0));
+        return;
+    }
+
+    uint32_t    count   = proc->topValue().u32();
+    if( count == 0 || count > Scheduler::MAX_SELECT ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::BAD_CHANNEL, proc->pid_, 0));
+        return;
+    }
+
+    if( size < count + 1 ) {
+        proc->emitSignal(VM::Process::Signal(VM::Process::Signal::VS_UNDERFLOW, proc->pid_, 0));
+        return;
+    }
+
+    Scheduler&  sched   = proc->vm_->scheduler();
+    uint32_t    ids[Scheduler::MAX_SELECT];
+    Channel*    chs[Scheduler::MAX_SELECT];
+    for( uint32_t k = 0; k < count; ++k ) {
+        ids[k]  = proc->valueStack_[size - 1 - count + k].u32();
+        chs[k]  = sched.channel(ids[k]);
+        if( chs[k] == nullptr || !chs[k]->claimReceiver(proc->pid_) ) {
+            proc->emitSignal(VM::Process::Signal(VM::Process::Signal::BAD_CHANNEL, proc->pid_, ids[k]));
+            return;
+        }
+    }
+
+    for( ;; ) {
+        VM::Process::Value  v;
+        for( uint32_t k = 0; k < count; ++k ) {
+            if( chs[k]->tryReceive(v) ) {
+                for( uint32_t i = 0; i <= count; ++i ) {
+                    proc->popValue();
+                }
+                proc->pushValue(v);
+                proc->pushValue(VM::Process::Value(static_cast<int32_t>(ids[k])));
+                sched.notify(ids[k], Scheduler::WAIT_SEND);
+                return;
+            }
+        }
+
+        if( !waitChannels(proc, SELECT_ID, ids, count, Scheduler::WAIT_RECEIVE) ) {
+            return;
+        }
+    }
 }
 
 void
 Primitives::showValueStack(VM::Process* proc) {
     for( size_t i = 0; i < proc->valueStack_.size(); ++i ) {
-        fprintf(stdout, "vs@%d -- 0x%X\n", i, proc->valueStack_[i].u32);
+        proc->out_.putString("vs@");
+        proc->out_.putInt(static_cast<int32_t>(i));
+        proc->out_.putString(" -- 0x");
+        proc->out_.putHex(proc->valueStack_[i].u32());
+        proc->out_.putChar('\n');
     }
 }
 
 void
 Primitives::setDebugMode(VM::Process* proc) {
     VS_POP(v);
-    proc->vm_->verboseDebugging_   = v.u32 ? true : false;
+    proc->vm_->verboseDebugging_   = v.u32() ? true : false;
 }
 
 }   // namespace forth
@@ -0,0 +1,747 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "scheduler.hpp"
+
+#ifdef FORTH_THREADS
+#   include <sched.h>
+#endif
+
+namespace SM {
+
+// the process in its turn on this thread
+static __thread VM::Process*    current_    = nullptr;
+
+// the channels it parks on
+static __thread uint32_t        waitIds_[Scheduler::MAX_SELECT];
+static __thread uint32_t        waitCount_      = 0;
+static __thread uint32_t        waitKind_       = 0;
+
+#ifdef FORTH_THREADS
+// the worker running on this thread during a parallel run
+static __thread uint32_t        workerIndex_    = 0;
+#endif
+
+Scheduler&
+VM::scheduler() {
+    if( scheduler_ == nullptr ) {
+        AllocatorScope  scope(&pool_);
+        scheduler_  = new Scheduler(this);
+    }
+    return *scheduler_;
+}
+
+Scheduler::Scheduler(VM* vm) :
+    vm_(vm),
+#ifdef FORTH_THREADS
+    running_(heapAllocator()),      // grown by the worker threads
+#endif
+    nextPid_(FIRST_PID),
+    budget_(DEFAULT_BUDGET),
+    channelCount_(0),
+    mailboxes_(heapAllocator()),
+    hostWaitCount_(0),
+    hostWaitKind_(WAIT_RECEIVE)
+#ifdef FORTH_THREADS
+    ,
+    workerCount_(1),
+    waiting_(heapAllocator()),
+    active_(0),
+    stopPid_(0),
+    turnsLeft_(0),
+    oneRound_(false),
+    stop_(false),
+    parallel_(false)
+#endif
+    {
+    memset(channels_, 0, sizeof(channels_));
+#ifdef FORTH_THREADS
+    pthread_mutex_init(&pidLock_, nullptr);
+#endif
+}
+
+Scheduler::~Scheduler() {
+    // the parked processes go with their channels
+    for( uint32_t id = 1; id <= channelCount_; ++id ) {
+        delete entry(id);
+    }
+    for( uint32_t c = 0; c < MAX_CHANNEL_CHUNKS && channels_[c]; ++c ) {
+        delete[] channels_[c];
+    }
+
+#ifdef FORTH_THREADS
+    setWorkers(1);
+    pthread_mutex_destroy(&pidLock_);
+#endif
+}
+
+void
+Scheduler::lock() const {
+#ifdef FORTH_THREADS
+    if( parallel_ ) {
+        pthread_mutex_lock(&pidLock_);
+    }
+#endif
+}
+
+void
+Scheduler::unlock() const {
+#ifdef FORTH_THREADS
+    if( parallel_ ) {
+        pthread_mutex_unlock(&pidLock_);
+    }
+#endif
+}
+
+VM::Process*
+Scheduler::current() const {
+    return current_;
+}
+
+bool
+Scheduler::isRunning(uint32_t pid) const {
+    lock();
+    bool    running = testRunning(pid);
+    unlock();
+    return running;
+}
+
+bool
+Scheduler::hasProcesses() const {
+    bool    any     = false;
+    lock();
+    for( size_t i = 0; i < running_.size() && !any; ++i ) {
+        any = running_[i] != 0;
+    }
+    unlock();
+    return any;
+}
+
+void
+Scheduler::setRunning(uint32_t pid, bool running) {
+    if( (pid >> 5) >= running_.size() ) {
+        size_t  prev    = running_.size();
+        running_.resize((pid >> 5) + 1);
+        for( size_t i = prev; i < running_.size(); ++i ) {
+            running_[i] = 0;
+        }
+    }
+
+    if( running ) {
+        running_[pid >> 5] |= 1u << (pid & 31);
+    } else {
+        running_[pid >> 5] &= ~(1u << (pid & 31));
+    }
+}
+
+uint32_t
+Scheduler::spawn(VM::Process* parent, uint32_t word) {
+    IAllocator* allocator   = &vm_->pool();
+#ifdef FORTH_THREADS
+    // the pool is not shared, the workers may free or grow what is allocated here
+    if( workerCount_ > 1 ) {
+        allocator   = heapAllocator();
+    }
+#endif
+
+    lock();
+    uint32_t    pid     = nextPid_++;
+    setRunning(pid, true);
+    unlock();
+
+    Task        task;
+    {
+        // the stacks are released with the process
+        AllocatorScope  scope(allocator);
+        task.proc   = new VM::Process(parent, pid, vm_);
+    }
+    task.proc->start(word);
+    task.joining    = 0;
+
+#ifdef FORTH_THREADS
+    if( parallel_ ) {
+        // spawned by a process in its turn: on the deque of this worker
+        __atomic_add_fetch(&active_, 1, __ATOMIC_ACQ_REL);
+        push(*workers_[workerIndex_], task);
+        return pid;
+    }
+#endif
+
+    tasks_.push_back(task);
+    return pid;
+}
+
+bool
+Scheduler::runRound() {
+#ifdef FORTH_THREADS
+    if( workerCount_ > 1 ) {
+        return runParallel(0, true);
+    }
+#endif
+
+    bool    ran     = false;
+    size_t  i       = 0;
+    while( i < tasks_.size() ) {
+        if( tasks_[i].joining ) {
+            if( testRunning(tasks_[i].joining) ) {
+                ++i;
+                continue;
+            }
+            tasks_[i].joining   = 0;
+        }
+
+        // the turn can spawn and move the tasks
+        VM::Process::Ptr    proc    = tasks_[i].proc;
+        VM::Process*        prev    = current_;
+        current_    = proc.get();
+        bool        alive   = proc->resume(budget_);
+        current_    = prev;
+        ran         = true;
+
+        // the output comes out in turn order
+        proc->out().flush();
+
+        VM::Process::Signal sig = proc->signal();
+        if( alive && sig.ty == VM::Process::Signal::JOIN ) {
+            tasks_[i].joining   = sig.data;
+            proc->clearSignal();
+        } else if( alive && sig.ty == VM::Process::Signal::YIELD ) {
+            proc->clearSignal();
+        } else if( alive && sig.ty == VM::Process::Signal::PARK ) {
+            proc->clearSignal();
+            Task    task    = tasks_[i];
+            tasks_[i]   = tasks_.back();
+            tasks_.pop_back();
+            if( park(task) ) {
+                tasks_.push_back(task);
+            }
+            continue;
+        } else if( !alive || sig.ty != VM::Process::Signal::NONE ) {
+            // ended: the last task takes its place and has its turn next
+            setRunning(proc->pid(), false);
+            tasks_[i]   = tasks_.back();
+            tasks_.pop_back();
+            continue;
+        }
+        ++i;
+    }
+
+    return ran;
+}
+
+void
+Scheduler::runUntil(uint32_t pid) {
+#ifdef FORTH_THREADS
+    if( workerCount_ > 1 ) {
+        runParallel(pid);
+        return;
+    }
+#endif
+
+    while( testRunning(pid) && runRound() ) {
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// channels
+////////////////////////////////////////////////////////////////////////////////
+Scheduler::ChannelEntry::ChannelEntry(uint32_t capacity, Channel::Kind kind) :
+    channel(capacity, kind) {
+    waiters[WAIT_RECEIVE]   = 0;
+    waiters[WAIT_SEND]      = 0;
+    sweepAt[WAIT_RECEIVE]   = MIN_SWEEP;
+    sweepAt[WAIT_SEND]      = MIN_SWEEP;
+#ifdef FORTH_THREADS
+    pthread_mutex_init(&lock, nullptr);
+#endif
+}
+
+Scheduler::ChannelEntry::~ChannelEntry() {
+#ifdef FORTH_THREADS
+    pthread_mutex_destroy(&lock);
+#endif
+}
+
+uint32_t
+Scheduler::addChannel(uint32_t capacity, Channel::Kind kind) {
+    uint32_t    id      = channelCount_ + 1;
+    uint32_t    chunk   = (id - 1) / CHANNEL_CHUNK;
+    if( chunk >= MAX_CHANNEL_CHUNKS ) {
+        return 0;
+    }
+
+    // the entries never move, the workers look them up without the lock
+    AllocatorScope  scope(heapAllocator());
+    if( channels_[chunk] == nullptr ) {
+        channels_[chunk]    = new ChannelEntry*[CHANNEL_CHUNK];
+    }
+    channels_[chunk][(id - 1) % CHANNEL_CHUNK]  = new ChannelEntry(capacity, kind);
+    __atomic_store_n(&channelCount_, id, __ATOMIC_RELEASE);
+    return id;
+}
+
+uint32_t
+Scheduler::newChannel(uint32_t capacity, Channel::Kind kind) {
+    lock();
+    uint32_t    id  = addChannel(capacity, kind);
+    unlock();
+    return id;
+}
+
+Channel*
+Scheduler::channel(uint32_t id) const {
+    if( id == 0 || id > __atomic_load_n(&channelCount_, __ATOMIC_ACQUIRE) ) {
+        return nullptr;
+    }
+    return &entry(id)->channel;
+}
+
+uint32_t
+Scheduler::mailbox(uint32_t pid) {
+    uint32_t    id  = 0;
+    lock();
+    if( pid < nextPid_ ) {
+        HashMap<uint32_t, uint32_t>::Iterator it = mailboxes_.find(pid);
+        if( it != mailboxes_.end() ) {
+            id  = it.value();
+        } else {
+            id  = addChannel(MAILBOX_CAPACITY, Channel::MPMC);
+            if( id ) {
+                mailboxes_.insert(pid, id);
+            }
+        }
+    }
+    unlock();
+    return id;
+}
+
+void
+Scheduler::waitFor(const uint32_t* ids, uint32_t count, WaitKind kind) {
+    for( uint32_t i = 0; i < count; ++i ) {
+        waitIds_[i] = ids[i];
+    }
+    waitCount_  = count;
+    waitKind_   = kind;
+}
+
+void
+Scheduler::requeue(const Task& task) {
+#ifdef FORTH_THREADS
+    if( parallel_ ) {
+        __atomic_add_fetch(&active_, 1, __ATOMIC_ACQ_REL);
+        push(*workers_[workerIndex_], task);
+        return;
+    }
+#endif
+    tasks_.push_back(task);
+}
+
+void
+Scheduler::sweep(ChannelEntry* e, uint32_t kind) {
+    // the tasks woken by another channel (or by themselves) are still listed here
+    Vector<Parking::Ptr>&   parked  = e->parked[kind];
+    size_t  kept    = 0;
+    for( size_t i = 0; i < parked.size(); ++i ) {
+        if( __atomic_load_n(&parked[i]->woken, __ATOMIC_ACQUIRE) == 0 ) {
+            parked[kept++]  = parked[i];
+        }
+    }
+
+    uint32_t    dropped = static_cast<uint32_t>(parked.size() - kept);
+    while( parked.size() > kept ) {
+        parked.pop_back();
+    }
+    __atomic_sub_fetch(&e->waiters[kind], dropped, __ATOMIC_SEQ_CST);
+
+    // swept again once it has doubled: a constant cost per park
+    e->sweepAt[kind]    = kept * 2 > MIN_SWEEP ? static_cast<uint32_t>(kept * 2) : static_cast<uint32_t>(MIN_SWEEP);
+}
+
+bool
+Scheduler::park(const Task& task) {
+    Parking::Ptr    p;
+    {
+        AllocatorScope  scope(heapAllocator());
+        p   = new Parking();
+    }
+    p->task     = task;
+    p->woken    = 0;
+
+    for( uint32_t i = 0; i < waitCount_; ++i ) {
+        ChannelEntry*   e   = entry(waitIds_[i]);
+#ifdef FORTH_THREADS
+        pthread_mutex_lock(&e->lock);
+#endif
+        if( e->parked[waitKind_].size() >= e->sweepAt[waitKind_] ) {
+            sweep(e, waitKind_);
+        }
+        e->parked[waitKind_].push_back(p);
+        __atomic_add_fetch(&e->waiters[waitKind_], 1, __ATOMIC_SEQ_CST);
+#ifdef FORTH_THREADS
+        pthread_mutex_unlock(&e->lock);
+#endif
+    }
+
+    // a value (or room) that came before the waiters were counted would wake no one:
+    // the process stays in turn if it can take itself back
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for( uint32_t i = 0; i < waitCount_; ++i ) {
+        if( isReady(&entry(waitIds_[i])->channel, static_cast<WaitKind>(waitKind_)) ) {
+            uint32_t    expected    = 0;
+            if( __atomic_compare_exchange_n(&p->woken, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+                p->task.proc    = nullptr;
+                return true;
+            }
+            break;
+        }
+    }
+    return false;
+}
+
+void
+Scheduler::notify(uint32_t id, WaitKind kind) {
+    ChannelEntry*   e   = entry(id);
+
+    // pairs with the fence in park(): either the waiter is counted here or it sees the change
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if( __atomic_load_n(&e->waiters[kind], __ATOMIC_RELAXED) ) {
+#ifdef FORTH_THREADS
+        pthread_mutex_lock(&e->lock);
+#endif
+        Vector<Parking::Ptr>&   parked  = e->parked[kind];
+        for( size_t i = 0; i < parked.size(); ++i ) {
+            uint32_t    expected    = 0;
+            if( __atomic_compare_exchange_n(&parked[i]->woken, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+                requeue(parked[i]->task);
+                parked[i]->task.proc    = nullptr;
+            }
+        }
+        __atomic_sub_fetch(&e->waiters[kind], static_cast<uint32_t>(parked.size()), __ATOMIC_SEQ_CST);
+        parked.clear();
+#ifdef FORTH_THREADS
+        pthread_mutex_unlock(&e->lock);
+#endif
+    }
+
+#ifdef FORTH_THREADS
+    if( parallel_ && hostWaitKind_ == kind ) {
+        for( uint32_t i = 0; i < hostWaitCount_; ++i ) {
+            if( hostWait_[i] == id ) {
+                __atomic_store_n(&stop_, true, __ATOMIC_RELEASE);
+            }
+        }
+    }
+#endif
+}
+
+bool
+Scheduler::runUntilReady(const uint32_t* ids, uint32_t count, WaitKind kind) {
+    for( ;; ) {
+        for( uint32_t i = 0; i < count; ++i ) {
+            if( isReady(&entry(ids[i])->channel, kind) ) {
+                return true;
+            }
+        }
+
+#ifdef FORTH_THREADS
+        if( workerCount_ > 1 ) {
+            for( uint32_t i = 0; i < count; ++i ) {
+                hostWait_[i]    = ids[i];
+            }
+            hostWaitCount_  = count;
+            hostWaitKind_   = kind;
+            bool    ran     = runParallel(0);
+            hostWaitCount_  = 0;
+            if( !ran ) {
+                return false;
+            }
+            continue;
+        }
+#endif
+
+        if( !runRound() ) {
+            return false;
+        }
+    }
+}
+
+#ifdef FORTH_THREADS
+////////////////////////////////////////////////////////////////////////////////
+// worker threads
+////////////////////////////////////////////////////////////////////////////////
+void
+Scheduler::setWorkers(uint32_t count) {
+    if( parallel_ ) {
+        return;
+    }
+
+    for( size_t i = 0; i < workers_.size(); ++i ) {
+        pthread_mutex_destroy(&workers_[i]->lock);
+        delete workers_[i];
+    }
+    workers_.clear();
+
+    workerCount_    = count ? count : 1;
+    if( workerCount_ == 1 ) {
+        return;
+    }
+
+    AllocatorScope  scope(heapAllocator());
+    for( uint32_t i = 0; i < workerCount_; ++i ) {
+        Worker*     w   = new Worker();
+        w->sched    = this;
+        w->index    = i;
+        w->seed     = 2463534242u + i;
+        w->head     = 0;
+        w->count    = 0;
+        w->ring.resize(64);
+        pthread_mutex_init(&w->lock, nullptr);
+        workers_.push_back(w);
+    }
+}
+
+void
+Scheduler::push(Worker& w, const Task& task) {
+    pthread_mutex_lock(&w.lock);
+    uint32_t    capacity    = static_cast<uint32_t>(w.ring.size());
+    if( w.count == capacity ) {
+        // unrolled in order into a ring twice as large
+        Vector<Task>    ring(heapAllocator());
+        ring.resize(capacity << 1);
+        for( uint32_t i = 0; i < w.count; ++i ) {
+            ring[i] = w.ring[(w.head + i) & (capacity - 1)];
+        }
+        w.ring  = SM::move(ring);
+        w.head  = 0;
+        capacity <<= 1;
+    }
+
+    w.ring[(w.head + w.count) & (capacity - 1)] = task;
+    __atomic_store_n(&w.count, w.count + 1, __ATOMIC_RELAXED);   // peeked at by the thieves
+    pthread_mutex_unlock(&w.lock);
+}
+
+bool
+Scheduler::take(Worker& w, Task& task) {
+    bool    found   = false;
+    pthread_mutex_lock(&w.lock);
+    if( w.count ) {
+        Task&   front   = w.ring[w.head];
+        task        = front;
+        front.proc  = nullptr;
+        w.head      = (w.head + 1) & (static_cast<uint32_t>(w.ring.size()) - 1);
+        __atomic_store_n(&w.count, w.count - 1, __ATOMIC_RELAXED);
+        found       = true;
+    }
+    pthread_mutex_unlock(&w.lock);
+    return found;
+}
+
+bool
+Scheduler::steal(Worker& w, Task& task) {
+    // xorshift: the victims are tried from a random one on
+    w.seed ^= w.seed << 13;
+    w.seed ^= w.seed >> 17;
+    w.seed ^= w.seed << 5;
+
+    uint32_t    count   = static_cast<uint32_t>(workers_.size());
+    for( uint32_t k = 0; k < count; ++k ) {
+        Worker&     victim  = *workers_[(w.seed + k) % count];
+        if( &victim == &w || __atomic_load_n(&victim.count, __ATOMIC_RELAXED) == 0 ) {
+            continue;
+        }
+
+        bool        found   = false;
+        pthread_mutex_lock(&victim.lock);
+        if( victim.count ) {
+            __atomic_store_n(&victim.count, victim.count - 1, __ATOMIC_RELAXED);
+            Task&   back    = victim.ring[(victim.head + victim.count) & (static_cast<uint32_t>(victim.ring.size()) - 1)];
+            task        = back;
+            back.proc   = nullptr;
+            found       = true;
+        }
+        pthread_mutex_unlock(&victim.lock);
+
+        if( found ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+Scheduler::endTurn(Worker& w, Task& task, bool alive) {
+    VM::Process::Signal sig = task.proc->signal();
+    if( alive && sig.ty == VM::Process::Signal::JOIN ) {
+        task.proc->clearSignal();
+
+        pthread_mutex_lock(&pidLock_);
+        bool    waits   = testRunning(sig.data);
+        if( waits ) {
+            task.joining    = sig.data;
+            waiting_.push_back(task);
+        }
+        pthread_mutex_unlock(&pidLock_);
+
+        if( waits ) {
+            __atomic_sub_fetch(&active_, 1, __ATOMIC_ACQ_REL);
+        } else {
+            push(w, task);
+        }
+        return;
+    }
+
+    if( alive && (sig.ty == VM::Process::Signal::NONE || sig.ty == VM::Process::Signal::YIELD) ) {
+        task.proc->clearSignal();
+        push(w, task);
+        return;
+    }
+
+    if( alive && sig.ty == VM::Process::Signal::PARK ) {
+        task.proc->clearSignal();
+        if( park(task) ) {
+            push(w, task);
+        } else {
+            __atomic_sub_fetch(&active_, 1, __ATOMIC_ACQ_REL);
+        }
+        return;
+    }
+
+    // ended: its joiners are ready again (counted before it leaves, so the count
+    // only reaches 0 when nothing can run)
+    uint32_t    pid     = task.proc->pid();
+    pthread_mutex_lock(&pidLock_);
+    setRunning(pid, false);
+    size_t  i   = 0;
+    while( i < waiting_.size() ) {
+        if( waiting_[i].joining != pid ) {
+            ++i;
+            continue;
+        }
+
+        waiting_[i].joining = 0;
+        __atomic_add_fetch(&active_, 1, __ATOMIC_ACQ_REL);
+        push(w, waiting_[i]);
+        waiting_[i] = waiting_.back();
+        waiting_.pop_back();
+    }
+    pthread_mutex_unlock(&pidLock_);
+
+    if( pid == stopPid_ ) {
+        __atomic_store_n(&stop_, true, __ATOMIC_RELEASE);
+    }
+    __atomic_sub_fetch(&active_, 1, __ATOMIC_ACQ_REL);
+}
+
+void
+Scheduler::work(Worker& w) {
+    workerIndex_    = w.index;
+
+    Task    task;
+    while( !__atomic_load_n(&stop_, __ATOMIC_ACQUIRE) ) {
+        if( !take(w, task) && !steal(w, task) ) {
+            if( __atomic_load_n(&active_, __ATOMIC_ACQUIRE) == 0 ) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+
+        current_    = task.proc.get();
+        bool    alive   = task.proc->resume(budget_);
+        current_    = nullptr;
+
+        task.proc->out().flush();
+        endTurn(w, task, alive);
+        task.proc   = nullptr;
+
+        if( oneRound_ && __atomic_sub_fetch(&turnsLeft_, 1, __ATOMIC_ACQ_REL) == 0 ) {
+            __atomic_store_n(&stop_, true, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+void*
+Scheduler::threadMain(void* worker) {
+    Worker* w   = static_cast<Worker*>(worker);
+    w->sched->work(*w);
+    return nullptr;
+}
+
+bool
+Scheduler::runParallel(uint32_t pid, bool oneRound) {
+    // the waiting tasks stay in tasks_ between the runs
+    uint32_t    queued  = 0;
+    for( size_t i = 0; i < tasks_.size(); ++i ) {
+        Task&   task    = tasks_[i];
+        if( task.joining && testRunning(task.joining) ) {
+            waiting_.push_back(task);
+        } else {
+            task.joining    = 0;
+            push(*workers_[queued % workerCount_], task);
+            ++queued;
+        }
+    }
+    tasks_.clear();
+
+    if( queued ) {
+        vm_->setShared(true);
+        active_     = queued;
+        stopPid_    = pid;
+        turnsLeft_  = queued;
+        oneRound_   = oneRound;
+        stop_       = false;
+        parallel_   = true;
+
+        // the host thread is the first worker, a thread that can not start leaves its
+        // deque to the thieves
+        for( uint32_t i = 1; i < workerCount_; ++i ) {
+            if( pthread_create(&workers_[i]->thread, nullptr, threadMain, workers_[i]) != 0 ) {
+                workers_[i]->thread = pthread_self();
+            }
+        }
+
+        {
+            AllocatorScope  scope(heapAllocator());
+            work(*workers_[0]);
+        }
+
+        for( uint32_t i = 1; i < workerCount_; ++i ) {
+            if( !pthread_equal(workers_[i]->thread, pthread_self()) ) {
+                pthread_join(workers_[i]->thread, nullptr);
+            }
+        }
+
+        parallel_   = false;
+        vm_->setShared(false);
+    }
+
+    // back to one turn order
+    Task    task;
+    for( uint32_t i = 0; i < workerCount_; ++i ) {
+        while( take(*workers_[i], task) ) {
+            tasks_.push_back(task);
+        }
+    }
+    for( size_t i = 0; i < waiting_.size(); ++i ) {
+        tasks_.push_back(waiting_[i]);
+    }
+    waiting_.clear();
+
+    return queued != 0;
+}
+#endif
+
+}   // namespace SM
@@ -0,0 +1,223 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SCHEDULER__HPP__
+#define __SCHEDULER__HPP__
+
+#ifndef __SM_BASE__
+#   include "base.hpp"
+#endif
+
+#include "vm.hpp"
+#include "channel.hpp"
+
+#ifdef FORTH_THREADS
+#   include <pthread.h>
+#endif
+
+namespace SM {
+
+///
+/// cooperative scheduler: the processes it owns run in turn on the host thread, each
+/// for at most budget() instructions per turn. A process only leaves between two
+/// instructions (its budget is spent, it yields or it joins a running process) and
+/// keeps its own stacks, so a switch is a return from resume() and the next call.
+///
+/// The host process (the terminal) is not scheduled: its yield runs every ready
+/// process once, its join runs them until the joined one has ended. A process that
+/// ends (returns from its word or stops on a signal) is released.
+///
+/// With FORTH_THREADS and more than one worker, the host's yield and join run the
+/// processes on that many threads instead (the host thread is the first worker)
+/// and the yield ends once as many turns as there were ready processes have been
+/// taken (a round, whichever worker took them). Each worker takes turns from its own
+/// deque, puts back the processes it spawns or wakes there and steals from the
+/// back of another deque when its own is empty. The VM is shared meanwhile (see
+/// VM::setShared).
+///
+/// Channels are numbered from 1 and live as long as the scheduler, a process has a
+/// mailbox (an MPMC channel) once asked for. A process that can not send or receive
+/// parks on the channels it waits for and is put back in turn by the next process
+/// receiving from or sending to one of them. The host runs the others instead.
+///
+struct Scheduler : public NonCopyable {
+    enum : uint32_t {
+        DEFAULT_BUDGET      = 1024,     // instructions per turn
+        FIRST_PID           = 1,        // 0 is the host
+        MAX_SELECT          = 16,       // channels a process waits on at once
+        MAILBOX_CAPACITY    = 256,
+    };
+
+    enum WaitKind : uint32_t {
+        WAIT_RECEIVE        = 0,        // for a value
+        WAIT_SEND           = 1,        // for room
+    };
+
+    explicit Scheduler(VM* vm);
+    ~Scheduler();
+
+    inline void         setBudget(uint32_t count)   { budget_ = count ? count : 1; }
+    inline uint32_t     budget() const              { return budget_; }
+
+#ifdef FORTH_THREADS
+    // set before spawning: the stacks of the processes spawned before are in the VM pool
+    void                setWorkers(uint32_t count);
+    inline uint32_t     workers() const             { return workerCount_; }
+#endif
+
+    // the process in its turn on this thread, nullptr while the host runs
+    VM::Process*        current() const;
+    inline uint32_t     processCount() const        { return static_cast<uint32_t>(tasks_.size()); }
+
+    // a new process calling word (a defined word) on its first turn, its pid
+    uint32_t            spawn(VM::Process* parent, uint32_t word);
+
+    bool                isRunning(uint32_t pid) const;
+    // a process has not ended yet: in turn, joining or parked
+    bool                hasProcesses() const;
+
+    // one turn for every process that is not waiting, false when none could run
+    bool                runRound();
+    // turns until pid has ended or no process can run (the others wait on each other)
+    void                runUntil(uint32_t pid);
+    inline void         runAll()                    { while( tasks_.size() && runRound() ) {} }
+
+    // a new channel id, 0 when there are too many
+    uint32_t            newChannel(uint32_t capacity, Channel::Kind kind);
+    // nullptr for an id that is not a channel
+    Channel*            channel(uint32_t id) const;
+    // the mailbox channel of a process, 0 for a pid never given
+    uint32_t            mailbox(uint32_t pid);
+
+    // after a send (WAIT_RECEIVE) or a receive (WAIT_SEND): the processes parked
+    // on that side of the channel go back in turn
+    void                notify(uint32_t id, WaitKind kind);
+
+    // the process in its turn raises PARK after naming the channels (valid ids)
+    void                waitFor(const uint32_t* ids, uint32_t count, WaitKind kind);
+    // the host: runs the processes until one of the channels is ready or none can run
+    bool                runUntilReady(const uint32_t* ids, uint32_t count, WaitKind kind);
+
+private:
+    struct Task {
+        VM::Process::Ptr    proc;
+        uint32_t            joining;    // pid waited for, 0: none
+    };
+
+    // a parked task is in the lists of all the channels it waits on, the first one
+    // to wake it takes it, the others drop it on their next wake or when their list
+    // has doubled since it was last swept
+    struct Parking : public RCObject {
+        typedef IntrusivePtr<Parking>   Ptr;
+
+        Task                task;
+        uint32_t            woken;      // atomic
+    };
+
+    struct ChannelEntry {
+        ChannelEntry(uint32_t capacity, Channel::Kind kind);
+        ~ChannelEntry();
+
+        Channel             channel;
+        uint32_t            waiters[2]; // parked per WaitKind (atomic)
+        Vector<Parking::Ptr>    parked[2];
+        uint32_t            sweepAt[2]; // parked size dropping the woken ones
+#ifdef FORTH_THREADS
+        pthread_mutex_t     lock;       // parked
+#endif
+    };
+
+    enum : uint32_t {
+        CHANNEL_CHUNK       = 1024,
+        MAX_CHANNEL_CHUNKS  = 1024,
+        MIN_SWEEP           = 16,
+    };
+
+    inline ChannelEntry*    entry(uint32_t id) const    { return channels_[(id - 1) / CHANNEL_CHUNK][(id - 1) % CHANNEL_CHUNK]; }
+    static bool         isReady(Channel* ch, WaitKind kind)  { return kind == WAIT_RECEIVE ? !ch->isEmpty() : !ch->isFull(); }
+
+    static void         sweep(ChannelEntry* e, uint32_t kind);  // e locked
+    bool                park(const Task& task);    // true: ready already, stays in turn
+    void                requeue(const Task& task);
+
+    inline bool
+    testRunning(uint32_t pid) const {
+        return (pid >> 5) < running_.size() && ((running_[pid >> 5] >> (pid & 31)) & 1);
+    }
+
+    void                setRunning(uint32_t pid, bool running);
+
+    // the scheduler lock while the workers run, nothing otherwise
+    void                lock() const;
+    void                unlock() const;
+
+    uint32_t            addChannel(uint32_t capacity, Channel::Kind kind);
+
+#ifdef FORTH_THREADS
+    struct Worker {
+        Scheduler*          sched;
+        uint32_t            index;
+        uint32_t            seed;       // victim choice
+        pthread_t           thread;
+        pthread_mutex_t     lock;       // the deque
+        Vector<Task>        ring;       // power of 2 capacity
+        uint32_t            head;
+        uint32_t            count;
+    };
+
+    // pid 0: until no process can run, or a round only
+    bool                runParallel(uint32_t pid, bool oneRound = false);
+    void                work(Worker& w);
+    void                endTurn(Worker& w, Task& task, bool alive);
+
+    void                push(Worker& w, const Task& task);
+    bool                take(Worker& w, Task& task);   // own deque, front
+    bool                steal(Worker& w, Task& task);  // another deque, back
+
+    static void*        threadMain(void* worker);
+#endif
+
+    VM*                 vm_;
+    Vector<Task>        tasks_;         // turn order
+    Vector<uint32_t>    running_;       // bit per pid
+    uint32_t            nextPid_;
+    uint32_t            budget_;
+
+    ChannelEntry**      channels_[MAX_CHANNEL_CHUNKS];
+    uint32_t            channelCount_;  // atomic
+    HashMap<uint32_t, uint32_t> mailboxes_;     // pid -> channel
+
+    // the channels the host waits on
+    uint32_t            hostWait_[MAX_SELECT];
+    uint32_t            hostWaitCount_;
+    WaitKind            hostWaitKind_;
+
+#ifdef FORTH_THREADS
+    Vector<Worker*>     workers_;
+    uint32_t            workerCount_;
+    Vector<Task>        waiting_;       // joining a running process, during a parallel run
+    mutable pthread_mutex_t pidLock_;   // running_, nextPid_, waiting_, the channel table and the mailboxes during a parallel run
+    uint32_t            active_;        // processes queued or in a turn (atomic)
+    uint32_t            stopPid_;
+    uint32_t            turnsLeft_;     // in the round (atomic)
+    bool                oneRound_;
+    bool                stop_;          // stopPid_ has ended (atomic)
+    bool                parallel_;
+#endif
+};
+
+}   // namespace SM
+
+#endif  // __SCHEDULER__HPP__
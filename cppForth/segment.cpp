@@ -0,0 +1,139 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "segment.hpp"
+
+#ifdef FORTH_VM_SEGMENTS
+
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace SM {
+
+static __thread FaultTrap*  currentTrap_    = nullptr;
+static struct sigaction     prevSegvAction_;
+static struct sigaction     prevBusAction_;
+static bool                 handlerInstalled_   = false;
+static size_t               pageSize_           = 0;    // set with the handler
+
+static void
+guardFaultHandler(int, siginfo_t* info, void*) {
+    FaultTrap* trap = currentTrap_;
+
+    if( trap ) {
+        for( uint32_t r = 0; r < trap->regionCount; ++r ) {
+            const VMRegion* region  = trap->regions[r];
+            bool            upper   = region->inUpperGuard(info->si_addr);
+            if( upper || region->inLowerGuard(info->si_addr) ) {
+                trap->kind      = region->kind();
+                trap->overflow  = upper;
+                siglongjmp(trap->env, 1);
+            }
+        }
+    }
+
+    // not a guard page: restore the previous handler, the faulting instruction will be replayed
+    sigaction(SIGSEGV, &prevSegvAction_, nullptr);
+    sigaction(SIGBUS, &prevBusAction_, nullptr);
+}
+
+static void
+installHandler() {
+    if( handlerInstalled_ ) {
+        return;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = guardFaultHandler;
+    sa.sa_flags     = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(SIGSEGV, &sa, &prevSegvAction_);
+    sigaction(SIGBUS, &sa, &prevBusAction_);
+    pageSize_           = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    handlerInstalled_   = true;
+}
+
+size_t
+VMRegion::pageSize() {
+    return pageSize_ ? pageSize_ : static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+void*
+VMRegion::reserve(size_t bytes, RegionKind kind) {
+    size_t  page    = pageSize();
+    size_t  usable  = (bytes + page - 1) & ~(page - 1);
+
+    installHandler();
+
+    // [guard][usable][guard]
+    void*   mem     = mmap(nullptr, usable + 2 * page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if( mem == MAP_FAILED ) {
+        fprintf(stderr, "unable to reserve %lu bytes\n", static_cast<unsigned long>(usable));
+        return nullptr;
+    }
+
+    base_   = static_cast<uint8_t*>(mem) + page;
+    bytes_  = usable;
+    kind_   = kind;
+
+    if( mprotect(base_, bytes_, PROT_READ | PROT_WRITE) != 0 ) {
+        munmap(mem, usable + 2 * page);
+        base_   = nullptr;
+        bytes_  = 0;
+        return nullptr;
+    }
+
+    return base_;
+}
+
+void
+VMRegion::release() {
+    if( base_ ) {
+        munmap(base_ - pageSize(), bytes_ + 2 * pageSize());
+        base_   = nullptr;
+        bytes_  = 0;
+    }
+}
+
+bool
+VMRegion::inLowerGuard(const void* addr) const {
+    const uint8_t* a = static_cast<const uint8_t*>(addr);
+    return base_ && a < base_ && a >= base_ - pageSize();
+}
+
+bool
+VMRegion::inUpperGuard(const void* addr) const {
+    const uint8_t* a = static_cast<const uint8_t*>(addr);
+    return base_ && a >= base_ + bytes_ && a < base_ + bytes_ + pageSize();
+}
+
+void
+FaultTrap::enter() {
+    prev            = currentTrap_;
+    currentTrap_    = this;
+}
+
+void
+FaultTrap::leave() {
+    currentTrap_    = prev;
+}
+
+}   // namespace SM
+
+#endif  // FORTH_VM_SEGMENTS
@@ -0,0 +1,141 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SEGMENT__HPP__
+#define __SEGMENT__HPP__
+
+#ifndef __SM_BASE__
+#   include "base.hpp"
+#endif
+
+#ifdef FORTH_VM_SEGMENTS
+
+#if defined _WIN32 || defined __CYGWIN__
+#   error "FORTH_VM_SEGMENTS requires mmap and sigaction"
+#endif
+
+#include "allocator.hpp"
+
+#include <setjmp.h>
+
+namespace SM {
+
+enum RegionKind {
+    VALUE_STACK_REGION,
+    RETURN_STACK_REGION,
+    LOCAL_STACK_REGION,
+    CODE_SEGMENT_REGION,
+    DATA_SEGMENT_REGION,
+};
+
+///
+/// a reserved range of virtual memory surrounded by two PROT_NONE guard pages.
+/// Pages are committed by the kernel when first touched, so the region never
+/// moves and never needs to be grown explicitly.
+///
+struct VMRegion : public NonCopyable {
+    VMRegion() : base_(nullptr), bytes_(0), kind_(VALUE_STACK_REGION) {}
+    ~VMRegion()     { release(); }
+
+    void*           reserve(size_t bytes, RegionKind kind);
+    void            release();
+
+    inline RegionKind   kind() const    { return kind_; }
+
+    // the guard right before the first element, hit when popping an empty stack
+    bool            inLowerGuard(const void* addr) const;
+    // the guard right after the last page, hit when the region is full
+    bool            inUpperGuard(const void* addr) const;
+
+    static size_t   pageSize();
+
+private:
+    uint8_t*        base_;      // first usable byte
+    size_t          bytes_;     // usable bytes (page aligned)
+    RegionKind      kind_;
+};
+
+///
+/// a guard page fault catcher. A trap is entered around the code that touches the
+/// segments, a guard page hit jumps back to the sigsetjmp point with the faulting
+/// region kind.
+///
+struct FaultTrap {
+    enum {
+        MAX_REGIONS = 8,
+    };
+
+    FaultTrap() : prev(nullptr), regionCount(0), kind(VALUE_STACK_REGION), overflow(false) {}
+
+    inline void     watch(const VMRegion& region)   { assert(regionCount < MAX_REGIONS); regions[regionCount++] = &region; }
+
+    void            enter();
+    void            leave();
+
+    sigjmp_buf                  env;
+    FaultTrap*                  prev;
+    const VMRegion*             regions[MAX_REGIONS];
+    uint32_t                    regionCount;
+    volatile RegionKind         kind;       // faulting region kind
+    volatile bool               overflow;   // upper (true) or lower (false) guard
+};
+
+///
+/// a stack or segment living in a VMRegion. Pushing and popping do not check the
+/// capacity, the guard pages do.
+///
+template<typename T, RegionKind KIND, size_t MAX_COUNT>
+struct Segment : public NonCopyable {
+    Segment() : count_(0), data_(static_cast<T*>(region_.reserve(sizeof(T) * MAX_COUNT, KIND))) {}
+    // the pages are mapped, the allocator is not used
+    explicit Segment(IAllocator*) : count_(0), data_(static_cast<T*>(region_.reserve(sizeof(T) * MAX_COUNT, KIND))) {}
+
+	const T*
+    get() const	{	return data_; }
+
+	T*
+    get()		{ return data_; }
+
+    const T&
+    back() const { return data_[count_ - 1]; }
+
+    inline void     push_back(const T& t)   { new(&(data_[count_])) T(t); ++count_; }
+    inline void     pop_back()              { --count_; }
+    inline void     clear()                 { count_ = 0; }
+
+    void
+    resize(size_t newSize) {
+        for( size_t i = count_; i < newSize; ++i ) {
+            new(&(data_[i])) T();
+        }
+        count_  = newSize;
+    }
+
+    size_t		size() const			{ return count_;	}
+    const T&	operator[] (size_t i) const	{ return data_[i];	}
+    T&          operator[] (size_t i)       { return data_[i];	}
+
+    const VMRegion&     region() const      { return region_; }
+
+private:
+    VMRegion        region_;
+    size_t          count_;
+    T*              data_;
+};
+
+}   // namespace SM
+
+#endif  // FORTH_VM_SEGMENTS
+#endif  // __SEGMENT__HPP__
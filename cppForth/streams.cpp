@@ -18,28 +18,146 @@
 
 #include <cstdio>
 
+#if defined _WIN32 || defined __CYGWIN__
+#   define FORTH_STREAM_NO_MMAP
+#   include <io.h>
+#   define read     _read
+typedef int ssize_t;
+#else
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <poll.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define FORTH_STREAM_SSE2
+#   include <emmintrin.h>
+#endif
+
 namespace Forth {
 
-void
-StdInStream::testAndFillBuffer() {
-    if(pos >= buff.size()) {
-        char tmp[8192] = {0};
-        char* res = fgets(tmp, 8192, stdin);
-        buff += res;
-        buff += '\n';
+////////////////////////////////////////////////////////////////////////////////
+// white space scanning, 16 bytes at a time with SSE2 or 8 bytes at a time in a
+// 64 bit word. The space set is the one of IInputStream::isSpace
+////////////////////////////////////////////////////////////////////////////////
+#ifdef FORTH_STREAM_SSE2
+typedef uint32_t    ScanMask;
+
+enum : uint32_t {
+    SCAN_WIDTH  = 16,
+};
+
+// one bit per space byte
+static inline ScanMask
+spaceMask(const char* p) {
+    __m128i v   = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i m   = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                               _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))),
+                                            _mm_cmpeq_epi8(v, _mm_set1_epi8('\a'))));
+    return static_cast<ScanMask>(_mm_movemask_epi8(m));
+}
+
+static inline ScanMask  invertMask(ScanMask m)  { return ~m & 0xFFFF; }
+static inline uint32_t  firstByte(ScanMask m)   { return static_cast<uint32_t>(__builtin_ctz(m)); }
+#else
+typedef uint64_t    ScanMask;
+
+enum : uint32_t {
+    SCAN_WIDTH  = 8,
+};
+
+// 0x80 in every byte of x that is 0 (exact, no borrow between bytes)
+static inline uint64_t
+zeroBytes(uint64_t x) {
+    const uint64_t  low7    = 0x7F7F7F7F7F7F7F7Full;
+    return ~(((x & low7) + low7) | x | low7);
+}
+
+// 0x80 in every space byte
+static inline ScanMask
+spaceMask(const char* p) {
+    const uint64_t  ones    = 0x0101010101010101ull;
+    uint64_t    x;
+    memcpy(&x, p, sizeof(x));
+    return zeroBytes(x ^ (ones * ' ')) | zeroBytes(x ^ (ones * '\n')) | zeroBytes(x ^ (ones * '\t'))
+         | zeroBytes(x ^ (ones * '\r')) | zeroBytes(x ^ (ones * '\a'));
+}
+
+static inline ScanMask  invertMask(ScanMask m)  { return ~m & 0x8080808080808080ull; }
+
+static inline uint32_t
+firstByte(ScanMask m) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return static_cast<uint32_t>(__builtin_clzll(m)) >> 3;
+#else
+    return static_cast<uint32_t>(__builtin_ctzll(m)) >> 3;
+#endif
+}
+#endif
+
+const char*
+IInputStream::skipSpaces(const char* p, const char* end) {
+    while( static_cast<size_t>(end - p) >= SCAN_WIDTH ) {
+        ScanMask    m   = invertMask(spaceMask(p));
+        if( m ) {
+            return p + firstByte(m);
+        }
+        p += SCAN_WIDTH;
     }
+
+    while( p != end && isSpace(static_cast<uint8_t>(*p)) ) { ++p; }
+    return p;
 }
 
-uint32_t
-StdInStream::peekChar() {
-    testAndFillBuffer();
-    return buff[pos];
+const char*
+IInputStream::findSpace(const char* p, const char* end) {
+    while( static_cast<size_t>(end - p) >= SCAN_WIDTH ) {
+        ScanMask    m   = spaceMask(p);
+        if( m ) {
+            return p + firstByte(m);
+        }
+        p += SCAN_WIDTH;
+    }
+
+    while( p != end && !isSpace(static_cast<uint8_t>(*p)) ) { ++p; }
+    return p;
 }
 
-uint32_t
-StdInStream::getChar() {
-    testAndFillBuffer();
-    return buff[pos++];
+////////////////////////////////////////////////////////////////////////////////
+// standard input: whatever one read(2) returns is a block
+////////////////////////////////////////////////////////////////////////////////
+bool
+StdInStream::refill() {
+    cur_    = end_  = block_;
+
+    for( ;; ) {
+        ssize_t n   = read(fd_, block_, BLOCK_SIZE);
+        if( n > 0 ) {
+            end_    = block_ + n;
+            return true;
+        }
+
+        if( n == 0 ) {
+            return false;
+        }
+
+#ifndef FORTH_STREAM_NO_MMAP
+        if( errno == EINTR ) {
+            continue;
+        }
+
+        if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            // non blocking descriptor: wait for the producer
+            struct pollfd   pfd = { fd_, POLLIN, 0 };
+            poll(&pfd, 1, -1);
+            continue;
+        }
+#endif
+        return false;
+    }
 }
     
 IInputStream::Mode
@@ -55,29 +173,22 @@ StdInStream::setMode(IInputStream::Mode m) {
 StdInStream::~StdInStream() {
 }
 
-StdInStream::StdInStream() : mode(Mode::EVAL), pos(0) {}
+StdInStream::StdInStream(int fd) : mode(Mode::EVAL), fd_(fd) {}
 
 
 
 
-StringStream::StringStream(const char* str) : mode(Mode::EVAL), pos(0), buff(str) {}
-
-uint32_t
-StringStream::peekChar() {
-    if( pos == buff.size() ) {
-        return 0;
-    } else {
-        return buff[pos];
-    }
+////////////////////////////////////////////////////////////////////////////////
+// string: the whole string is the only block
+////////////////////////////////////////////////////////////////////////////////
+StringStream::StringStream(const char* str) : mode(Mode::EVAL), buff(str) {
+    cur_    = buff.c_str();
+    end_    = cur_ + buff.size();
 }
 
-uint32_t
-StringStream::getChar() {
-    if( pos == buff.size() ) {
-        return 0;
-    } else {
-        return buff[pos++];
-    }
+bool
+StringStream::refill() {
+    return false;
 }
     
 IInputStream::Mode
@@ -93,6 +204,121 @@ StringStream::setMode(Mode m) {
 StringStream::~StringStream() {
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// SpanStream
+////////////////////////////////////////////////////////////////////////////////
+SpanStream::SpanStream(IInputStream::Ptr source, const char* begin, const char* end) : mode(Mode::EVAL), source_(source) {
+    cur_    = begin;
+    end_    = end;
+}
+
+bool
+SpanStream::refill() {
+    return false;
+}
+
+IInputStream::Mode
+SpanStream::getMode() const {
+    return mode;
+}
+
+void
+SpanStream::setMode(Mode m) {
+    mode = m;
+}
+
+SpanStream::~SpanStream() {
+}
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// mapped file: the whole file is the only block
+////////////////////////////////////////////////////////////////////////////////
+MmapFileStream::MmapFileStream() : mode(Mode::EVAL), base_(nullptr), size_(0) {}
+
+IInputStream::Ptr
+MmapFileStream::open(const char* path) {
+#ifdef FORTH_STREAM_NO_MMAP
+    // no mapping: the file is read in one block owned by the stream
+    FILE*   f   = fopen(path, "rb");
+    if( f == nullptr ) {
+        return nullptr;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long    fsize   = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    MmapFileStream* strm    = new MmapFileStream();
+    if( fsize > 0 ) {
+        strm->base_ = SM::heapAllocator()->allocate(static_cast<size_t>(fsize));
+        strm->size_ = fread(strm->base_, 1, static_cast<size_t>(fsize), f);
+    }
+    fclose(f);
+#else
+    int     fd  = ::open(path, O_RDONLY);
+    if( fd < 0 ) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ) {
+        close(fd);
+        return nullptr;
+    }
+
+    MmapFileStream* strm    = new MmapFileStream();
+    if( st.st_size > 0 ) {
+        void*   mem = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if( mem == MAP_FAILED ) {
+            close(fd);
+            delete strm;
+            return nullptr;
+        }
+
+        madvise(mem, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+        strm->base_ = mem;
+        strm->size_ = static_cast<size_t>(st.st_size);
+    }
+
+    // the mapping outlives the descriptor
+    close(fd);
+#endif
+
+    strm->cur_  = static_cast<const char*>(strm->base_);
+    strm->end_  = strm->cur_ + strm->size_;
+    return strm;
+}
+
+bool
+MmapFileStream::refill() {
+    return false;
+}
+
+IInputStream::Mode
+MmapFileStream::getMode() const {
+    return mode;
+}
+
+void
+MmapFileStream::setMode(Mode m) {
+    mode = m;
+}
+
+MmapFileStream::~MmapFileStream() {
+    if( base_ == nullptr ) {
+        return;
+    }
+
+#ifdef FORTH_STREAM_NO_MMAP
+    SM::heapAllocator()->deallocate(base_, size_);
+#else
+    munmap(base_, size_);
+#endif
+}
+
 
 
 }   // namespace Forth
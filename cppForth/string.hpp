@@ -5,9 +5,12 @@
 #   include "base.hpp"
 #endif
 
+#include "allocator.hpp"
 #include "vector.hpp"
 
 extern "C" {
+FORTH_API uint32_t __forth_hash_bytes__(const char* str, size_t len);
+FORTH_API uint64_t __forth_hash_bytes64__(const char* str, size_t len, uint64_t seed);
 FORTH_API uint32_t __forth_hash_string__(const char* str);
 FORTH_API uint32_t __forth_reverse_hash_string__(const char* str);
 }
@@ -17,40 +20,126 @@ namespace SM
 ///
 /// RTK string implementation
 ///
+/// strings up to INLINE_CAPACITY characters live inside the object, longer ones
+/// are moved to the heap. The data is always null terminated.
+///
 struct String
 {
-	inline String()	{	__data.push_back('\0');	}
+	enum {
+		INLINE_CAPACITY	= 15,	///< characters stored without allocation (+ '\0')
+	};
 
-	inline String(const String& other) : __data(other.__data)	{}
+	inline String() : __data(__short), __size(0), __capacity(INLINE_CAPACITY), __hash(0), __hashed(false), __allocator(currentAllocator())	{	__short[0] = '\0';	}
 
-	inline String(const char* other) {
-		if( other ) {
-			size_t len	= strlen(other);
+	inline String(const String& other) : __data(__short), __size(0), __capacity(INLINE_CAPACITY), __hash(other.__hash), __hashed(other.__hashed), __allocator(currentAllocator()) {
+		assign(other.__data, other.__size);
+		__hashed	= other.__hashed;
+	}
 
-			__data.resize(len + 1);
-			strcpy(&(__data[0]), other);
-		} else {
-			__data.push_back('\0');
+	inline String(String&& other) : __data(__short), __size(0), __capacity(INLINE_CAPACITY), __hash(other.__hash), __hashed(other.__hashed), __allocator(other.__allocator) {
+		steal(other);
+	}
+
+	inline String(const char* str, size_t len) : __data(__short), __size(0), __capacity(INLINE_CAPACITY), __hash(0), __hashed(false), __allocator(currentAllocator()) {
+		assign(str, len);
+	}
+
+	inline String(const char* other) : __data(__short), __size(0), __capacity(INLINE_CAPACITY), __hash(0), __hashed(false), __allocator(currentAllocator()) {
+		__short[0]	= '\0';
+		if( other ) {
+			assign(other, strlen(other));
 		}
 	}
 
-	inline String(char s) {
-		__data.push_back(s);
-		__data.push_back('\0');
+	inline String(char s) : __data(__short), __size(0), __capacity(INLINE_CAPACITY), __hash(0), __hashed(false), __allocator(currentAllocator()) {
+		assign(&s, 1);
 	}
 
-	inline ~String() {}
+	explicit inline String(IAllocator* allocator) : __data(__short), __size(0), __capacity(INLINE_CAPACITY), __hash(0), __hashed(false), __allocator(allocator)	{	__short[0] = '\0';	}
+
+	inline ~String() {
+		if( __data != __short ) {
+			__allocator->deallocate(__data, __capacity + 1);
+		}
+	}
 
 	inline void
 	clear()	{
-		__data.resize(1);
+		__hashed	= false;
+		__size		= 0;
 		__data[0]	= '\0';
 	}
 
+	///
+	/// make room for at least count characters
+	///
+	inline void
+	reserve(size_t count) {
+		if( count <= __capacity ) {
+			return;
+		}
+
+		size_t	capacity	= __capacity;
+		while( capacity < count ) {
+			capacity	= capacity * 2 + 1;
+		}
+
+		if( __data == __short ) {
+			char*	data	= static_cast<char*>(__allocator->allocate(capacity + 1));
+			memcpy(data, __short, __size + 1);
+			__data	= data;
+		} else {
+			__data	= static_cast<char*>(__allocator->reallocate(__data, __capacity + 1, capacity + 1));
+		}
+		__capacity	= static_cast<uint32_t>(capacity);
+	}
+
+	inline String&
+	assign(const char* s, size_t len) {
+		__hashed	= false;
+		reserve(len);
+		memmove(__data, s, len);
+		__size			= static_cast<uint32_t>(len);
+		__data[__size]	= '\0';
+		return *this;
+	}
+
+	inline String&
+	append(const char* s, size_t len) {
+		__hashed	= false;
+		reserve(__size + len);
+		memmove(__data + __size, s, len);
+		__size			+= static_cast<uint32_t>(len);
+		__data[__size]	= '\0';
+		return *this;
+	}
+
 	inline String&
 	operator = (const String& s) {
-		if( &s != this )	// an idiot is trying to copy himself ?
-			__data	= s.__data;
+		if( &s != this ) {	// an idiot is trying to copy himself ?
+			assign(s.__data, s.__size);
+			__hash		= s.__hash;
+			__hashed	= s.__hashed;
+		}
+		return *this;
+	}
+
+	inline String&
+	operator = (String&& s) {
+		if( s.__allocator != __allocator ) {	// the buffer cannot change allocator
+			return *this = static_cast<const String&>(s);
+		}
+
+		if( &s != this ) {
+			if( __data != __short ) {
+				__allocator->deallocate(__data, __capacity + 1);
+				__data		= __short;
+				__capacity	= INLINE_CAPACITY;
+			}
+			__hash		= s.__hash;
+			__hashed	= s.__hashed;
+			steal(s);
+		}
 		return *this;
 	}
 
@@ -63,9 +152,7 @@ struct String
 		}
 		else
 		{
-			size_t	len	= __data.size();
-			__data.resize(__data.size() + s.__data.size() - 1);
-			strcpy(&(__data[len - 1]), &(s.__data[0]));
+			append(s.__data, s.__size);
 		}
 
 		return *this;
@@ -74,63 +161,55 @@ struct String
 	inline String&
 	operator = (const char* s)
 	{
-		size_t len	= strlen(s);
-
-		__data.resize(len + 1);
-		strcpy(&(__data[0]), s);
-		return *this;
+		return assign(s, strlen(s));
 	}
 
 	inline String&
 	operator += (const char* s)
 	{
-		size_t	slen	= strlen(s);
-		size_t	len	= __data.size();
-		__data.resize(__data.size() + slen);
-		strcpy(&(__data[len - 1]), s);
-
-		return *this;
+		return append(s, strlen(s));
 	}
 
 	inline String&
 	operator = (char s)
 	{
-		__data.resize(2);
-		__data[0]	= s;
-		__data[1]	= '\0';
-		return *this;
+		return assign(&s, 1);
 	}
 
 	inline String&
 	operator += (char s)
 	{
-		__data[__data.size() - 1]	= s;
-		__data.push_back('\0');
+		__hashed	= false;
+		if( __size == __capacity ) {
+			reserve(__size + 1);
+		}
+		__data[__size++]	= s;
+		__data[__size]		= '\0';
 		return *this;
 	}
 
 	inline bool
 	operator == (const String& s) const
 	{
-		return (strcmp(&(s.__data[0]), &(__data[0])) == 0);
+		return __size == s.__size && memcmp(s.__data, __data, __size) == 0;
 	}
 
 	inline bool
 	operator != (const String& s) const
 	{
-		return (strcmp(&(s.__data[0]), &(__data[0])) != 0);
+		return !(*this == s);
 	}
 
 	inline bool
 	operator < (const String& s) const
 	{
-		return (strcmp(&(__data[0]), &(s.__data[0])) < 0 );
+		return (strcmp(__data, s.__data) < 0 );
 	}
 
 	inline bool
 	operator > (const String& s) const
 	{
-		return (strcmp(&(__data[0]), &(s.__data[0])) > 0 );
+		return (strcmp(__data, s.__data) > 0 );
 	}
 
 	inline String
@@ -147,17 +226,52 @@ struct String
 		return (temp += s);
 	}
 
-	inline size_t		length() const	{	return __data.size() - 1;	}
-	inline size_t		size() const	{	return __data.size() - 1;	}
+	inline size_t		length() const	{	return __size;	}
+	inline size_t		size() const	{	return __size;	}
 
 	inline char         operator[] (size_t i) const	{		return __data[i];	}
-	inline char&		operator[] (size_t i)		{		return __data[i];	}
-
-	inline const char*	c_str() const			    {	return &(__data[0]);		}
-
+	inline char&		operator[] (size_t i)		{	__hashed = false;	return __data[i];	}
+
+	inline const char*	c_str() const			    {	return __data;		}
+	inline IAllocator*	allocator() const			{	return __allocator;	}
+
+	///
+	/// hash of the string, computed on first use and cached until the string changes
+	///
+	inline uint32_t
+	hash() const {
+		if( !__hashed ) {
+			__hash		= __forth_hash_bytes__(__data, __size);
+			__hashed	= true;
+		}
+		return __hash;
+	}
 
 private:
-	Vector<char>		__data;		///< the actual string data
+	// take the other string buffer (or copy it when inline), the other string is left empty
+	inline void
+	steal(String& other) {
+		if( other.__data == other.__short ) {
+			memcpy(__short, other.__short, other.__size + 1);
+		} else {
+			__data			= other.__data;
+			__capacity		= other.__capacity;
+			other.__data		= other.__short;
+			other.__capacity	= INLINE_CAPACITY;
+		}
+		__size				= other.__size;
+		other.__size		= 0;
+		other.__short[0]	= '\0';
+		other.__hashed		= false;
+	}
+
+	char*				__data;		///< the actual string data (__short or heap)
+	uint32_t			__size;		///< length without the '\0'
+	uint32_t			__capacity;	///< characters that fit without growing (without the '\0')
+	char				__short[INLINE_CAPACITY + 1];	///< short string storage
+	mutable uint32_t	__hash;		///< cached hash
+	mutable bool		__hashed;	///< is the cached hash valid ?
+	IAllocator*			__allocator;	///< where the heap buffer comes from
 };	// struct string
 
 inline String operator + (const char* cstr, const String& str) {	return (String(cstr) + str);	}
@@ -203,7 +317,21 @@ inline String to_lower(const String& str)
 /// @param str the string to hash
 /// @return hash number as 32 bits integer
 ///
-inline uint32_t			hash_string(const String& str)	{ return __forth_hash_string__(str.c_str());	}
+inline uint32_t			hash_string(const String& str)	{ return str.hash();	}
+
+///
+/// hash a byte range, it does not allocate
+/// @param str the first byte
+/// @param len the byte count
+/// @return the same hash as a String with the same bytes
+///
+inline uint32_t			hash_bytes(const char* str, size_t len)	{ return __forth_hash_bytes__(str, len);	}
+
+///
+/// 64 bits hash of a byte range, for keys that have to stay unique (content hashes)
+/// @param seed chains the hash of several ranges
+///
+inline uint64_t			hash_bytes64(const char* str, size_t len, uint64_t seed = 0)	{ return __forth_hash_bytes64__(str, len, seed);	}
 
 template<>
 struct Hash<String> {
@@ -0,0 +1,100 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "symbol_table.hpp"
+
+namespace SM {
+
+SymbolTable::SymbolTable(IAllocator* allocator) :
+    allocator_(allocator ? allocator : currentAllocator()),
+    table_(nullptr),
+    capacity_(0),
+    names_(allocator_),
+    bytes_(allocator_) {
+}
+
+SymbolTable::~SymbolTable() {
+    allocator_->deallocate(table_, sizeof(Entry) * capacity_);
+}
+
+SymbolTable::Symbol
+SymbolTable::find(const char* str, size_t len, uint32_t hash) const {
+    if( capacity_ == 0 ) {
+        return NOT_FOUND;
+    }
+    return table_[probe(str, len, hash)].symbol;
+}
+
+SymbolTable::Symbol
+SymbolTable::intern(const char* str, size_t len, uint32_t hash) {
+    if( capacity_ == 0 ) {
+        grow();
+    }
+
+    uint32_t    slot    = probe(str, len, hash);
+    if( table_[slot].symbol != NOT_FOUND ) {
+        return table_[slot].symbol;
+    }
+
+    Symbol      s       = static_cast<Symbol>(names_.size());
+
+    Name        n;
+    n.offset    = static_cast<uint32_t>(bytes_.size());
+    n.length    = static_cast<uint32_t>(len);
+    names_.push_back(n);
+
+    bytes_.resize(n.offset + len + 1);
+    memcpy(&bytes_[n.offset], str, len);
+    bytes_[n.offset + len]  = '\0';
+
+    table_[slot].hash   = hash;
+    table_[slot].symbol = s;
+
+    // keep the load under 3/4 so the probes stay short
+    if( names_.size() * 4 > capacity_ * 3 ) {
+        grow();
+    }
+
+    return s;
+}
+
+void
+SymbolTable::grow() {
+    Entry*      prev            = table_;
+    uint32_t    prevCapacity    = capacity_;
+
+    capacity_   = capacity_ ? capacity_ << 1 : static_cast<uint32_t>(INITIAL_CAPACITY);
+    table_      = static_cast<Entry*>(allocator_->allocate(sizeof(Entry) * capacity_));
+    assert(table_ != nullptr);
+    for( uint32_t i = 0; i < capacity_; ++i ) {
+        table_[i].symbol    = NOT_FOUND;
+    }
+
+    // the hashes are kept, the names are not compared again (they are all distinct)
+    uint32_t    mask    = capacity_ - 1;
+    for( uint32_t i = 0; i < prevCapacity; ++i ) {
+        if( prev[i].symbol != NOT_FOUND ) {
+            uint32_t    slot    = prev[i].hash & mask;
+            while( table_[slot].symbol != NOT_FOUND ) {
+                slot = (slot + 1) & mask;
+            }
+            table_[slot]    = prev[i];
+        }
+    }
+
+    allocator_->deallocate(prev, sizeof(Entry) * prevCapacity);
+}
+
+}   // namespace SM
@@ -0,0 +1,105 @@
+/*
+** Copyright (c) 2017 Wael El Oraiby.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as
+** published by the Free Software Foundation, version 3.
+**
+** This program is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Lesser Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SYMBOL_TABLE__HPP__
+#define __SYMBOL_TABLE__HPP__
+
+#ifndef __SM_BASE__
+#   include "base.hpp"
+#endif
+
+#include "allocator.hpp"
+#include "vector.hpp"
+#include "string.hpp"
+
+namespace SM {
+
+///
+/// interned names: every distinct byte sequence gets a stable symbol id (0, 1, 2...).
+///
+/// the table is a linear probed array of (hash, symbol) pairs, the names are packed
+/// null terminated in one byte buffer. find() never inserts, intern() looks up and
+/// inserts in the same probe. Neither allocates on a hit, an empty table does not
+/// allocate at all.
+///
+struct SymbolTable : public NonCopyable {
+    typedef uint32_t    Symbol;
+
+    enum : uint32_t {
+        NOT_FOUND   = 0xFFFFFFFF,
+    };
+
+    explicit SymbolTable(IAllocator* allocator = nullptr);
+    ~SymbolTable();
+
+    Symbol          find(const char* str, size_t len, uint32_t hash) const;
+    Symbol          intern(const char* str, size_t len, uint32_t hash);
+
+    inline Symbol   find(const char* str, size_t len) const     { return find(str, len, hash_bytes(str, len)); }
+    inline Symbol   find(const String& str) const               { return find(str.c_str(), str.size(), str.hash()); }
+    inline Symbol   intern(const char* str, size_t len)         { return intern(str, len, hash_bytes(str, len)); }
+    inline Symbol   intern(const String& str)                   { return intern(str.c_str(), str.size(), str.hash()); }
+
+    // the name bytes move when new symbols are interned
+    inline const char*  name(Symbol s) const    { return &bytes_[names_[s].offset]; }
+    inline uint32_t     length(Symbol s) const  { return names_[s].length; }
+
+    inline uint32_t     size() const            { return static_cast<uint32_t>(names_.size()); }
+
+private:
+    enum {
+        INITIAL_CAPACITY    = 256,
+    };
+
+    struct Entry {
+        uint32_t        hash;
+        Symbol          symbol;     // NOT_FOUND: empty
+    };
+
+    struct Name {
+        uint32_t        offset;
+        uint32_t        length;
+    };
+
+    // slot of the symbol or of the empty entry ending the probe
+    inline uint32_t
+    probe(const char* str, size_t len, uint32_t hash) const {
+        uint32_t    mask    = capacity_ - 1;
+        uint32_t    slot    = hash & mask;
+        for( ;; ) {
+            const Entry&    e   = table_[slot];
+            if( e.symbol == NOT_FOUND ) {
+                return slot;
+            }
+
+            if( e.hash == hash && names_[e.symbol].length == len && memcmp(&bytes_[names_[e.symbol].offset], str, len) == 0 ) {
+                return slot;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    void            grow();
+
+    IAllocator*     allocator_;
+    Entry*          table_;
+    uint32_t        capacity_;      // power of 2
+    Vector<Name>    names_;
+    Vector<char>    bytes_;
+};
+
+}   // namespace SM
+
+#endif  // __SYMBOL_TABLE__HPP__
@@ -14,54 +14,104 @@
 ** along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 #include "forth.hpp"
+#include "scheduler.hpp"
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+
+#if defined _WIN32 || defined __CYGWIN__
+#   include <process.h>
+#   define getpid   _getpid
+#else
+#   include <unistd.h>
+#endif
 
 namespace Forth {
 IInputStream::~IInputStream() {}
 
-bool
-Terminal::isInt(const SM::String& tok) {
+void
+Terminal::classify(Token& tok) {
+    uint32_t    val = 0;
     uint32_t    pos = 0;
-    
-    while( pos < tok.size() ) {
-        if( tok[pos] < '0' || tok[pos] > '9' ) {
-            return false;
+
+    while( pos < tok.length ) {
+        uint32_t    digit   = static_cast<uint32_t>(static_cast<uint8_t>(tok.str[pos])) - '0';
+        if( digit > 9 ) {
+            break;
         }
 
+        val = val * 10 + digit;
         ++pos;
     }
 
-    return true;
+    tok.isInt   = (pos == tok.length);
+    tok.value   = static_cast<int32_t>(val);
 }
 
-int32_t
-Terminal::toInt32(const SM::String& tok) {
-    uint32_t    pos = 0;
-    uint32_t    val = 0;
-    
-    while( pos < tok.size() ) {
-        val = val * 10 + (tok[pos] - '0');
-        ++pos;
-    }
-
-    return val;
-}
+bool
+Terminal::nextToken(Token& tok) {
+    IInputStream*   strm    = stream();
 
-SM::String
-Terminal::getToken() {
-    SM::String ret;
-    
     // remove white space
-    while( stream()->peekChar() && IInputStream::isSpace(stream()->peekChar()) ) { stream()->getChar(); }
-    
+    const char*     p;
+    for( ;; ) {
+        waitInput(strm);
+        if( !strm->available() ) {
+            return false;
+        }
+
+        p   = IInputStream::skipSpaces(strm->cursor(), strm->limit());
+        if( p != strm->limit() ) {
+            break;
+        }
+        strm->seek(p);
+    }
+
     // get token
-    while( stream()->peekChar() && !IInputStream::isSpace(stream()->peekChar()) ) {
-        ret += stream()->getChar();
+    const char*     e   = IInputStream::findSpace(p, strm->limit());
+    strm->seek(e);
+
+    if( e != strm->limit() ) {
+        tok.str     = p;
+        tok.length  = static_cast<uint32_t>(e - p);
+    } else {
+        // the token may go on in the next block, which replaces this one
+        tokenScratch_.assign(p, static_cast<size_t>(e - p));
+        while( strm->available() ) {
+            p   = strm->cursor();
+            e   = IInputStream::findSpace(p, strm->limit());
+            tokenScratch_.append(p, static_cast<size_t>(e - p));
+            strm->seek(e);
+            if( e != strm->limit() ) {
+                break;
+            }
+        }
+
+        tok.str     = tokenScratch_.c_str();
+        tok.length  = static_cast<uint32_t>(tokenScratch_.size());
     }
 
-    return ret;
+    classify(tok);
+    return true;
+}
+
+bool
+Terminal::skipPast(char delimiter) {
+    IInputStream*   strm    = stream();
+    for( ;; ) {
+        waitInput(strm);
+        if( !strm->available() ) {
+            return false;
+        }
+
+        const char* p   = static_cast<const char*>(memchr(strm->cursor(), delimiter, static_cast<size_t>(strm->limit() - strm->cursor())));
+        if( p != nullptr ) {
+            strm->seek(p + 1);
+            return true;
+        }
+        strm->seek(strm->limit());
+    }
 }
 
 //
@@ -71,48 +121,313 @@ void
 Terminal::loadStream(IInputStream::Ptr strm) {
     streams_.push_back(strm);
 
-    while( stream()->peekChar() && sig_.ty == Signal::NONE ) {
-        SM::String tok = getToken();
+    // files pushed by include are read until their end, then this one resumes
+    size_t  depth   = streams_.size();
+
+#ifdef FORTH_VM_SEGMENTS
+    // compiling emits straight into the code segment, outside of runCall
+    SM::FaultTrap   trap;
+    watchRegions(trap);
+    if( sigsetjmp(trap.env, 1) ) {
+        trap.leave();
+        emitSignal(Signal(regionSignal(trap.kind, trap.overflow), pid_, 0));
+        streams_.resize(depth - 1);
+        return;
+    }
+    trap.enter();
+#endif
+
+    Token   tok;
+    while( sig_.ty == Signal::NONE ) {
+        if( vm_->isOverMemoryLimit() ) {
+            emitSignal(Signal(Signal::OUT_OF_MEMORY, pid_, 0));
+            break;
+        }
+
+        if( !nextToken(tok) ) {
+            if( streams_.size() > depth ) {
+                if( cacheFrames_.size() && cacheFrames_.back().depth == streams_.size() ) {
+                    endCacheFrame();
+                }
+                streams_.pop_back();
+                continue;
+            }
+            break;
+        }
 
         switch( stream()->getMode() ) {
         case IInputStream::Mode::EVAL:
-            if( isInt(tok) ) {
-                Value v(toInt32(tok));
+            if( tok.isInt ) {
+                if( cacheFrames_.size() ) {
+                    notCacheable();
+                }
+                Value v(tok.value);
                 valueStack_.push_back(v);
             } else {
-                if( vm_->nameToWord().find(tok) == vm_->nameToWord().end() ) {
+                int32_t     word    = vm_->findWord(tok.str, tok.length);
+                if( word < 0 ) {
                     char buff[MAX_BUFF] = {0};
-                    sprintf(buff, "ERROR: word not found (%s)", tok.c_str());
+                    snprintf(buff, MAX_BUFF, "ERROR: word not found (%.*s)", static_cast<int>(tok.length), tok.str);
                     emitSignal(Signal(Signal::EXCEPTION, pid_, ErrorCase::WORD_NOT_FOUND));
                 } else {
-                    runCall(vm_->nameToWord()[tok]);
+                    // a file running anything but definitions (and comments) can not be replayed
+                    if( cacheFrames_.size() && !vm_->isImmediate(static_cast<uint32_t>(word)) && !isDefiningWord(static_cast<uint32_t>(word)) ) {
+                        notCacheable();
+                    }
+                    runCall(static_cast<uint32_t>(word));
                 }
             }
             break;
 
         case IInputStream::Mode::COMPILE:
-            if( isInt(tok) ) {
+            if( tok.isInt ) {
                 vm_->emit(0);
-                vm_->emit(Value(toInt32(tok)).u32);
+                vm_->emit(Value(tok.value).u32());
             } else {
-                if( vm_->nameToWord().find(tok) == vm_->nameToWord().end() ) {
+                int32_t     word    = vm_->findWord(tok.str, tok.length);
+                if( word < 0 ) {
                     char buff[MAX_BUFF] = {0};
-                    sprintf(buff, "ERROR: word not found (%s)", tok.c_str());
+                    snprintf(buff, MAX_BUFF, "ERROR: word not found (%.*s)", static_cast<int>(tok.length), tok.str);
                     emitSignal(Signal(Signal::EXCEPTION, pid_, ErrorCase::WORD_NOT_FOUND));
+                } else if( vm_->isImmediate(static_cast<uint32_t>(word)) ) {
+                    runCall(static_cast<uint32_t>(word));
                 } else {
-                    uint32_t    word    = vm_->nameToWord()[tok];
-                    if( vm_->functions()[word].isImmediate ) {
-                        runCall(word);
-                    } else {
-                        vm_->emit(word);
-                    }
+                    vm_->emit(static_cast<uint32_t>(word));
                 }
             }
             break;
         }
     }
 
-    streams_.pop_back();
+#ifdef FORTH_VM_SEGMENTS
+    trap.leave();
+#endif
+    if( sig_.ty != Signal::NONE ) {
+        openWord_   = -1;
+    }
+    while( cacheFrames_.size() && cacheFrames_.back().depth >= depth ) {
+        cacheFrames_.pop_back();
+    }
+    streams_.resize(depth - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// compile cache
+////////////////////////////////////////////////////////////////////////////////
+void
+Terminal::setCompileCache(const char* dir) {
+    cacheDir_   = dir ? dir : "";
+}
+
+void
+Terminal::cachePath(uint64_t key, SM::String& path) const {
+    char    name[32];
+    snprintf(name, sizeof(name), "/%016llx.fimg", static_cast<unsigned long long>(key));
+    path    = cacheDir_;
+    path   += name;
+}
+
+bool
+Terminal::includeCached(IInputStream* strm) {
+    SM::VM::Mark    mark    = vm_->mark();
+    uint64_t        before  = vm_->fingerprint(mark);
+    uint64_t        key     = SM::hash_bytes64(strm->cursor(), static_cast<size_t>(strm->limit() - strm->cursor()), before);
+
+    SM::String      path;
+    cachePath(key, path);
+    if( vm_->loadImage(path.c_str()) ) {
+        return true;
+    }
+
+    CacheFrame      frame;
+    frame.depth     = streams_.size() + 1;
+    frame.key       = key;
+    frame.before    = before;
+    frame.mark      = mark;
+    frame.cacheable = true;
+    cacheFrames_.push_back(frame);
+    return false;
+}
+
+void
+Terminal::endCacheFrame() {
+    CacheFrame  frame   = cacheFrames_.back();
+    cacheFrames_.pop_back();
+
+    // the words compiled before have to be untouched (no patching from the file)
+    if( !frame.cacheable || sig_.ty != Signal::NONE || stream()->getMode() != IInputStream::Mode::EVAL ||
+        vm_->fingerprint(frame.mark) != frame.before ) {
+        return;
+    }
+
+    // written aside then renamed, concurrent loaders never see a partial entry
+    SM::String  path;
+    cachePath(frame.key, path);
+
+    char        suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%u.tmp", static_cast<uint32_t>(getpid()));
+    SM::String  tmp     = path + suffix;
+
+    if( vm_->saveImage(tmp.c_str(), frame.mark) ) {
+        rename(tmp.c_str(), path.c_str());
+    } else {
+        remove(tmp.c_str());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// lazy compilation
+////////////////////////////////////////////////////////////////////////////////
+void
+Terminal::setLazyCompile(bool lazy) {
+    if( !lazy ) {
+        compilePending();
+    }
+
+    lazy_   = lazy;
+    vm_->setLazyCompiler(lazy ? Terminal::lazyCompiler : nullptr, this);
+}
+
+bool
+Terminal::lazyCompiler(void* term, uint32_t word) {
+    return static_cast<Terminal*>(term)->compileLazy(word);
+}
+
+bool
+Terminal::scanDefinition(uint32_t word) {
+    IInputStream*   strm    = stream();
+    const char*     begin   = strm->cursor();
+    Token           tok;
+    bool            lazy    = false;
+
+    while( nextToken(tok) ) {
+        if( tok.isInt ) {
+            continue;
+        }
+
+        if( tok.length == 1 && tok.str[0] == ';' ) {
+            lazy    = true;
+            break;
+        }
+
+        // the words reading the input: their text is not a part of the body
+        if( tok.length == 1 && tok.str[0] == '(' ) {
+            skipPast(')');
+        } else if( tok.length == 1 && tok.str[0] == '\\' ) {
+            skipPast('\n');
+        } else if( tok.length == 1 && tok.str[0] == '\'' ) {
+            nextToken(tok);
+        } else if( tok.str[tok.length - 1] == '"' ) {
+            skipPast('"');
+        } else if( tok.length == 9 && memcmp(tok.str, "immediate", 9) == 0 ) {
+            break;
+        }
+    }
+
+    if( !lazy ) {
+        // compiled now, from the start of the body (the window of a persistent stream does not move)
+        strm->seek(begin);
+        return false;
+    }
+
+    if( lazySources_.size() == 0 || lazySources_.back().get() != strm ) {
+        lazySources_.push_back(streams_.back());
+    }
+
+    LazyBody    body;
+    body.word   = word;
+    body.source = static_cast<uint32_t>(lazySources_.size() - 1);
+    body.begin  = begin;
+    body.end    = strm->cursor();
+    lazyBodies_.push_back(body);
+    ++pendingLazy_;
+
+    vm_->function(word).body.interpreted.start  = -1;
+    return true;
+}
+
+Terminal::LazyBody*
+Terminal::findLazy(uint32_t word) {
+    // the bodies are recorded in word order
+    size_t  lo  = 0;
+    size_t  hi  = lazyBodies_.size();
+    while( lo < hi ) {
+        size_t  mid = (lo + hi) >> 1;
+        if( lazyBodies_[mid].word < word ) {
+            lo  = mid + 1;
+        } else {
+            hi  = mid;
+        }
+    }
+
+    return (lo < lazyBodies_.size() && lazyBodies_[lo].word == word) ? &lazyBodies_[lo] : nullptr;
+}
+
+bool
+Terminal::compileLazy(uint32_t word) {
+    // the code of a word can not go in the middle of the one being compiled
+    LazyBody*   body    = findLazy(word);
+    if( body == nullptr || body->begin == nullptr || openWord_ >= 0 ) {
+        return false;
+    }
+
+    IInputStream::Ptr   span(new SpanStream(lazySources_[body->source], body->begin, body->end));
+    body->begin = nullptr;
+    --pendingLazy_;
+
+    vm_->function(word).body.interpreted.start  = static_cast<int32_t>(vm_->wordSegmentSize());
+    openWord_   = static_cast<int32_t>(word);
+    span->setMode(IInputStream::Mode::COMPILE);
+    loadStream(span);
+
+    if( openWord_ >= 0 ) {
+        // no ';' reached
+        vm_->function(word).body.interpreted.start  = -1;
+        openWord_   = -1;
+        return false;
+    }
+
+    return sig_.ty == Signal::NONE;
+}
+
+void
+Terminal::compilePending() {
+    for( size_t i = 0; i < lazyBodies_.size() && pendingLazy_ && sig_.ty == Signal::NONE; ++i ) {
+        if( lazyBodies_[i].begin ) {
+            compileLazy(lazyBodies_[i].word);
+        }
+    }
+
+    // the sources are released with the last body
+    if( pendingLazy_ == 0 ) {
+        lazyBodies_.clear();
+        lazySources_.clear();
+    }
+}
+
+void
+Terminal::compileReferenced(uint32_t word) {
+    SM::Vector<uint32_t>    words;
+    words.push_back(word);
+
+    while( words.size() && sig_.ty == Signal::NONE ) {
+        const SM::VM::Function& func    = vm_->function(words.back());
+        uint32_t    pos     = static_cast<uint32_t>(func.body.interpreted.start);
+        uint32_t    end     = func.body.interpreted.end;
+        words.pop_back();
+
+        for( ; pos < end; ++pos ) {
+            // literals may be word ids as well (' word)
+            uint32_t    ref     = vm_->wordSegment()[pos];
+            if( ref == 0 && pos + 1 < end ) {
+                ref = vm_->wordSegment()[++pos];
+            }
+
+            if( ref >= vm_->builtinCount() && ref < vm_->wordCount() && compileLazy(ref) ) {
+                words.push_back(ref);
+            }
+        }
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -121,37 +436,51 @@ Terminal::loadStream(IInputStream::Ptr strm) {
 void
 Terminal::wordId(SM::VM::Process* proc) {
     Terminal* term = static_cast<Terminal*>(proc);
-    SM::String name    = term->getToken();
-    
-    if( Terminal::isInt(name) ) {
+    Token       name;
+
+    if( !term->nextToken(name) ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::WORD_NOT_FOUND));
+        return;
+    }
+
+    if( name.isInt ) {
         term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::INT_IS_NO_WORD));
         return;
     }
 
-    if( term->vm_->nameToWord().find(name) == term->vm_->nameToWord().end() ) {
+    int32_t     wordId  = term->vm_->findWord(name.str, name.length);
+    if( wordId < 0 ) {
         char buff[MAX_BUFF] = {0};
-        sprintf(buff, "ERROR: word not found (%s)", name.c_str());
+        snprintf(buff, MAX_BUFF, "ERROR: word not found (%.*s)", static_cast<int>(name.length), name.str);
         term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::WORD_NOT_FOUND));
         return;
     }
-    
-    uint32_t    wordId = term->vm_->nameToWord()[name];
+
     term->vm_->emit(0);
-    term->vm_->emit(wordId);
+    term->vm_->relocate(term->vm_->emit(static_cast<uint32_t>(wordId)), SM::VM::RELOC_WORD);
 }
 
 void
 Terminal::defineWord(SM::VM::Process* proc) {
     Terminal* term = static_cast<Terminal*>(proc);
 
-    SM::String name    = term->getToken();
+    Token       tok;
 
-    if( Terminal::isInt(name) ) {
+    if( !term->nextToken(tok) ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::WORD_NOT_FOUND));
+    } else if( tok.isInt ) {
         term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::INT_IS_NO_WORD));
     } else {
+        SM::String  name(tok.str, tok.length);
+
+        // the pending bodies are compiled against the definition they were written for
+        if( term->pendingLazy_ && term->vm_->findWord(name) >= 0 ) {
+            term->compilePending();
+        }
+
         //
         // TODO:    do we want to allow forward declaration ?
-        //          In this case, we should test to see if the functions[nameToWord[name]].start == -1 && .native == nullptr
+        //          In this case, we should test to see if the functions[findWord(name)].start == -1 && .native == nullptr
         //          before setting the the old function to a value
         //
         uint32_t    wordId  = term->vm_->addNormalFunction(name);
@@ -159,6 +488,12 @@ Terminal::defineWord(SM::VM::Process* proc) {
         if( term->vm_->isVerboseDebugging() ) {
             fprintf(stderr, "%s [%d]\n", name.c_str(), wordId);
         }
+
+        if( term->lazy_ && term->cacheFrames_.size() == 0 && term->stream()->isPersistent() && term->scanDefinition(wordId) ) {
+            return;
+        }
+
+        term->openWord_ = static_cast<int32_t>(wordId);
         term->stream()->setMode(IInputStream::Mode::COMPILE);
     }
 }
@@ -166,20 +501,47 @@ Terminal::defineWord(SM::VM::Process* proc) {
 void
 Terminal::immediate(SM::VM::Process* proc) {
     Terminal* term = static_cast<Terminal*>(proc);
-    term->vm_->setFunctionAsImmediate(term->vm_->functions().size() - 1);
+    uint32_t    word    = term->compiledWord();
+    term->vm_->setFunctionAsImmediate(word);
+
+    // an immediate word runs while others are compiled, it can not wait for its first call
+    if( term->openWord_ < 0 && term->pendingLazy_ ) {
+        if( term->vm_->function(word).body.interpreted.start < 0 ) {
+            term->compileLazy(word);
+        } else {
+            term->compileReferenced(word);
+        }
+    }
 }
 
 void
-Terminal::setLocalCount(SM::VM::Process* proc) {
-    Terminal* term = static_cast<Terminal*>(proc);
-    SM::String tok  = term->getToken();
+Terminal::declareLocals(bool clear) {
+    Token   tok;
 
-    if( !Terminal::isInt(tok) ) {
-        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::LOCAL_IS_NOT_INT));
+    if( !nextToken(tok) || !tok.isInt ) {
+        emitSignal(Signal(Signal::EXCEPTION, pid_, ErrorCase::LOCAL_IS_NOT_INT));
         return;
     }
-    uint32_t i = Terminal::toInt32(tok);
-    term->vm_->setFunctionLocalCount(term->vm_->functions().size() - 1, i);
+
+    uint32_t i = static_cast<uint32_t>(tok.value);
+    if( i > SM::VM::MAX_LOCAL_COUNT ) {
+        emitSignal(Signal(Signal::EXCEPTION, pid_, ErrorCase::LOCAL_OVERFLOW));
+        return;
+    }
+
+    vm_->setFunctionLocalCount(compiledWord(), i, clear);
+}
+
+void
+Terminal::setLocalCount(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    term->declareLocals(false);
+}
+
+void
+Terminal::setClearedLocalCount(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    term->declareLocals(true);
 }
 
 void
@@ -187,12 +549,21 @@ Terminal::endWord(SM::VM::Process* proc) {
     Terminal* term = static_cast<Terminal*>(proc);
     term->stream()->setMode(IInputStream::Mode::EVAL);
     term->vm_->emit(1);
+
+    uint32_t    word    = term->compiledWord();
+    term->openWord_ = -1;
+    term->vm_->endFunction(word);
+
+    if( term->pendingLazy_ && term->vm_->isImmediate(word) ) {
+        term->compileReferenced(word);
+    }
 }
 
 void
 Terminal::streamPeek(SM::VM::Process* proc) {
     Terminal* term = static_cast<Terminal*>(proc);
     // TODO: handle stream error (if it does not exist)
+    term->waitInput(term->stream());
     Value v(static_cast<uint32_t>(term->stream()->peekChar()));
     term->pushValue(v);
 }
@@ -201,6 +572,7 @@ void
 Terminal::streamGetCH(SM::VM::Process* proc) {
     Terminal* term = static_cast<Terminal*>(proc);
     // TODO: handle stream error (does not exist)
+    term->waitInput(term->stream());
     Value v(static_cast<uint32_t>(term->stream()->getChar()));
     term->pushValue(v);
 }
@@ -211,60 +583,320 @@ Terminal::streamToken(SM::VM::Process* proc) {
     // TODO: when strings are ready
 }
 
+void
+Terminal::streamSkip(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    if( term->valueStack_.size() == 0 ) {
+        term->emitSignal(Signal(Signal::VS_UNDERFLOW, term->pid_, 0));
+        return;
+    }
+
+    uint32_t    ch  = term->topValue().u32();
+    term->popValue();
+    term->skipPast(static_cast<char>(ch));
+}
+
+void
+Terminal::readString(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    SM::String  str;
+
+    uint32_t    ch  = term->stream()->getChar();
+    while( ch != 0 && ch != static_cast<uint32_t>('"') ) {
+        str += static_cast<char>(ch);
+        ch  = term->stream()->getChar();
+    }
+
+    term->pushValue(Value(term->vm_->internString(str)));
+}
+
+void
+Terminal::state(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    term->pushValue(Value(term->stream()->getMode() == IInputStream::Mode::COMPILE ? -1 : 0));
+}
+
+void
+Terminal::include(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    Token       tok;
+
+    if( !term->nextToken(tok) ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::FILE_NOT_FOUND));
+        return;
+    }
+
+    if( term->streams_.size() >= MAX_INCLUDE_DEPTH ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::INCLUDE_TOO_DEEP));
+        return;
+    }
+
+    SM::String          path(tok.str, tok.length);
+    IInputStream::Ptr   strm    = MmapFileStream::open(path.c_str());
+    if( strm.get() == nullptr ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::FILE_NOT_FOUND));
+        return;
+    }
+
+    if( term->cacheDir_.size() && term->includeCached(strm.get()) ) {
+        return;
+    }
+
+    // loadStream reads from the top stream until it ends
+    term->pushStream(strm);
+}
+
+void
+Terminal::saveImage(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    Token       tok;
+
+    if( !term->nextToken(tok) ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::IMAGE_NOT_SAVED));
+        return;
+    }
+
+    // an image has no source to compile the pending bodies from
+    term->compilePending();
+
+    SM::String  path(tok.str, tok.length);
+    if( !term->vm_->saveImage(path.c_str()) ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::IMAGE_NOT_SAVED));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// compiling words: they emit the code of their former bootstrap.f definitions, the
+// addresses to patch are left on the value stack
+////////////////////////////////////////////////////////////////////////////////
+static constexpr uint32_t   BRANCH_ID       = SM::primitiveId("branch");
+static constexpr uint32_t   BRANCH_IF_ID    = SM::primitiveId("?branch");
+
+static_assert(BRANCH_ID < SM::PRIMITIVE_COUNT && BRANCH_IF_ID < SM::PRIMITIVE_COUNT, "branch and ?branch are primitives");
+
+bool
+Terminal::popAddress(uint32_t& addr) {
+    if( valueStack_.size() == 0 ) {
+        emitSignal(Signal(Signal::VS_UNDERFLOW, pid_, 0));
+        return false;
+    }
+
+    addr    = topValue().u32();
+    popValue();
+    return true;
+}
+
+void
+Terminal::parenComment(SM::VM::Process* proc) {
+    static_cast<Terminal*>(proc)->skipPast(')');
+}
+
+void
+Terminal::lineComment(SM::VM::Process* proc) {
+    static_cast<Terminal*>(proc)->skipPast('\n');
+}
+
+// ( -- loop-addr )
+void
+Terminal::doWord(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    term->pushValue(Value(static_cast<int32_t>(term->vm_->wordSegmentSize())));
+}
+
+// ( loop-addr -- ) loops while the condition is true: lit loop-addr ?branch
+void
+Terminal::whileWord(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    uint32_t    loop;
+    if( !term->popAddress(loop) ) {
+        return;
+    }
+
+    term->vm_->emit(0);
+    term->vm_->emit(loop);
+    term->vm_->emit(BRANCH_IF_ID);
+}
+
+// ( -- else-addr ) lit body ?branch lit <else> branch body...
+void
+Terminal::ifWord(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    uint32_t    at  = term->vm_->wordSegmentSize();
+
+    term->vm_->emit(0);
+    term->vm_->emit(at + 6);
+    term->vm_->emit(BRANCH_IF_ID);
+    term->vm_->emit(0);
+    term->vm_->emit(0);
+    term->vm_->emit(BRANCH_ID);
+    term->pushValue(Value(static_cast<int32_t>(at + 4)));
+}
+
+// ( else-addr -- )
+void
+Terminal::thenWord(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    uint32_t    addr;
+    if( term->popAddress(addr) ) {
+        term->vm_->patch(addr, term->vm_->wordSegmentSize());
+    }
+}
+
+// ( else-addr -- then-addr ) the true part ends with: lit <then> branch
+void
+Terminal::elseWord(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    uint32_t    addr;
+    if( !term->popAddress(addr) ) {
+        return;
+    }
+
+    uint32_t    at  = term->vm_->wordSegmentSize();
+    term->vm_->patch(addr, at + 3);
+    term->pushValue(Value(static_cast<int32_t>(at + 1)));
+
+    term->vm_->emit(0);
+    term->vm_->emit(0);
+    term->vm_->emit(BRANCH_ID);
+}
+
+void
+Terminal::shake(SM::VM::Process* proc) {
+    Terminal* term = static_cast<Terminal*>(proc);
+    Token       tok;
+
+    // shake root ... ; (no root: every word that has a name)
+    SM::Vector<uint32_t>    roots;
+    while( term->nextToken(tok) && !(tok.length == 1 && tok.str[0] == ';') ) {
+        int32_t     word    = term->vm_->findWord(tok.str, tok.length);
+        if( word < 0 ) {
+            term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::WORD_NOT_FOUND));
+            return;
+        }
+        roots.push_back(static_cast<uint32_t>(word));
+    }
+
+    if( roots.size() == 0 ) {
+        for( uint32_t s = 0; s < term->vm_->symbols().size(); ++s ) {
+            int32_t     word    = term->vm_->symbolWord(s);
+            if( word >= 0 ) {
+                roots.push_back(static_cast<uint32_t>(word));
+            }
+        }
+    }
+
+    // the code moves: nothing may be running (here or in a process) or being compiled
+    if( term->returnStack_.size() || term->openWord_ >= 0 || (term->vm_->hasScheduler() && term->vm_->scheduler().hasProcesses()) ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::NOT_COMPACTED));
+        return;
+    }
+
+    term->compilePending();
+    if( term->sig_.ty == Signal::NONE && !term->vm_->compact(roots.get(), static_cast<uint32_t>(roots.size())) ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::NOT_COMPACTED));
+    }
+}
+
 void
 Terminal::see(SM::VM::Process* proc) {
     Terminal* term = static_cast<Terminal*>(proc);
-    uint32_t    word    = term->vm_->nameToWord()[term->getToken()];
-    fprintf(stdout, "[%d] : %s ", word, term->vm_->functions()[word].name.c_str());
-    if( term->vm_->functions()[word].color == SM::VM::Function::Color::NATIVE ) {
-         fprintf(stdout, " <native> ");
+    Token       tok;
+    int32_t     word    = term->nextToken(tok) ? term->vm_->findWord(tok.str, tok.length) : -1;
+    if( word < 0 ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::WORD_NOT_FOUND));
+        return;
+    }
+
+    if( !term->vm_->ensureCompiled(word) ) {
+        term->emitSignal(Signal(Signal::EXCEPTION, term->pid_, ErrorCase::WORD_NOT_DEFINED));
+        return;
+    }
+
+    SM::OutputSink& out = term->out_;
+    out.putChar('[');
+    out.putInt(word);
+    out.putString("] : ");
+    out.putString(term->vm_->wordName(word));
+    out.putChar(' ');
+    if( term->vm_->isNativeWord(word) ) {
+         out.putString(" <native> ");
     } else {
-        int32_t     curr    = term->vm_->functions()[word].body.interpreted.start;
+        int32_t     curr    = term->vm_->function(word).body.interpreted.start;
         while( term->vm_->wordSegment()[curr] != 1 ) {
             if( term->vm_->wordSegment()[curr] == 0 ) {
-                fprintf(stdout, "%d ", term->vm_->wordSegment()[++curr]);
+                out.putInt(static_cast<int32_t>(term->vm_->wordSegment()[++curr]));
+                out.putChar(' ');
             } else {
-                fprintf(stdout, "@%d:%s ", curr, term->vm_->functions()[term->vm_->wordSegment()[curr]].name.c_str());
+                out.putChar('@');
+                out.putInt(curr);
+                out.putChar(':');
+                out.putString(term->vm_->wordName(term->vm_->wordSegment()[curr]));
+                out.putChar(' ');
             }
 
             ++curr;
         }
     }
 
-    if( term->vm_->functions()[word].isImmediate ) {
-        fprintf(stdout, "immediate");
+    if( term->vm_->isImmediate(word) ) {
+        out.putString("immediate");
     }
 
-    fprintf(stdout, "\n");
+    out.putChar('\n');
 }
 
 
 
-Terminal::Terminal(SM::VM* vm) : SM::VM::Process(nullptr, 0) {
-    struct Primitive {
-        const char*             name;
-        SM::VM::NativeFunction  native;
-        bool                    isImmediate;
-    };
-
-    static Primitive primitives[] = {
-            { ":"           , Terminal::defineWord      , false },
-            { "immediate"   , Terminal::immediate       , true  },
-            { "locals"      , Terminal::setLocalCount   , true  },
-            { ";"           , Terminal::endWord         , true  },
-            { "'"           , Terminal::wordId          , true  },
-
-            { "stream.peek" , Terminal::streamPeek      , false },
-            { "stream.getch", Terminal::streamGetCH     , false },
+///
+/// the terminal words follow the VM primitives, both are resolved by one compile
+/// time perfect hash
+///
+static constexpr SM::VM::Builtin TERMINAL_WORDS[] = {
+    { ":"           , Terminal::defineWord      , false },
+    { "immediate"   , Terminal::immediate       , true  },
+    { "locals"      , Terminal::setLocalCount   , true  },
+    { "locals.zero" , Terminal::setClearedLocalCount, true  },
+    { ";"           , Terminal::endWord         , true  },
+    { "'"           , Terminal::wordId          , true  },
+
+    { "("           , Terminal::parenComment    , true  },
+    { "\\"          , Terminal::lineComment     , true  },
+    { "do"          , Terminal::doWord          , true  },
+    { "while"       , Terminal::whileWord       , true  },
+    { "if"          , Terminal::ifWord          , true  },
+    { "then"        , Terminal::thenWord        , true  },
+    { "else"        , Terminal::elseWord        , true  },
+
+    { "stream.peek" , Terminal::streamPeek      , false },
+    { "stream.getch", Terminal::streamGetCH     , false },
+    { "stream.skip" , Terminal::streamSkip      , false },  // ( char -- ) past the next char
+    { ".readString" , Terminal::readString      , false },
+    { "state"       , Terminal::state           , false },
+
+    { "see"         , Terminal::see             , false },
+    { "include"     , Terminal::include         , false },
+    { "save-image"  , Terminal::saveImage       , false },
+    { "shake"       , Terminal::shake           , false },
+};
+
+enum : uint32_t {
+    TERMINAL_COUNT  = sizeof(TERMINAL_WORDS) / sizeof(TERMINAL_WORDS[0]),
+};
+
+static constexpr SM::StaticBuiltinTable<SM::VM::NativeFunction, SM::PRIMITIVE_COUNT + TERMINAL_COUNT>   terminalTable_(SM::PRIMITIVE_WORDS, SM::PRIMITIVE_COUNT, TERMINAL_WORDS, TERMINAL_COUNT);
+static_assert(terminalTable_.seed != 0, "no perfect hash for the terminal words (duplicate name ?)");
+
+static constexpr SM::VM::Builtins   terminalBuiltins_ = terminalTable_.table();
 
-            { "see"         , Terminal::see             , false },
-    };
-
-    vm_ = vm;
+bool
+Terminal::isDefiningWord(uint32_t word) const {
+    static_assert(TERMINAL_WORDS[0].native == Terminal::defineWord, "':' is the first terminal word");
+    return word == SM::PRIMITIVE_COUNT;
+}
 
-    for(Primitive p : primitives) {
-        vm_->addNativeFunction(p.name, p.native, p.isImmediate);
-    }
+Terminal::Terminal(SM::VM* vm) : SM::VM::Process(nullptr, 0, vm), lazy_(false), openWord_(-1), pendingLazy_(0) {
+    vm_->setBuiltins(&terminalBuiltins_);
+    hostsBuiltins_  = true;
 }
 
-}   // namespace Forth
\ No newline at end of file
+}   // namespace Forth
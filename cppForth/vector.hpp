@@ -3,12 +3,22 @@
 ///
 /// custom vector implementation
 ///
-#include <malloc.h>
+#ifndef __SM_BASE__
+#   include "base.hpp"
+#endif
+
+#include "allocator.hpp"
+
 #include <cstdint>
 
 namespace SM
 {
 
+///
+/// growable array. Trivially relocatable elements are moved with realloc/memcpy,
+/// the others are move constructed into the new buffer. The memory comes from the
+/// allocator given at construction (the current allocator by default).
+///
 template<typename T>
 struct Vector
 {
@@ -17,33 +27,66 @@ private:
 	{
         MIN_VEC_RES_SIZE_	= 4
 	};
+
+protected:
     size_t			count_;
     size_t			reserved_;
     T*              data_;
+    T*              inline_;        // inline storage of a SmallVector (nullptr otherwise)
+    size_t          inlineCount_;
+    IAllocator*     allocator_;
+
+    // used by SmallVector: start with the inline storage
+    Vector(T* inlineData, size_t inlineCount, IAllocator* allocator) : count_(0), reserved_(inlineCount), data_(inlineData), inline_(inlineData), inlineCount_(inlineCount), allocator_(allocator) {}
 
 public:
-    Vector() : count_(0), reserved_(MIN_VEC_RES_SIZE_), data_(static_cast<T*>(malloc(sizeof(T) * MIN_VEC_RES_SIZE_))) {
+    Vector() : count_(0), reserved_(0), data_(nullptr), inline_(nullptr), inlineCount_(0), allocator_(currentAllocator()) {
 	}
 
-    Vector(size_t n, const T* elems) : count_(n), reserved_(n ? n : MIN_VEC_RES_SIZE_), data_(static_cast<T*>(malloc(sizeof(T) * (n ? n : MIN_VEC_RES_SIZE_)))) {
-		if( n ) {
-            T*  data    = static_cast<T*>(data_);
-            for( size_t i = 0; i < count_; ++i ) {
-                new(&(data[i])) T(elems[i]);
-            }
+    explicit Vector(IAllocator* allocator) : count_(0), reserved_(0), data_(nullptr), inline_(nullptr), inlineCount_(0), allocator_(allocator) {
+	}
+
+    Vector(size_t n, const T* elems) : count_(0), reserved_(0), data_(nullptr), inline_(nullptr), inlineCount_(0), allocator_(currentAllocator()) {
+        reserve(n);
+        for( size_t i = 0; i < n; ++i ) {
+            new(&(data_[i])) T(elems[i]);
         }
+        count_  = n;
+	}
+
+    Vector(const Vector<T>& v) : count_(0), reserved_(0), data_(nullptr), inline_(nullptr), inlineCount_(0), allocator_(currentAllocator()) {
+        copyFrom(v);
+	}
+
+    Vector(Vector<T>&& v) : count_(0), reserved_(0), data_(nullptr), inline_(nullptr), inlineCount_(0), allocator_(v.allocator_) {
+        moveFrom(v);
 	}
 
 	~Vector() {
-        T*  data    = static_cast<T*>(data_);
-        for( size_t i = 0; i < count_; ++i ) {
-            (data[i]).~T();
-		}
-        free(data_);
+        destroy(0, count_);
+        releaseBuffer();
         count_		= 0;
         reserved_	= 0;
 	}
 
+	Vector&
+	operator = (const Vector<T>& v) {
+        if( &v != this ) {
+            clear();
+            copyFrom(v);
+        }
+		return *this;
+	}
+
+	Vector&
+	operator = (Vector<T>&& v) {
+        if( &v != this ) {
+            clear();
+            moveFrom(v);
+        }
+		return *this;
+	}
+
 	const T*
     get() const	{	return data_; }
 
@@ -51,127 +94,230 @@ public:
     get()		{ return data_; }
 
     const T&
-    back() const { T*  data    = static_cast<T*>(data_); return data[count_ - 1]; }
+    back() const { return data_[count_ - 1]; }
+
+	T&
+    back()      { return data_[count_ - 1]; }
 
 	void
 	push_back(const T& t)	{
-        T*  data    = static_cast<T*>(data_);
-
         if( count_ == reserved_ ) {	// we have reached the limit
-            reserved_	<<= 1;
-
-            T*	new_data	= static_cast<T*>(malloc(sizeof(T) * reserved_));
-            for( size_t i = 0; i < count_; ++i )
-                new(&(new_data[i])) T(data[i]);
+            if( &t >= data_ && &t < data_ + count_ ) {  // t lives in the buffer that is about to move
+                size_t  idx = static_cast<size_t>(&t - data_);
+                grow(count_ + 1);
+                new(&(data_[count_])) T(data_[idx]);
+                ++count_;
+                return;
+            }
+            grow(count_ + 1);
+		}
 
-			// remove old data
-            for( size_t i = 0; i < count_; ++i )
-                (data[i]).~T();
+        new(&(data_[count_])) T(t);
+        ++count_;
+	}
 
-            free(data_);
+	void
+	push_back(T&& t)	{
+        if( count_ == reserved_ ) {
+            T   tmp(SM::move(t));
+            grow(count_ + 1);
+            new(&(data_[count_])) T(SM::move(tmp));
+        } else {
+            new(&(data_[count_])) T(SM::move(t));
+        }
+        ++count_;
+	}
 
-            data_	= new_data;
-            data    = new_data;
+    template<typename... Args>
+	T&
+	emplace_back(Args&&... args)	{
+        if( count_ == reserved_ ) {
+            grow(count_ + 1);
 		}
 
-        new(&(data[count_])) T(t);
-        ++count_;
+        new(&(data_[count_])) T(SM::forward<Args>(args)...);
+        return data_[count_++];
 	}
 
 	void
 	pop_back() {
         if( count_ ) {
-            T*  data    = static_cast<T*>(data_);
             --count_;
-            (data[count_]).~T();
+            (data_[count_]).~T();
 		}
 	}
 
     size_t		size() const			{ return count_;	}
-    const T&	operator[] (size_t i) const	{ const T*  data    = static_cast<const T*>(data_); return data[i];	}
+    size_t		capacity() const		{ return reserved_;	}
+    IAllocator*	allocator() const		{ return allocator_;	}
+    const T&	operator[] (size_t i) const	{ return data_[i];	}
 
-    T&		operator[] (size_t i)		{ T*  data    = static_cast<T*>(data_); return data[i];	}
+    T&		operator[] (size_t i)		{ return data_[i];	}
 
-	Vector&
-	operator = (const Vector<T>& v) {
-		this->~Vector();
-        reserved_	= v.reserved_;
-        count_		= v.count_;
-
-        data_		= static_cast<T*>(malloc(sizeof(T) * reserved_));
-        T*  data    = static_cast<T*>(data_);
-        const T*  vData    = static_cast<const T*>(v.data_);
-        for( size_t i = 0; i < count_; ++i )
-            new(&(data[i])) T(vData[i]);
-		return *this;
+	void
+	clear()	{
+        destroy(0, count_);
+        count_	= 0;
 	}
 
-    Vector(const Vector<T>& v) : count_(v.count_), reserved_(v.reserved_), data_(nullptr) {
-        data_		= static_cast<T*>(malloc(sizeof(T) * reserved_));
-        T*  data    = static_cast<T*>(data_);
-        const T*  vData    = static_cast<const T*>(v.data_);
-
-        for( size_t i = 0; i < count_; ++i )
-            new(&(data[i])) T(vData[i]);
+    ///
+    /// make sure n elements fit without reallocating
+    ///
+	void
+	reserve(size_t n) {
+        if( n > reserved_ ) {
+            relocate(n);
+        }
 	}
 
+    ///
+    /// release the unused reserved elements
+    ///
 	void
-	clear()	{
-        T*  data    = static_cast<T*>(data_);
-        for( size_t i = 0; i < count_; ++i ) {
-            (data[i]).~T();
-		}
-        count_	= 0;
+	shrink_to_fit() {
+        if( count_ < reserved_ && data_ != inline_ ) {
+            if( count_ == 0 ) {
+                releaseBuffer();
+                reserved_   = inlineCount_;
+            } else {
+                relocate(count_);
+            }
+        }
 	}
 
 	void
 	resize(size_t new_size)	{
         if( new_size > reserved_ ) {
-			// expand
-            reserved_	= new_size;
-
-            T*	new_data	= static_cast<T*>(malloc(sizeof(T) * reserved_));
-			assert(new_data != 0);
-            T*  data    = static_cast<T*>(data_);
-            for( size_t i = 0; i < count_; ++i ) {
-                new(&(new_data[i])) T(data[i]);
-			}
-
-			// remove old data
-            for( size_t i = 0; i < count_; ++i ) {
-                (data[i]).~T();
-			}
-            free(data_);
-
-            data_	= new_data;
-            data    = static_cast<T*>(data_);
-			// initialize the new new allocated elements
-            for( size_t i = count_; i < reserved_; ++i )
-			{
-                new(&(data[i])) T();
-			}
+            grow(new_size);
+        }
 
-            count_	= reserved_;
-        } else if( new_size < count_ ) {
+        if( new_size < count_ ) {
 			// shrink and remove data
-            T* data    = static_cast<T*>(data_);
-            for( size_t i = new_size; i < count_; ++i ) {
-                (data[i]).~T();
-			}
-
-            count_	= new_size;
-        } else if( new_size > count_ ) {	// and new_size <= __v_reserved
-
+            destroy(new_size, count_);
+        } else {
 			// initialize new elements in reserved
-            T* data    = static_cast<T*>(data_);
             for( size_t i = count_; i < new_size; ++i )
 			{
-                new(&(data[i])) T();
+                new(&(data_[i])) T();
 			}
-            count_	= new_size;
 		}
+        count_	= new_size;
 	}
 
+protected:
+    void
+    destroy(size_t from, size_t to) {
+        if( !IsTriviallyDestructible<T>::VALUE ) {
+            for( size_t i = from; i < to; ++i ) {
+                (data_[i]).~T();
+            }
+        }
+    }
+
+    void
+    releaseBuffer() {
+        if( data_ != inline_ ) {
+            allocator_->deallocate(data_, sizeof(T) * reserved_);
+        }
+        data_   = inline_;
+    }
+
+    // geometric growth to at least n elements
+    void
+    grow(size_t n) {
+        size_t  newReserved = reserved_ ? reserved_ << 1 : static_cast<size_t>(MIN_VEC_RES_SIZE_);
+        while( newReserved < n ) {
+            newReserved <<= 1;
+        }
+        relocate(newReserved);
+    }
+
+    // move the elements to a buffer of exactly n elements (n >= count_)
+    void
+    relocate(size_t n) {
+        if( IsTriviallyRelocatable<T>::VALUE && data_ != inline_ ) {
+            data_   = static_cast<T*>(allocator_->reallocate(data_, sizeof(T) * reserved_, sizeof(T) * n));
+            assert(data_ != nullptr);
+        } else {
+            T*  newData = static_cast<T*>(allocator_->allocate(sizeof(T) * n));
+            assert(newData != nullptr);
+
+            if( IsTriviallyRelocatable<T>::VALUE ) {
+                if( count_ ) {
+                    memcpy(static_cast<void*>(newData), static_cast<const void*>(data_), sizeof(T) * count_);
+                }
+            } else {
+                for( size_t i = 0; i < count_; ++i ) {
+                    new(&(newData[i])) T(SM::move(data_[i]));
+                    (data_[i]).~T();
+                }
+            }
+
+            releaseBuffer();
+            data_   = newData;
+        }
+        reserved_   = n;
+    }
+
+    void
+    copyFrom(const Vector<T>& v) {
+        reserve(v.count_);
+        for( size_t i = 0; i < v.count_; ++i ) {
+            new(&(data_[i])) T(v.data_[i]);
+        }
+        count_  = v.count_;
+    }
+
+    // steal the heap buffer when it comes from the same allocator, inline elements are moved one by one
+    void
+    moveFrom(Vector<T>& v) {
+        if( v.data_ != v.inline_ && reserved_ <= v.reserved_ && allocator_ == v.allocator_ ) {
+            releaseBuffer();
+            data_       = v.data_;
+            reserved_   = v.reserved_;
+            count_      = v.count_;
+            v.data_     = v.inline_;
+            v.reserved_ = v.inlineCount_;
+            v.count_    = 0;
+        } else {
+            reserve(v.count_);
+            for( size_t i = 0; i < v.count_; ++i ) {
+                new(&(data_[i])) T(SM::move(v.data_[i]));
+            }
+            count_  = v.count_;
+            v.clear();
+        }
+    }
+
 };	// struct vector
+
+///
+/// vector with the first N elements stored inline (no allocation until it grows past N)
+///
+template<typename T, size_t N>
+struct SmallVector : public Vector<T>
+{
+    SmallVector() : Vector<T>(reinterpret_cast<T*>(storage_), N, currentAllocator()) {}
+
+    explicit SmallVector(IAllocator* allocator) : Vector<T>(reinterpret_cast<T*>(storage_), N, allocator) {}
+
+    SmallVector(const SmallVector& v) : Vector<T>(reinterpret_cast<T*>(storage_), N, currentAllocator()) {
+        this->copyFrom(v);
+    }
+
+    SmallVector(const Vector<T>& v) : Vector<T>(reinterpret_cast<T*>(storage_), N, currentAllocator()) {
+        this->copyFrom(v);
+    }
+
+    SmallVector&
+    operator = (const SmallVector& v) {
+        Vector<T>::operator = (v);
+        return *this;
+    }
+
+private:
+    alignas(T) unsigned char    storage_[N * sizeof(T)];
+};
+
 }	// namespace SM
 #endif // VECTOR_HPP
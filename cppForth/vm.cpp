@@ -14,23 +14,84 @@
 ** along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 #include "vm.hpp"
+#include "scheduler.hpp"
 
 #include <stdio.h>
 
 namespace SM {
 
-int32_t
-VM::findWord(const String& name) {
-    if( nameToWord_.find(name) == nameToWord_.end() ) {
-        return nameToWord_[name];
-    } else { 
-        return static_cast<uint32_t>(-1);
-    } 
+static constexpr StaticBuiltinTable<VM::NativeFunction, PRIMITIVE_COUNT>   primitiveTable_(PRIMITIVE_WORDS, PRIMITIVE_COUNT, nullptr, 0);
+static_assert(primitiveTable_.seed != 0, "no perfect hash for the primitive names (duplicate name ?)");
+
+static constexpr VM::Builtins   primitives_ = primitiveTable_.table();
+
+const VM::Builtins*
+VM::primitives() {
+    return &primitives_;
+}
+
+void
+VM::setBuiltins(const Builtins* table) {
+    if( table == builtins_ ) {
+        return;
+    }
+
+    // the ids of the defined words depend on the built-in count
+    assert(functions_.size() == 0 && table->count <= MAX_BUILTINS);
+    builtins_       = table;
+    builtinCount_   = table->count;
+}
+
+void
+VM::bindSymbol(const String& name, uint32_t wordId) {
+    int32_t     builtin = builtins_->find(name.c_str(), name.size());
+    if( builtin >= 0 ) {
+        shadowed_[builtin >> 5] |= 1u << (builtin & 31);
+    }
+
+    SymbolTable::Symbol s   = symbols_.intern(name);
+    while( symbolWords_.size() <= s ) {
+        symbolWords_.push_back(-1);
+    }
+    symbolWords_[s] = static_cast<int32_t>(wordId);
+}
+
+uint32_t
+VM::appendData(const void* data, uint32_t size) {
+    uint32_t    addr    = static_cast<uint32_t>(constDataSegment_.size());
+    constDataSegment_.resize(addr + size);
+    memcpy(&constDataSegment_[addr], data, size);
+    return addr;
+}
+
+uint32_t
+VM::emitData(const void* data, uint32_t size) {
+    rawData_    = true;
+    return appendData(data, size);
+}
+
+uint32_t
+VM::internString(const String& str) {
+    pendingStringAt_    = static_cast<uint32_t>(wordSegment_.size());
+
+    HashMap<String, uint32_t>::Iterator it  = stringPool_.find(str);
+    if( it != stringPool_.end() ) {
+        pendingString_  = it.value();
+        return it.value();
+    }
+
+    AllocatorScope  scope(&arena_);     // the pooled key lives with the VM
+
+    uint32_t    addr    = appendData(str.c_str(), static_cast<uint32_t>(str.size() + 1));
+    stringPool_[str]    = addr;
+    pendingString_      = addr;
+    return addr;
 }
 
 uint32_t
 VM::addNativeFunction(const String& name, NativeFunction native, bool isImmediate) {
-    uint32_t    wordId  = static_cast<uint32_t>(functions_.size());
+    AllocatorScope  scope(&arena_);     // names are copied into the dictionary
+    uint32_t    wordId  = wordCount();
     Function    func;
 
     func.name   = name;
@@ -38,13 +99,14 @@ VM::addNativeFunction(const String& name, NativeFunction native, bool isImmediat
     func.body.native = native;
     func.isImmediate    = isImmediate;
     functions_.push_back(func);
-    nameToWord_[name]    = wordId;
+    bindSymbol(name, wordId);
     return wordId;
 }
 
 uint32_t
 VM::addNormalFunction(const String& name) {
-        uint32_t    wordId  = static_cast<uint32_t>(functions_.size());
+        AllocatorScope  scope(&arena_);
+        uint32_t    wordId  = wordCount();
 
         SM::VM::Function    func;
         func.name   = name;
@@ -52,42 +114,180 @@ VM::addNormalFunction(const String& name) {
         func.body.interpreted.start  = wordSegment_.size();
         functions_.push_back(func);
 
-        nameToWord_[name]    = wordId;
+        // a string interned outside of the word is not its first literal
+        pendingStringAt_    = NO_ADDRESS;
+
+        bindSymbol(name, wordId);
 
         return wordId;
 }
 
+void
+VM::endFunction(uint32_t idx) {
+    function(idx).body.interpreted.end    = wordSegment_.size();
+#ifdef FORTH_DENSE_CODE
+    translate(idx);
+#endif
+}
+
+bool
+VM::patch(uint32_t addr, uint32_t word) {
+    // the workers decode the code (and its dense translation) meanwhile
+    if( shared_ ) {
+        return false;
+    }
+
+#ifdef FORTH_DENSE_CODE
+    uint32_t    old     = wordSegment_[addr];
+#endif
+    wordSegment_[addr]  = word;
+
+#ifdef FORTH_DENSE_CODE
+    // words still being compiled are translated when ended
+    if( addr >= translatedEnd_ ) {
+        return true;
+    }
+
+    for( size_t i = functions_.size(); i > 0; --i ) {
+        const Function& func = functions_[i - 1];
+        if( func.color == Function::NORMAL && func.body.interpreted.start >= 0 &&
+            static_cast<uint32_t>(func.body.interpreted.start) <= addr && addr < functionEnd(func) ) {
+            if( func.body.interpreted.denseStart >= 0 && !rewriteDense(func, addr, old, word) ) {
+                translate(builtinCount_ + i - 1);   // the previous translation stays valid for the running frames
+            }
+            return true;
+        }
+    }
+#endif
+    return true;
+}
+
+#ifdef FORTH_DENSE_CODE
+void
+VM::encodeVarint(uint32_t v) {
+    while( v >= 0x80 ) {
+        denseSegment_.push_back(static_cast<uint8_t>(v | 0x80));
+        v >>= 7;
+    }
+    denseSegment_.push_back(static_cast<uint8_t>(v));
+}
+
+bool
+VM::rewriteDense(const Function& func, uint32_t addr, uint32_t old, uint32_t word) {
+    // a lit.i32 operand shares the dense offset of its lit.i32
+    bool        operand = addr > static_cast<uint32_t>(func.body.interpreted.start) && addrMap_[addr] == addrMap_[addr - 1];
+    uint32_t    pos     = addrMap_[addr];
+    if( operand ) {
+        pos    += varintLength(0);
+        old     = zigzag(old);
+        word    = zigzag(word);
+    } else if( old == 0 || word == 0 ) {
+        return false;   // an operand appears or goes
+    }
+
+    if( varintLength(old) != varintLength(word) ) {
+        return false;
+    }
+
+    // the same number of bytes, the continuation bits stay
+    uint32_t    length  = varintLength(word);
+    for( uint32_t b = 0; b + 1 < length; ++b ) {
+        denseSegment_[pos + b]  = static_cast<uint8_t>(word | 0x80);
+        word  >>= 7;
+    }
+    denseSegment_[pos + length - 1] = static_cast<uint8_t>(word);
+    return true;
+}
+
+void
+VM::translate(uint32_t idx) {
+    Function&   func    = function(idx);
+    uint32_t    end     = functionEnd(func);
+
+    if( addrMap_.size() < wordSegment_.size() ) {
+        addrMap_.resize(wordSegment_.size());
+    }
+
+    func.body.interpreted.denseStart    = static_cast<int32_t>(denseSegment_.size());
+
+    uint32_t    pos     = func.body.interpreted.start;
+    while( pos < end ) {
+        uint32_t    word    = wordSegment_[pos];
+        addrMap_[pos]   = denseSegment_.size();
+        encodeVarint(word);
+
+        if( word == 0 && pos + 1 < end ) {  // lit.i32 operand
+            addrMap_[pos + 1]   = addrMap_[pos];
+            encodeVarint(zigzag(wordSegment_[pos + 1]));
+            ++pos;
+        }
+        ++pos;
+    }
+
+    if( end > translatedEnd_ ) {
+        translatedEnd_  = end;
+    }
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // runtime
 ////////////////////////////////////////////////////////////////////////////////
 
 void
 VM::Process::step() {
-    uint32_t    word    = vm_->wordSegment_[wp_];
+    uint32_t    at      = wp_;
+    uint32_t    word    = fetchWord();
         
-    if( word > vm_->functions_.size() ) {
+    if( word >= vm_->wordCount() ) {
         emitSignal(VM::Process::Signal(VM::Process::Signal::WORD_ID_OUT_OF_RANGE, pid_, 0));
         return;
     }
 
     if( vm_->verboseDebugging_ ) {
-        fprintf(stdout, "    @%d -- %s", wp_, vm_->functions_[word].name.c_str());
+        out_.putString("    @");
+        out_.putInt(static_cast<int32_t>(at));
+        out_.putString(" -- ");
+        out_.putString(vm_->wordName(word));
         if( word == 0 ) {
-            fprintf(stdout, " %d", vm_->wordSegment_[wp_ + 1]);
+            out_.putChar(' ');
+#ifdef FORTH_DENSE_CODE
+            uint32_t    pos     = wp_;
+            out_.putInt(static_cast<int32_t>(unzigzag(decodeVarint(vm_->denseSegment_.get(), pos))));
+#else
+            out_.putInt(static_cast<int32_t>(vm_->wordSegment_[wp_ + 1]));
+#endif
+        }
+        out_.putChar('\n');
+    }
+
+    if( vm_->isBuiltin(word) ) {
+        // the extended words take their process for the one that extends the table
+        if( word >= PRIMITIVE_COUNT && !hostsBuiltins_ ) {
+            emitSignal(VM::Process::Signal(VM::Process::Signal::WORD_NOT_IMPLEMENTED, pid_, word));
+            return;
         }
-        fprintf(stdout, "\n");
+        vm_->builtins_->words[word].native(this);
+#ifndef FORTH_DENSE_CODE
+        ++wp_;
+#endif
+        return;
     }
 
-    if( vm_->functions_[word].color == VM::Function::Color::NATIVE ) {
-        vm_->functions_[word].body.native(this);
+    const Function& func    = vm_->function(word);
+    if( func.color == VM::Function::Color::NATIVE ) {
+        func.body.native(this);
+#ifndef FORTH_DENSE_CODE
         ++wp_;
+#endif
     } else {
-        if( vm_->functions_[word].body.interpreted.start == -1 ) {
+        if( func.body.interpreted.start == -1 && !vm_->compileLazy(word) ) {
             emitSignal(VM::Process::Signal(VM::Process::Signal::WORD_NOT_IMPLEMENTED, pid_, 0));
             return;
         } else {
             if( vm_->verboseDebugging_ ) {
-                fprintf(stdout, "%s:\n", vm_->functions_[word].name.c_str());
+                out_.putString(func.name.c_str(), func.name.size());
+                out_.putString(":\n");
             }
             setCall(word);
         }
@@ -98,112 +298,186 @@ void
 VM::Process::emitSignal(const VM::Process::Signal& sig) {
     sig_    = sig;
 
+    // keep the output that led to the error before the trace
+    out_.flush();
+
     for( int i = returnStack_.size() - 1; i >= 0 ; --i ) {
-        fprintf(stderr, "\t@[%d] - %s\n", returnStack_[i].word, vm_->functions_[returnStack_[i].word].name.c_str());
+        fprintf(stderr, "\t@[%d] - %s\n", returnStack_[i].word, vm_->wordName(returnStack_[i].word));
     }
 }
 
 void
 VM::Process::runCall(uint32_t word) {
 
-    if( word > vm_->functions_.size() ) {
+    if( word >= vm_->wordCount() ) {
         emitSignal(VM::Process::Signal(VM::Process::Signal::WORD_ID_OUT_OF_RANGE, pid_, 0));
         return;
     }
 
     // IF verbose debugging AND IF function id exists
     if( vm_->verboseDebugging_ ) {
-        fprintf(stdout, "%s:\n", vm_->functions_[word].name.c_str());
+        out_.putString(vm_->wordName(word));
+        out_.putString(":\n");
     }
 
-    if( vm_->functions_[word].color == VM::Function::Color::NATIVE && sig_.ty == Signal::NONE ) {
-        vm_->functions_[word].body.native(this);
+    if( vm_->isNativeWord(word) && sig_.ty == Signal::NONE ) {
+        if( vm_->isBuiltin(word) && word >= PRIMITIVE_COUNT && !hostsBuiltins_ ) {
+            emitSignal(VM::Process::Signal(VM::Process::Signal::WORD_NOT_IMPLEMENTED, pid_, word));
+        } else if( vm_->isBuiltin(word) ) {
+            vm_->builtins_->words[word].native(this);
+        } else {
+            vm_->function(word).body.native(this);
+        }
     } else {
+        if( !vm_->ensureCompiled(word) ) {
+            emitSignal(VM::Process::Signal(VM::Process::Signal::WORD_NOT_IMPLEMENTED, pid_, 0));
+            return;
+        }
+
         uint32_t    rsPos   = returnStack_.size();
 
+#ifdef FORTH_VM_SEGMENTS
+        FaultTrap   trap;
+        watchRegions(trap);
+        if( sigsetjmp(trap.env, 1) ) {
+            trap.leave();
+            emitSignal(Signal(regionSignal(trap.kind, trap.overflow), pid_, 0));
+            return;
+        }
+        trap.enter();
+#endif
+
         setCall(word);
 
         while( returnStack_.size() != rsPos && sig_.ty == Signal::NONE ) {
             step();
         }
+
+#ifdef FORTH_VM_SEGMENTS
+        trap.leave();
+#endif
     }
 }
 
+bool
+VM::Process::resume(uint32_t budget) {
+#ifdef FORTH_VM_SEGMENTS
+    FaultTrap   trap;
+    watchRegions(trap);
+    if( sigsetjmp(trap.env, 1) ) {
+        trap.leave();
+        emitSignal(Signal(regionSignal(trap.kind, trap.overflow), pid_, 0));
+        return false;
+    }
+    trap.enter();
+#endif
+
+    // counted in a local set after sigsetjmp: the argument is not live across it
+    uint32_t    left    = budget;
+    while( left && returnStack_.size() && sig_.ty == Signal::NONE ) {
+        step();
+        --left;
+    }
 
-VM::Process::Process(VM::Process* parent, uint32_t pid) :  sig_(Signal(VM::Process::Signal::NONE, 0, 0)), pid_(pid), wp_(0), lp_(0), parent_(parent) {}
+#ifdef FORTH_VM_SEGMENTS
+    trap.leave();
+#endif
 
-VM::VM() : verboseDebugging_(false) {
-    initPrimitives();
+    return returnStack_.size() != 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// primitives
-////////////////////////////////////////////////////////////////////////////////
+#ifdef FORTH_VM_SEGMENTS
 void
-VM::initPrimitives() {
-    struct Primitive {
-        const char*     name;
-        NativeFunction  native;
-        bool            isImmediate;
-    };
-
-    Primitive primitives[] = {
-        { "lit.i32"     , Primitives::fetchInt32    , false },
-        { "return"      , Primitives::returnWord    , false },
-        { "#"           , Primitives::callIndirect  , false },
-        { "."           , Primitives::printInt32    , false },
-        { ".c"          , Primitives::printChar     , false },
-        { "+"           , Primitives::addInt32      , false },
-        { "-"           , Primitives::subInt32      , false },
-        { "*"           , Primitives::mulInt32      , false },
-        { "/"           , Primitives::divInt32      , false },
-        { "%"           , Primitives::modInt32      , false },
-        { "branch"      , Primitives::branch        , false },  // ( addr -- )
-        { "?branch"     , Primitives::branchIf      , false },  // ( cond addr -- )
-        { "dup"         , Primitives::dup           , false },
-        { "drop"        , Primitives::drop          , false },
-        { "swap"        , Primitives::swap          , false },
-        { "code.size"   , Primitives::codeSize      , false },
-        { "w>"          , Primitives::emitWord      , false },
-        { "cd>"         , Primitives::emitConstData , false },
-        { "e>"          , Primitives::emitException , false },
-        
-        { "=="          , Primitives::ieq           , false },
-        { "=/="         , Primitives::ineq          , false },
-        { ">"           , Primitives::igt           , false },
-        { "<"           , Primitives::ilt           , false },
-        { ">="          , Primitives::igeq          , false },
-        { "<="          , Primitives::ileq          , false },
-        { "not"         , Primitives::notBW         , false },
-        { "and"         , Primitives::andBW         , false },
-        { "or"          , Primitives::orBW          , false },
-
-        { "v&"          , Primitives::vsPtr         , false },
-        { "r&"          , Primitives::rsPtr         , false },
-        { "w&"          , Primitives::wsPtr         , false },
-        { "cd&"         , Primitives::cdsPtr        , false },
-        { "@"           , Primitives::vsFetch       , false },
-        { "r@"          , Primitives::rsFetch       , false },
-        { "w@"          , Primitives::wsFetch       , false },
-        { "l@"          , Primitives::lsFetch       , false },
-        { "cd@"         , Primitives::cdsFetch      , false },
-        { "!"           , Primitives::vsStore       , false },
-        { "w!"          , Primitives::wsStore       , false },
-        { "l!"          , Primitives::lsStore       , false },
-        { "cd!"         , Primitives::cdsStore      , false },
-        
-        { "bye"         , Primitives::bye           , false },
-        { "exit"        , Primitives::exit          , false },
+VM::Process::watchRegions(FaultTrap& trap) const {
+    trap.watch(valueStack_.region());
+    trap.watch(returnStack_.region());
+    trap.watch(locals_.region);
+    trap.watch(vm_->wordSegment_.region());
+    trap.watch(vm_->constDataSegment_.region());
+}
+
+VM::Process::Signal::Type
+VM::Process::regionSignal(RegionKind kind, bool overflow) {
+    switch( kind ) {
+    case VALUE_STACK_REGION:    return overflow ? Signal::VS_OVERFLOW : Signal::VS_UNDERFLOW;
+    case RETURN_STACK_REGION:   return overflow ? Signal::RS_OVERFLOW : Signal::RS_UNDERFLOW;
+    case LOCAL_STACK_REGION:    return Signal::LS_OVERFLOW;
+    default:                    return Signal::SEGMENT_OVERFLOW;
+    }
+}
+#endif
 
-        { ".s"          , Primitives::showValueStack, false },
-        { "deb.set"     , Primitives::setDebugMode  , false },
-    };
 
-    for(Primitive p : primitives) {
-        addNativeFunction(p.name, p.native, p.isImmediate);
+#ifndef FORTH_VM_SEGMENTS
+void
+VM::Process::FrameArena::grow() {
+    uint32_t    prevCapacity    = capacity;
+    while( capacity < top ) {
+        capacity <<= 1;
     }
+
+    base    = static_cast<Value*>(allocator->reallocate(base, sizeof(Value) * prevCapacity, sizeof(Value) * capacity));
+    assert(base != nullptr);
+}
+#endif
+
+VM::Process::Process(VM::Process* parent, uint32_t pid, VM* vm) :  sig_(Signal(VM::Process::Signal::NONE, 0, 0)), pid_(pid), wp_(0), lp_(0), vm_(vm), parent_(parent), hostsBuiltins_(false) {}
+
+VM::VM(IAllocator* parent) :
+    arena_(parent),
+    pool_(parent),
+#ifdef FORTH_DENSE_CODE
+    denseSegment_(&arena_),
+    addrMap_(&arena_),
+    translatedEnd_(0),
+#endif
+    functions_(&arena_),
+    symbols_(&arena_),
+    symbolWords_(&arena_),
+    wordSegment_(&arena_),
+    constDataSegment_(&arena_),
+    stringPool_(&arena_),
+    relocations_(&arena_),
+    pendingString_(0),
+    pendingStringAt_(NO_ADDRESS),
+    rawData_(false),
+    memoryLimit_(0),
+    lazyCompiler_(nullptr),
+    lazyContext_(nullptr),
+    scheduler_(nullptr),
+    shared_(false),
+    verboseDebugging_(false) {
+    // the built-ins are static, building a VM does not allocate for them
+    builtins_       = &primitives_;
+    builtinCount_   = primitives_.count;
+    memset(shadowed_, 0, sizeof(shadowed_));
 }
 
+void
+VM::setShared(bool shared) {
+    if( shared && !shared_ ) {
+        for( uint32_t word = builtinCount_; word < wordCount(); ++word ) {
+            Function&   func    = function(word);
+            if( func.isNative() ) {
+                continue;
+            }
+
+            if( func.body.interpreted.start < 0 && !compileLazy(word) ) {
+                continue;
+            }
+#ifdef FORTH_DENSE_CODE
+            if( function(word).body.interpreted.denseStart < 0 ) {
+                translate(word);
+            }
+#endif
+        }
+    }
+    shared_ = shared;
+}
 
+VM::~VM() {
+    // the processes left hold pool memory
+    delete scheduler_;
+}
 
 }
@@ -20,17 +20,45 @@
 #endif
 
 #include "intrusive-ptr.hpp"
+#include "allocator.hpp"
+#include "cell.hpp"
 #include "vector.hpp"
 #include "string.hpp"
 #include "hash_map.hpp"
+#include "symbol_table.hpp"
+#include "builtins.hpp"
+#include "segment.hpp"
+#include "output.hpp"
 
 namespace SM {
+struct Scheduler;
+
 struct VM : public RCObject {
 
     struct Process;
 
     typedef void    (*NativeFunction)(Process* proc);
 
+    // compiles a word defined without code (start -1), false when it can not
+    typedef bool    (*LazyCompiler)(void* context, uint32_t word);
+
+    typedef BuiltinWord<NativeFunction>     Builtin;
+    typedef BuiltinTable<NativeFunction>    Builtins;
+
+    enum {
+        MAX_LOCAL_COUNT     = 255,  // locals per word, the frame size has to fit in a return entry
+        MAX_BUILTINS        = 256,
+    };
+
+    // reserved sizes (in elements) of the stacks and segments with FORTH_VM_SEGMENTS
+    enum {
+        VALUE_STACK_RESERVE     = 1 << 16,
+        RETURN_STACK_RESERVE    = 1 << 16,
+        LOCAL_STACK_RESERVE     = 1 << 16,
+        CODE_SEGMENT_RESERVE    = 1 << 24,
+        DATA_SEGMENT_RESERVE    = 1 << 24,  // bytes
+    };
+
     struct Function {
         enum Color {
             NATIVE                      = 0,    // native function
@@ -45,7 +73,12 @@ struct VM : public RCObject {
             NativeFunction      native;
             struct {
                 int32_t             start;
+                uint32_t            end;            // one past the last instruction, set when the word is ended
                 uint32_t            localCount;
+                bool                clearLocals;    // zero the local frame on each call
+#ifdef FORTH_DENSE_CODE
+                int32_t             denseStart;     // start in the dense segment, -1 when not translated
+#endif
             } interpreted;
         } body;
 
@@ -53,7 +86,12 @@ struct VM : public RCObject {
 
         Function() : color(NATIVE), isImmediate(false) {
             body.native = nullptr;
+            body.interpreted.end        = 0;
             body.interpreted.localCount = 0;
+            body.interpreted.clearLocals = false;
+#ifdef FORTH_DENSE_CODE
+            body.interpreted.denseStart = -1;
+#endif
         }
     };
 
@@ -68,7 +106,18 @@ struct VM : public RCObject {
                 WORD_ID_OUT_OF_RANGE    = -3,   // code segment fault
                 WORD_NOT_IMPLEMENTED    = -4,   // the function is not implemented (TODO: should this be on the parser end only ?)
                 VS_UNDERFLOW            = -5,   // value stack underflow
-
+                VS_OVERFLOW             = -6,   // value stack overflow
+                RS_UNDERFLOW            = -7,   // return stack underflow
+                RS_OVERFLOW             = -8,   // return stack overflow
+                LS_OVERFLOW             = -9,   // local stack overflow
+                SEGMENT_OVERFLOW        = -10,  // code or constant data segment is full
+                OUT_OF_MEMORY           = -11,  // the VM went over its memory limit
+                YIELD                   = -12,  // the process gives up the rest of its turn
+                JOIN                    = -13,  // the process waits for process data to end
+                VM_IS_SHARED            = -14,  // the segments can not grow while worker threads run
+                PARK                    = -15,  // the process waits on channels (Scheduler::waitFor)
+                BAD_CHANNEL             = -16,  // not a channel id, or no channel left
+                DEADLOCK                = -17,  // the host waits on a channel no process can serve
             };
 
             Type                ty;     // signal type
@@ -82,25 +131,71 @@ struct VM : public RCObject {
         /// return stack entry
         ///
         struct RetEntry {
-            uint32_t            word;   // calling word
-            uint32_t            ip; // global text (code) instruction pointer
-            uint32_t            lp; // local pointer
-            uint32_t            cp; // exception catcher (catch pointer)
+            uint32_t            ip;             // global text (code) instruction pointer
+            uint32_t            lp;             // caller local pointer
+            uint32_t            word    : 24;   // called word
+            uint32_t            frame   : 8;    // local frame size of the called word
         };
 
-        union Value {
-            uint32_t            u32;
-            int32_t             i32;
-            float               f32;
-            void*               ptr;
-        
-            Value()                     : u32(0) {}
-            explicit Value(uint32_t v)  : u32(v) {}
-            explicit Value(int32_t v)   : i32(v) {}
-            explicit Value(float v)     : f32(v) {}
-            explicit Value(void* v)     : ptr(v) {}
+        typedef VMCell      Value;      // see FORTH_CELL_WIDTH in cell.hpp
+
+        ///
+        /// local frame arena: frames are bump allocated on call and released on return,
+        /// they are not initialized unless the word asks for it
+        ///
+        struct FrameArena {
+            enum {
+                INITIAL_SIZE    = 256,
+            };
+
+#ifdef FORTH_VM_SEGMENTS
+            FrameArena() : base(static_cast<Value*>(region.reserve(sizeof(Value) * LOCAL_STACK_RESERVE, LOCAL_STACK_REGION))), top(0), capacity(LOCAL_STACK_RESERVE) {}
+
+            inline uint32_t
+            alloc(uint32_t count) {
+                uint32_t    fp  = top;
+                top += count;
+                return fp;
+            }
+
+            VMRegion            region;
+#else
+            IAllocator*         allocator;
+
+            FrameArena() : allocator(currentAllocator()), base(static_cast<Value*>(allocator->allocate(sizeof(Value) * INITIAL_SIZE))), top(0), capacity(INITIAL_SIZE) {}
+            ~FrameArena()               { allocator->deallocate(base, sizeof(Value) * capacity); }
+
+            inline uint32_t
+            alloc(uint32_t count) {
+                uint32_t    fp  = top;
+                top += count;
+                if( top > capacity ) {
+                    grow();
+                }
+                return fp;
+            }
+
+            void            grow();
+#endif
+
+            inline void release(uint32_t count)     { top -= count; }
+
+            Value*              base;
+            uint32_t            top;
+            uint32_t            capacity;
         };
 
+#ifdef FORTH_VM_SEGMENTS
+        typedef Segment<Value, VALUE_STACK_REGION, VALUE_STACK_RESERVE>         ValueStack;
+        typedef Segment<RetEntry, RETURN_STACK_REGION, RETURN_STACK_RESERVE>    ReturnStack;
+
+        void            watchRegions(FaultTrap& trap) const;
+        static Signal::Type regionSignal(RegionKind kind, bool overflow);
+#else
+        typedef Vector<Value>                   ValueStack;
+        typedef Vector<RetEntry>                ReturnStack;
+#endif
+
         inline void     pushValue(Value v)      { valueStack_.push_back(v); }
         inline Value    topValue() const        { return valueStack_.back(); }
         inline void     popValue()              { valueStack_.pop_back(); }
@@ -108,37 +203,77 @@ struct VM : public RCObject {
         void            step();
         void            runCall(uint32_t word);
         void            emitSignal(const Signal& sig);
-    
-        Process(Process* parent, uint32_t pid);
+
+        // makes a defined word the call in progress of an idle process, resume() runs it
+        inline void     start(uint32_t word)    { setCall(word); }
+        // runs the call in progress for at most budget instructions, false once it has returned
+        bool            resume(uint32_t budget);
+
+        Process(Process* parent, uint32_t pid, VM* vm = nullptr);
 
         uint32_t        pid() const             { return pid_; }
+        inline Process* parent() const          { return parent_; }
+        inline OutputSink&  out()               { return out_; }
+
+        inline const Signal&    signal() const  { return sig_; }
+        inline void     clearSignal()           { sig_ = Signal(Signal::NONE, 0, 0); }
 
 
     protected:
         inline void
         setCall(uint32_t word) {
+            const Function& func    = vm_->function(word);
+            uint32_t        frame   = func.body.interpreted.localCount;
+
             RetEntry re;
-            re.word = word;
-            re.ip = wp_;
-            re.lp = lp_;
+            re.ip       = wp_;
+            re.lp       = lp_;
+            re.word     = word;
+            re.frame    = frame;
             returnStack_.push_back(re);
-            wp_ = vm_->functions_[word].body.interpreted.start;
-            lp_ = localStack_.size();
-            localStack_.resize(lp_ + vm_->functions_[word].body.interpreted.localCount);
+
+#ifdef FORTH_DENSE_CODE
+            if( func.body.interpreted.denseStart < 0 ) {
+                vm_->translate(word);
+            }
+            wp_ = func.body.interpreted.denseStart;
+#else
+            wp_ = func.body.interpreted.start;
+#endif
+            lp_ = locals_.alloc(frame);
+            if( func.body.interpreted.clearLocals ) {
+                for( uint32_t i = 0; i < frame; ++i ) {
+                    locals_.base[lp_ + i] = Value();
+                }
+            }
         }
 
         inline void
         setRet() {
-            uint32_t word = returnStack_.back().word;
-            wp_ = returnStack_.back().ip;
-            lp_  = returnStack_.back().lp;
-            localStack_.resize(localStack_.size() - vm_->functions_[word].body.interpreted.localCount);
+            const RetEntry& re  = returnStack_.back();
+            wp_ = re.ip;
+            lp_ = re.lp;
+            locals_.release(re.frame);
             returnStack_.pop_back();
         }
 
-        inline void     setBranch(uint32_t addr)    { wp_ = addr; }
-
-        uint32_t        fetch()                     { ++wp_; return vm_->wordSegment_[wp_]; } 
+#ifdef FORTH_DENSE_CODE
+        // wp_ is a dense segment offset and is past the current instruction while it executes
+        inline void     setBranch(uint32_t addr)    { wp_ = vm_->addrMap_[addr]; }
+        inline void     setIndirectCall(uint32_t word)  { setCall(word); }
+        inline void     retry(uint32_t word)        { wp_ -= word < 0x80 ? 1 : 2; }     // the built-in word runs again
+
+        inline uint32_t fetchWord()                 { return decodeVarint(vm_->denseSegment_.get(), wp_); }
+        inline uint32_t fetch()                     { return unzigzag(decodeVarint(vm_->denseSegment_.get(), wp_)); }
+#else
+        // wp_ stays on the current instruction while it executes and is incremented after a native
+        inline void     setBranch(uint32_t addr)    { wp_ = addr - 1; }
+        inline void     setIndirectCall(uint32_t word)  { setCall(word); --wp_; }
+        inline void     retry(uint32_t)             { --wp_; }                          // the built-in word runs again
+
+        inline uint32_t fetchWord()                 { return vm_->wordSegment_[wp_]; }
+        uint32_t        fetch()                     { ++wp_; return vm_->wordSegment_[wp_]; }
+#endif
 
         uint32_t                                pid_;           // process id
 
@@ -148,46 +283,295 @@ struct VM : public RCObject {
 
         VM*                                     vm_;            // the virtual machine this process belongs to
         Process*                                parent_;        // parent process
+        bool                                    hostsBuiltins_; // runs the words after the primitives (a terminal)
 
-        Vector<Value>                           valueStack_;    // contains values on the stack
-        Vector<RetEntry>                        returnStack_;   // contains calling word pointer
-        Vector<Value>                           localStack_;    // local block stack
+        ValueStack                              valueStack_;    // contains values on the stack
+        ReturnStack                             returnStack_;   // contains calling word pointer
+        FrameArena                              locals_;        // local frames
+        OutputSink                              out_;           // text output
 
         friend struct Primitives;
     };
 
-    int32_t         findWord(const String& name);
+    // word id of a name, -1 when it is not defined (nothing is inserted)
+    inline int32_t  findWord(const String& name) const      { return findWord(name.c_str(), name.size()); }
+
+    inline int32_t
+    findWord(const char* str, size_t len) const {
+        int32_t     word    = builtins_->find(str, len);
+        if( word >= 0 && !isShadowed(static_cast<uint32_t>(word)) ) {
+            return word;
+        }
+        return symbolWord(symbols_.find(str, len));
+    }
+
+    // the word a symbol currently names, -1 for a symbol that is not a word
+    inline int32_t
+    symbolWord(SymbolTable::Symbol s) const {
+        return s < symbolWords_.size() ? symbolWords_[s] : -1;
+    }
+
+
+    inline uint32_t wordAddr(uint32_t word)     { return function(word).body.interpreted.start; }
 
+    inline uint32_t
+    emit(uint32_t word) {
+        uint32_t    pos     = static_cast<uint32_t>(wordSegment_.size());
+        wordSegment_.push_back(word);
 
-    inline uint32_t wordAddr(uint32_t word)     { return functions_[word].body.interpreted.start; }
+        // the literal compiled right after a string is interned is its address
+        if( pos && pos - 1 == pendingStringAt_ && word == pendingString_ && wordSegment_[pos - 1] == 0 ) {
+            relocate(pos, RELOC_DATA);
+        }
+        return pos;
+    }
+
+    uint32_t        emitData(const void* data, uint32_t size);     // program data: the data segment is not compacted
+    uint32_t        internString(const String& str);
+
+    ///
+    /// relocations: the literal operands that are not plain numbers, word ids (compiled
+    /// by ') and interned string addresses. The branch addresses need none, they are the
+    /// literals followed by branch or ?branch. Kept in address order, they let compact()
+    /// move the words and the strings.
+    ///
+    enum RelocationKind : uint32_t {
+        RELOC_WORD          = 0,
+        RELOC_DATA          = 1,
+    };
+
+    inline void     relocate(uint32_t addr, RelocationKind kind)    { relocations_.push_back((addr << 1) | kind); }
 
-    inline uint32_t emit(uint32_t word)         { uint32_t pos = static_cast<uint32_t>(wordSegment_.size()); wordSegment_.push_back(word); return pos; }
+    ///
+    /// tree shaking: keeps the roots and the words they reach (calls and word id literals),
+    /// drops the other defined words and the code outside of any word, then renumbers the
+    /// words and packs their code (and the interned strings, unless the program wrote its
+    /// own data). Calls, branch addresses and relocated literals are rewritten; numbers a
+    /// program uses as word ids or addresses are not, and nothing may be running. A name
+    /// whose latest word was dropped is undefined after. Fails without changing anything
+    /// when a branch leaves the code that is kept.
+    ///
+    bool            compact(const uint32_t* roots, uint32_t count);
+
+    inline const char*  dataString(uint32_t addr) const { return reinterpret_cast<const char*>(&constDataSegment_[addr]); }
 
     uint32_t        addNativeFunction(const String& name, NativeFunction native, bool isImmediate);
     uint32_t        addNormalFunction(const String& name);
 
-    void            setFunctionAsImmediate(uint32_t idx) { functions_[idx].isImmediate = true; }
-    void            setFunctionLocalCount(uint32_t idx, uint32_t locals) { functions_[idx].body.interpreted.localCount = locals; }
+    void            endFunction(uint32_t idx);
+    bool            patch(uint32_t addr, uint32_t word);       // false while shared
+
+    ///
+    /// words defined with a start of -1 have their code compiled on the first call by
+    /// the lazy compiler (none by default: calling them is an error)
+    ///
+    inline void     setLazyCompiler(LazyCompiler compiler, void* context)   { lazyCompiler_ = compiler; lazyContext_ = context; }
+    inline bool     compileLazy(uint32_t word)  { return lazyCompiler_ && !shared_ && lazyCompiler_(lazyContext_, word); }
+
+    inline bool
+    ensureCompiled(uint32_t word) {
+        return isNativeWord(word) || function(word).body.interpreted.start >= 0 || compileLazy(word);
+    }
+
+    void            setFunctionAsImmediate(uint32_t idx) { function(idx).isImmediate = true; }
+    void            setFunctionLocalCount(uint32_t idx, uint32_t locals, bool clear) {
+        function(idx).body.interpreted.localCount     = locals;
+        function(idx).body.interpreted.clearLocals    = clear;
+    }
+
+    ///
+    /// the built-in words come first (ids 0 .. builtinCount() - 1) and are not stored in
+    /// the VM, the defined words follow. An extended table (the terminal words) can
+    /// replace the primitives as long as no word has been defined yet.
+    ///
+    static const Builtins*  primitives();
+    void            setBuiltins(const Builtins* table);
+
+    inline uint32_t builtinCount() const        { return builtinCount_; }
+    inline bool     isBuiltin(uint32_t word) const  { return word < builtinCount_; }
+    inline uint32_t wordCount() const           { return builtinCount_ + static_cast<uint32_t>(functions_.size()); }
+    inline uint32_t lastWord() const            { return wordCount() - 1; }
+
+    // defined (non built-in) words only
+    inline Function&        function(uint32_t word)         { return functions_[word - builtinCount_]; }
+    inline const Function&  function(uint32_t word) const   { return functions_[word - builtinCount_]; }
+
+    inline const char*
+    wordName(uint32_t word) const {
+        return isBuiltin(word) ? builtins_->words[word].name : function(word).name.c_str();
+    }
+
+    inline bool
+    isNativeWord(uint32_t word) const {
+        return isBuiltin(word) || function(word).isNative();
+    }
+
+    inline bool
+    isImmediate(uint32_t word) const {
+        return isBuiltin(word) ? builtins_->words[word].isImmediate : function(word).isImmediate;
+    }
+
+
+#ifdef FORTH_VM_SEGMENTS
+    typedef Segment<uint32_t, CODE_SEGMENT_REGION, CODE_SEGMENT_RESERVE>            CodeSegment;
+    typedef Segment<uint8_t, DATA_SEGMENT_REGION, DATA_SEGMENT_RESERVE>             DataSegment;
+#else
+    typedef Vector<uint32_t>                    CodeSegment;
+    typedef Vector<uint8_t>                     DataSegment;
+#endif
+
+    ///
+    /// the dictionary, code and data segments live in a per VM arena released at once
+    /// with the VM, the processes and streams created in pool() scope are recycled
+    /// by size class. Both draw from parent (the heap by default).
+    ///
+    explicit VM(IAllocator* parent = nullptr);
+    ~VM() override;
+
+    inline ArenaAllocator&  arena()             { return arena_; }
+    inline PoolAllocator&   pool()              { return pool_; }
+
+    inline size_t   memoryUsed() const          { return arena_.used() + pool_.used(); }
+    inline void     setMemoryLimit(size_t bytes)    { memoryLimit_ = bytes; }  // 0: no limit
+    inline bool     isOverMemoryLimit() const   { return memoryLimit_ && memoryUsed() > memoryLimit_; }
+
+    // the processes spawned by the programs (created on first use)
+    Scheduler&      scheduler();
+    inline bool     hasScheduler() const        { return scheduler_ != nullptr; }
+
+    ///
+    /// shared: the worker threads only read the dictionary and the code, nothing may be
+    /// defined, compiled, translated, patched or appended to a segment (stores in place
+    /// into the data segments are the program's business). Sharing compiles the lazy words and translates the dense
+    /// code up front.
+    ///
+    void            setShared(bool shared);
+    inline bool     isShared() const            { return shared_; }
+
+    ///
+    /// images: the defined words, the code and data segments and the interned strings
+    /// in one relocatable block (offsets only, natives saved as built-in ids). A VM
+    /// with the same built-ins and no defined word can start from an image instead
+    /// of compiling its sources. Saving fails on natives added by the host, loading
+    /// fails on an image that was not made for these built-ins.
+    ///
+    /// An image can also hold only what was added since a mark (a fragment), it then
+    /// loads in a VM that is exactly at that mark.
+    ///
+    enum : uint32_t {
+        IMAGE_VERSION       = 3,
+    };
+
+    struct Mark {
+        uint32_t        wordCount;
+        uint32_t        codeSize;
+        uint32_t        dataSize;
+    };
 
+    inline Mark     mark() const                { return Mark{ wordCount(), static_cast<uint32_t>(wordSegment_.size()), static_cast<uint32_t>(constDataSegment_.size()) }; }
 
-    VM();
-    inline const Vector<Function>&              functions() const { return functions_; }
-    inline const HashMap<String, uint32_t>&     nameToWord() const { return nameToWord_; }
+    bool            saveImage(Vector<uint8_t>& image) const;
+    bool            saveImage(Vector<uint8_t>& image, const Mark& from) const;
+    bool            saveImage(const char* path, const Mark& from) const;
+    inline bool     saveImage(const char* path) const   { return saveImage(path, Mark{ builtinCount_, 0, 0 }); }
+    bool            loadImage(const uint8_t* image, size_t size);
+    bool            loadImage(const char* path);    // mapped, not read
 
-    const Vector<uint32_t>& wordSegment() const { return wordSegment_; }
+    // hash of the dictionary and of the segments up to a mark
+    uint64_t        fingerprint(const Mark& upTo) const;
+
+    inline const SymbolTable&                   symbols() const { return symbols_; }
+
+    const CodeSegment&  wordSegment() const { return wordSegment_; }
     inline uint32_t wordSegmentSize() const     { return wordSegment_.size(); }
     inline bool     isVerboseDebugging() const  { return verboseDebugging_; }
 
 private:
 
-    void            initPrimitives();
+    void            bindSymbol(const String& name, uint32_t wordId);
+    uint32_t        appendData(const void* data, uint32_t size);
+    int32_t         relocationAt(uint32_t addr) const;     // kind, -1 for none
+    uint32_t        builtinsHash() const;
+
+    inline bool     isShadowed(uint32_t word) const { return (shadowed_[word >> 5] >> (word & 31)) & 1; }
+
+    inline uint32_t functionEnd(const Function& func) const { return func.body.interpreted.end ? func.body.interpreted.end : static_cast<uint32_t>(wordSegment_.size()); }
+
+    ArenaAllocator                              arena_;         // has to outlive the containers below
+    PoolAllocator                               pool_;
+
+#ifdef FORTH_DENSE_CODE
+    ///
+    /// dense encoding: word ids are LEB128 varints (1 byte under 128 words, 2 bytes under 16K),
+    /// the lit.i32 operand is a zigzag LEB128 varint. The code segment stays the reference
+    /// for w@/w!/w& and addrMap_ maps its addresses to dense offsets for branches.
+    ///
+    void            translate(uint32_t idx);
+
+    static inline uint32_t
+    decodeVarint(const uint8_t* code, uint32_t& pos) {
+        uint32_t    b       = code[pos++];
+        uint32_t    v       = b & 0x7F;
+        uint32_t    shift   = 7;
+        while( b & 0x80 ) {
+            b       = code[pos++];
+            v      |= (b & 0x7F) << shift;
+            shift  += 7;
+        }
+        return v;
+    }
+
+    static inline uint32_t  zigzag(uint32_t v)      { return (v << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(v) >> 31); }
+    static inline uint32_t  unzigzag(uint32_t v)    { return (v >> 1) ^ (0 - (v & 1)); }
+
+    void            encodeVarint(uint32_t v);
+
+    static inline uint32_t
+    varintLength(uint32_t v) {
+        uint32_t    length  = 1;
+        while( v >= 0x80 ) {
+            v >>= 7;
+            ++length;
+        }
+        return length;
+    }
+
+    // w! into translated code: false when the encoding changes length (or shape)
+    bool            rewriteDense(const Function& func, uint32_t addr, uint32_t old, uint32_t word);
 
-    Vector<Function>                            functions_;
-    HashMap<String, uint32_t>                   nameToWord_;
+    Vector<uint8_t>                             denseSegment_;  // executable encoding of the code segment
+    Vector<uint32_t>                            addrMap_;       // code segment address -> dense segment offset
+    uint32_t                                    translatedEnd_; // code segment addresses below this may be translated
+#endif
+
+    const Builtins*                             builtins_;
+    uint32_t                                    builtinCount_;
+    uint32_t                                    shadowed_[MAX_BUILTINS / 32];  // built-ins redefined by a word
+
+    Vector<Function>                            functions_;     // defined words (id - builtinCount_)
+    SymbolTable                                 symbols_;       // interned word names
+    Vector<int32_t>                             symbolWords_;   // symbol -> latest word with that name
 
-    Vector<uint32_t>                            wordSegment_;    // the code segment
-    Vector<Process::Value>                      constDataSegment_;   // strings, names, ...
+    CodeSegment                                 wordSegment_;    // the code segment
+    DataSegment                                 constDataSegment_;   // strings, names, ... (byte addressed)
+    HashMap<String, uint32_t>                   stringPool_;    // interned string literals -> data segment address
+
+    enum : uint32_t {
+        NO_ADDRESS          = 0xFFFFFFFF,
+    };
 
+    Vector<uint32_t>                            relocations_;   // address << 1 | kind
+    uint32_t                                    pendingString_; // last interned string, until the next literal
+    uint32_t                                    pendingStringAt_;
+    bool                                        rawData_;       // emitData was used
+
+    size_t                                      memoryLimit_;   // checked between tokens and on emit, 0: no limit
+
+    LazyCompiler                                lazyCompiler_;
+    void*                                       lazyContext_;
+
+    Scheduler*                                  scheduler_;
+    bool                                        shared_;
 
     // debugging facilites
     bool                                        verboseDebugging_;
@@ -196,6 +580,12 @@ private:
     friend struct   Primitives;
 };
 
+#ifdef FORTH_EMBEDDED_BOOTSTRAP
+// image of bootstrap.f compiled at build time (bootgen.cpp)
+extern const uint8_t    BOOTSTRAP_IMAGE[];
+extern const size_t     BOOTSTRAP_IMAGE_SIZE;
+#endif
+
 struct Primitives {
     // primitives
     static void     fetchInt32      (VM::Process* proc);
@@ -204,6 +594,7 @@ struct Primitives {
 
     static void     printInt32      (VM::Process* proc);
     static void     printChar       (VM::Process* proc);
+    static void     printString     (VM::Process* proc);
     static void     addInt32        (VM::Process* proc);
     static void     subInt32        (VM::Process* proc);
     static void     mulInt32        (VM::Process* proc);
@@ -218,6 +609,7 @@ struct Primitives {
 
     static void     emitWord        (VM::Process* proc);
     static void     emitConstData   (VM::Process* proc);
+    static void     emitConstByte   (VM::Process* proc);
     static void     emitException   (VM::Process* proc);
 
     static void     ieq             (VM::Process* proc);
@@ -241,20 +633,126 @@ struct Primitives {
     static void     lsFetch         (VM::Process* proc);
     static void     wsFetch         (VM::Process* proc);
     static void     cdsFetch        (VM::Process* proc);
+    static void     cdsFetchByte    (VM::Process* proc);
 
     static void     vsStore         (VM::Process* proc);
     static void     lsStore         (VM::Process* proc);
     static void     wsStore         (VM::Process* proc);
     static void     cdsStore        (VM::Process* proc);
+    static void     cdsStoreByte    (VM::Process* proc);
 
     static void     bye             (VM::Process* proc);
     static void     exit            (VM::Process* proc);
 
+    // processes
     static void     pid             (VM::Process* proc);
+    static void     spawn           (VM::Process* proc);
+    static void     yield           (VM::Process* proc);
+    static void     join            (VM::Process* proc);
+
+    // channels
+    static void     newChannel      (VM::Process* proc);
+    static void     newSpscChannel  (VM::Process* proc);
+    static void     mailbox         (VM::Process* proc);
+    static void     send            (VM::Process* proc);
+    static void     receive         (VM::Process* proc);
+    static void     tryReceive      (VM::Process* proc);
+    static void     select          (VM::Process* proc);
+
+    // true when the channel word can try again (the host ran the others)
+    static bool     waitChannels    (VM::Process* proc, uint32_t word, const uint32_t* ids, uint32_t count, uint32_t kind);
 
     // debug helpers
     static void     showValueStack  (VM::Process* proc);
     static void     setDebugMode    (VM::Process* proc);
 };
+
+///
+/// the VM primitives in word id order (lit.i32 and return have to stay 0 and 1)
+///
+constexpr VM::Builtin PRIMITIVE_WORDS[] = {
+    { "lit.i32"     , Primitives::fetchInt32    , false },
+    { "return"      , Primitives::returnWord    , false },
+    { "#"           , Primitives::callIndirect  , false },
+    { "."           , Primitives::printInt32    , false },
+    { ".c"          , Primitives::printChar     , false },
+    { "+"           , Primitives::addInt32      , false },
+    { "-"           , Primitives::subInt32      , false },
+    { "*"           , Primitives::mulInt32      , false },
+    { "/"           , Primitives::divInt32      , false },
+    { "%"           , Primitives::modInt32      , false },
+    { "branch"      , Primitives::branch        , false },  // ( addr -- )
+    { "?branch"     , Primitives::branchIf      , false },  // ( cond addr -- )
+    { "dup"         , Primitives::dup           , false },
+    { "drop"        , Primitives::drop          , false },
+    { "swap"        , Primitives::swap          , false },
+    { "code.size"   , Primitives::codeSize      , false },
+    { "w>"          , Primitives::emitWord      , false },
+    { "cd>"         , Primitives::emitConstData , false },
+    { "cb>"         , Primitives::emitConstByte , false },
+    { "e>"          , Primitives::emitException , false },
+
+    { "=="          , Primitives::ieq           , false },
+    { "=/="         , Primitives::ineq          , false },
+    { ">"           , Primitives::igt           , false },
+    { "<"           , Primitives::ilt           , false },
+    { ">="          , Primitives::igeq          , false },
+    { "<="          , Primitives::ileq          , false },
+    { "not"         , Primitives::notBW         , false },
+    { "and"         , Primitives::andBW         , false },
+    { "or"          , Primitives::orBW          , false },
+
+    { "v&"          , Primitives::vsPtr         , false },
+    { "r&"          , Primitives::rsPtr         , false },
+    { "w&"          , Primitives::wsPtr         , false },
+    { "cd&"         , Primitives::cdsPtr        , false },
+    { "@"           , Primitives::vsFetch       , false },
+    { "r@"          , Primitives::rsFetch       , false },
+    { "w@"          , Primitives::wsFetch       , false },
+    { "l@"          , Primitives::lsFetch       , false },
+    { "cd@"         , Primitives::cdsFetch      , false },
+    { "cb@"         , Primitives::cdsFetchByte  , false },
+    { "!"           , Primitives::vsStore       , false },
+    { "w!"          , Primitives::wsStore       , false },
+    { "l!"          , Primitives::lsStore       , false },
+    { "cd!"         , Primitives::cdsStore      , false },
+    { "cb!"         , Primitives::cdsStoreByte  , false },
+    { ".cd"         , Primitives::printString   , false },
+
+    { "bye"         , Primitives::bye           , false },
+    { "exit"        , Primitives::exit          , false },
+
+    { "pid"         , Primitives::pid           , false },  // ( -- pid )
+    { "spawn"       , Primitives::spawn         , false },  // ( word -- pid )
+    { "yield"       , Primitives::yield         , false },  // ( -- )
+    { "join"        , Primitives::join          , false },  // ( pid -- )
+
+    { "channel"     , Primitives::newChannel    , false },  // ( capacity -- ch ) any number of senders and receivers
+    { "channel.spsc", Primitives::newSpscChannel, false },  // ( capacity -- ch ) one sender, one receiver
+    { "mailbox"     , Primitives::mailbox       , false },  // ( pid -- ch )
+    { "send"        , Primitives::send          , false },  // ( value ch -- )
+    { "receive"     , Primitives::receive       , false },  // ( ch -- value )
+    { "try-receive" , Primitives::tryReceive    , false },  // ( ch -- value -1 | 0 )
+    { "select"      , Primitives::select        , false },  // ( ch1 .. chn n -- value ch )
+
+    { ".s"          , Primitives::showValueStack, false },
+    { "deb.set"     , Primitives::setDebugMode  , false },
+};
+
+enum : uint32_t {
+    PRIMITIVE_COUNT = sizeof(PRIMITIVE_WORDS) / sizeof(PRIMITIVE_WORDS[0]),
+};
+
+constexpr bool
+sameName(const char* a, const char* b) {
+    return *a == *b && (*a == '\0' || sameName(a + 1, b + 1));
+}
+
+// word id of a primitive for the compile time constants, PRIMITIVE_COUNT if there is none
+constexpr uint32_t
+primitiveId(const char* name, uint32_t i = 0) {
+    return (i == PRIMITIVE_COUNT || sameName(PRIMITIVE_WORDS[i].name, name)) ? i : primitiveId(name, i + 1);
+}
+
 } // namespace SM
 #endif